@@ -1,3 +1,5 @@
+#include <vector>
+
 #include "Camera.h"
 
 Camera::Camera(int id, const char *imageName, const vec3f &pos,
@@ -8,6 +10,8 @@ Camera::Camera(int id, const char *imageName, const vec3f &pos,
     right = giraffe::cross(gaze, up);
     imageCenter = pos + imgPlane.distance * gaze;
     imageTopLeft = imageCenter + imgPlane.left * right + imgPlane.top * up;
+    pixelSpread =
+        (imgPlane.right - imgPlane.left) / imgPlane.nx / imgPlane.distance;
 }
 
 Ray Camera::getPrimaryRay(int col, int row) const
@@ -20,5 +24,31 @@ Ray Camera::getPrimaryRay(int col, int row) const
     vec3f origin = pos;
     vec3f direction = (pixelPos - pos).normalize();
 
-    return Ray(origin, direction);
+    Ray ray(origin, direction);
+    ray.coneSpread = pixelSpread;
+
+    return ray;
+}
+
+void Camera::getPrimaryRays(int col, int rowBegin, int rowEnd, Ray *rays) const
+{
+    const std::size_t count = rowEnd - rowBegin;
+    std::vector<float> us(count), vs(count);
+    std::vector<vec3f> pixels(count), directions(count);
+
+    float u = (col + 0.5) * (imgPlane.right - imgPlane.left) / imgPlane.nx;
+    for (std::size_t i = 0; i < count; ++i) {
+        us[i] = u;
+        vs[i] = (rowBegin + i + 0.5) * (imgPlane.top - imgPlane.bottom) /
+                imgPlane.ny;
+    }
+
+    giraffe::lerp_plane(imageTopLeft, right, up, us.data(), vs.data(),
+                        pixels.data(), count);
+    giraffe::directions_from(pos, pixels.data(), directions.data(), count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        rays[i] = Ray(pos, directions[i]);
+        rays[i].coneSpread = pixelSpread;
+    }
 }
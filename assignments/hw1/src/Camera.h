@@ -30,8 +30,21 @@ class Camera
            const vec3f &up,             // Camera up direction
            const ImagePlane &imgPlane); // Image plane parameters
 
+    const vec3f &getPosition() const { return pos; }
+    const vec3f &getGaze() const { return gaze; }
+    const vec3f &getUp() const { return up; }
+    // The primary ray through image plane coordinates (u, v), measured from
+    // the top left corner, points toward getImageTopLeft() + u * getRight()
+    // - v * getUp().
+    const vec3f &getRight() const { return right; }
+    const vec3f &getImageTopLeft() const { return imageTopLeft; }
+
     Ray getPrimaryRay(int row, int col) const;
 
+    // Fills rays[0 .. rowEnd - rowBegin) with the primary rays of the given
+    // column, from rowBegin (inclusive) to rowEnd (exclusive).
+    void getPrimaryRays(int col, int rowBegin, int rowEnd, Ray *rays) const;
+
   private:
     vec3f pos;
     vec3f gaze;
@@ -39,6 +52,7 @@ class Camera
     vec3f right;
     vec3f imageCenter;
     vec3f imageTopLeft;
+    float pixelSpread; // Width of a pixel per unit of distance from pos
 };
 
 #endif
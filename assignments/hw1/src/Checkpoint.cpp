@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+
+// Start of a checkpoint file. Finished tiles follow in the order they
+// finished, each a CheckpointRecord and then its pixels row by row.
+struct CheckpointHeader {
+    char magic[8];
+    std::uint64_t key;
+    std::int32_t width, height, tileSize;
+    std::int32_t unused;
+};
+
+struct CheckpointRecord {
+    std::int32_t tile;
+    std::uint32_t bytes;    // Of the pixels that follow
+    std::uint64_t checksum; // FNV-1a of those pixels
+};
+
+static constexpr char MAGIC[8] = {'C', 'H', 'E', 'C', 'K', 'P', 'T', '1'};
+
+static std::uint64_t checksum(const void *data, std::size_t size)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    std::uint64_t hash = 14695981039346656037ull;
+
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+Checkpoint::Checkpoint(const std::string &path, Image &image, int tileSize,
+                       std::uint64_t key, bool resume, double interval)
+    : path(path), width(image.width), height(image.height),
+      tileSize(tileSize), columns((image.width + tileSize - 1) / tileSize),
+      key(key),
+      done(std::size_t(columns) * ((image.height + tileSize - 1) / tileSize)),
+      interval(interval), lastSync(std::chrono::steady_clock::now())
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        throw std::runtime_error("cannot open checkpoint " + path + ": " +
+                                 strerror(errno));
+
+    try {
+        if (resume && load(image))
+            return;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.key = key;
+    header.width = width;
+    header.height = height;
+    header.tileSize = tileSize;
+
+    if (ftruncate(fd, 0) == -1 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        const std::string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("cannot write checkpoint " + path + ": " +
+                                 error);
+    }
+
+    end = sizeof(header);
+}
+
+Checkpoint::~Checkpoint() { close(fd); }
+
+Tile Checkpoint::tile(int i) const
+{
+    const int x0 = i % columns * tileSize;
+    const int y0 = i / columns * tileSize;
+
+    return {x0, y0, std::min(x0 + tileSize, width),
+            std::min(y0 + tileSize, height)};
+}
+
+// Copies the tiles of the checkpoint already in the file into image, up to
+// the first one that is cut short or damaged, and drops everything from
+// there on. Returns false if the file is not a checkpoint of this image.
+bool Checkpoint::load(Image &image)
+{
+    CheckpointHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) ||
+        header.key != key || header.width != width ||
+        header.height != height || header.tileSize != tileSize)
+        return false;
+
+    end = sizeof(header);
+
+    CheckpointRecord record;
+    std::vector<Color> pixels;
+
+    while (pread(fd, &record, sizeof(record), end) == sizeof(record)) {
+        if (record.tile < 0 || record.tile >= tileCount())
+            break;
+
+        const Tile t = tile(record.tile);
+        const int w = t.x1 - t.x0;
+        const int h = t.y1 - t.y0;
+        if (record.bytes != std::size_t(w) * h * sizeof(Color))
+            break;
+
+        pixels.resize(std::size_t(w) * h);
+        if (pread(fd, pixels.data(), record.bytes, end + sizeof(record)) !=
+                record.bytes ||
+            checksum(pixels.data(), record.bytes) != record.checksum)
+            break;
+
+        for (int y = 0; y < h; ++y)
+            std::copy(&pixels[std::size_t(y) * w],
+                      &pixels[std::size_t(y) * w] + w,
+                      image.data[t.y0 + y - image.originY] + t.x0 -
+                          image.originX);
+
+        if (!done[record.tile]) {
+            done[record.tile] = true;
+            restored += std::size_t(w) * h;
+        }
+
+        end += sizeof(record) + record.bytes;
+    }
+
+    if (ftruncate(fd, end) == -1)
+        throw std::runtime_error("cannot write checkpoint " + path + ": " +
+                                 strerror(errno));
+
+    return true;
+}
+
+void Checkpoint::save(int i, const Color *pixels)
+{
+    const Tile t = tile(i);
+
+    CheckpointRecord record;
+    record.tile = i;
+    record.bytes = (t.x1 - t.x0) * (t.y1 - t.y0) * sizeof(Color);
+    record.checksum = checksum(pixels, record.bytes);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (pwrite(fd, &record, sizeof(record), end) != sizeof(record) ||
+        pwrite(fd, pixels, record.bytes, end + sizeof(record)) !=
+            record.bytes)
+        throw std::runtime_error("cannot write checkpoint " + path + ": " +
+                                 strerror(errno));
+
+    end += sizeof(record) + record.bytes;
+
+    // Tiles written so far survive the process dying anyway; syncing makes
+    // them survive the machine going away too.
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastSync >= interval) {
+        if (fdatasync(fd) == -1)
+            throw std::runtime_error("cannot sync checkpoint " + path + ": " +
+                                     strerror(errno));
+        lastSync = now;
+    }
+}
+
+void Checkpoint::remove() { unlink(path.c_str()); }
@@ -0,0 +1,65 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+#include "Scene.h"
+
+// Finished tiles of one camera's image, appended to a file as they finish,
+// so that a render that dies part way, on a crash or a preempted machine,
+// can start again from the tiles it had. Each tile is checksummed, so a
+// tile cut short by the crash is rendered again rather than trusted.
+class Checkpoint
+{
+  public:
+    // Checkpoint at path for image, split into tiles tileSize pixels square,
+    // in a scene whose image key is key (see Scene::imageKey). With resume,
+    // the tiles a checkpoint already at path holds for the same image are
+    // copied into image and count as done; otherwise, or if the file was
+    // for another image, it starts empty. Finished tiles are flushed to disk
+    // at most interval seconds apart. Throws std::runtime_error if path
+    // cannot be written.
+    Checkpoint(const std::string &path, Image &image, int tileSize,
+               std::uint64_t key, bool resume, double interval);
+    ~Checkpoint();
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    int tileCount() const { return done.size(); }
+    Tile tile(int i) const;
+    bool isDone(int i) const { return done[i]; }
+
+    // Pixels copied into the image when it was resumed.
+    std::size_t restoredPixels() const { return restored; }
+
+    // Records tile i as finished, with its pixels row by row. May be called
+    // from several threads at once. Throws std::runtime_error if the file
+    // cannot be written.
+    void save(int i, const Color *pixels);
+
+    // Deletes the file, once the image it was for is saved.
+    void remove();
+
+  private:
+    bool load(Image &image);
+
+    std::string path;
+    int fd;
+    int width, height, tileSize, columns;
+    std::uint64_t key;
+    std::vector<bool> done; // Only changed while loading
+    std::size_t restored = 0;
+
+    std::mutex mutex; // Guards what follows
+    std::size_t end;  // Where the next tile goes
+    std::chrono::duration<double> interval;
+    std::chrono::steady_clock::time_point lastSync;
+};
+
+#endif
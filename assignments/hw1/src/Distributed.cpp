@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Camera.h"
+#include "Distributed.h"
+#include "Image.h"
+#include "Scene.h"
+#include "SceneCache.h"
+#include "ThreadPool.h"
+
+// A tile that fails this many times fails the render, and a worker that
+// fails this many tiles in a row is dropped.
+static constexpr int MAX_TILE_ERRORS = 3;
+
+// Seconds a worker may take over a tile before it is given up on, scene
+// loading included, even if no other worker is free to race it.
+static constexpr double TILE_TIMEOUT = 3;
+
+static bool send_all(int fd, const void *buffer, std::size_t size)
+{
+    auto bytes = static_cast<const char *>(buffer);
+
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+// Splits "[host:]port" into an IPv4 socket address.
+static sockaddr_in parse_endpoint(const std::string &endpoint)
+{
+    std::string host = "127.0.0.1", port = endpoint;
+
+    auto colon = endpoint.rfind(':');
+    if (colon != std::string::npos) {
+        host = endpoint.substr(0, colon);
+        port = endpoint.substr(colon + 1);
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(port.c_str()));
+
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1 ||
+        address.sin_port == 0)
+        throw std::runtime_error("bad endpoint " + endpoint);
+
+    return address;
+}
+
+void serve_tiles(int fd, SceneCache &cache, ThreadPool &pool)
+{
+    FILE *in = fdopen(dup(fd), "r");
+    char *line = nullptr;
+    std::size_t capacity = 0;
+
+    // A coordinator sends the same scene for every tile, so it is only
+    // looked up again when the path changes.
+    std::string scenePath;
+    Scene *scene = nullptr;
+
+    while (getline(&line, &capacity, in) != -1) {
+        TileHeader header = {-1, -1, -1, -1};
+        std::vector<unsigned char> reply(sizeof(header));
+        int cameraIdx, offset = 0;
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (sscanf(line, "tile %d %d %d %d %d %n", &cameraIdx, &header.x0,
+                   &header.y0, &header.x1, &header.y1, &offset) == 5 &&
+            offset > 0) {
+            try {
+                if (!scene || scenePath != line + offset) {
+                    bool cached;
+                    scene = nullptr;
+                    scene = cache.load(line + offset, cached);
+                    scenePath = line + offset;
+                }
+
+                if (cameraIdx < 0 || cameraIdx >= int(scene->cameras.size()) ||
+                    header.x0 >= header.x1 || header.y0 >= header.y1)
+                    throw std::runtime_error("bad tile");
+
+                const Tile tile = {header.x0, header.y0, header.x1,
+                                   header.y1};
+                reply.resize(sizeof(header) + (tile.x1 - tile.x0) *
+                                                  (tile.y1 - tile.y0) *
+                                                  sizeof(Color));
+                scene->render(scene->cameras[cameraIdx], tile,
+                              reply.data() + sizeof(header), pool);
+            } catch (const std::exception &e) {
+                std::cerr << "worker: " << e.what() << "\n";
+                header = {-1, -1, -1, -1};
+                reply.resize(sizeof(header));
+            }
+        }
+
+        // One send for header and pixels, so small tiles are not held back
+        // by Nagle's algorithm.
+        memcpy(reply.data(), &header, sizeof(header));
+        if (!send_all(fd, reply.data(), reply.size()))
+            break;
+    }
+
+    free(line);
+    fclose(in);
+}
+
+void listen_tiles(const char *endpoint, unsigned int num_threads,
+                  const SceneOptions &options)
+{
+    sockaddr_in address = parse_endpoint(endpoint);
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == -1)
+        throw std::runtime_error("socket: " + std::string(strerror(errno)));
+
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    if (bind(server, (sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(server, 8) == -1) {
+        close(server);
+        throw std::runtime_error(std::string(endpoint) + ": " +
+                                 strerror(errno));
+    }
+
+    SceneCache cache(1, options);
+    ThreadPool pool(num_threads);
+
+    for (;;) {
+        int client = accept(server, nullptr, nullptr);
+        if (client == -1)
+            continue;
+
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        serve_tiles(client, cache, pool);
+        close(client);
+    }
+}
+
+TileCoordinator::TileCoordinator(int tileSize, double slowFactor,
+                                 const SceneOptions &options)
+    : tileSize(std::max(tileSize, 1)), slowFactor(slowFactor), options(options)
+{
+}
+
+TileCoordinator::~TileCoordinator()
+{
+    for (auto &worker : workers) {
+        if (worker.alive)
+            close(worker.fd);
+    }
+
+    for (auto &worker : workers) {
+        if (worker.pid != -1)
+            waitpid(worker.pid, nullptr, 0);
+    }
+}
+
+void TileCoordinator::spawnWorker(unsigned int num_threads)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw std::runtime_error("socketpair: " +
+                                 std::string(strerror(errno)));
+
+    pid_t pid = fork();
+    if (pid == -1)
+        throw std::runtime_error("fork: " + std::string(strerror(errno)));
+
+    if (pid == 0) {
+        close(fds[0]);
+        for (auto &worker : workers) {
+            if (worker.alive)
+                close(worker.fd);
+        }
+
+        {
+            SceneCache cache(1, options);
+            ThreadPool pool(num_threads);
+            serve_tiles(fds[1], cache, pool);
+        }
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    Worker worker;
+    worker.name = "local:" + std::to_string(pid);
+    worker.fd = fds[0];
+    worker.pid = pid;
+    workers.push_back(std::move(worker));
+}
+
+void TileCoordinator::connectWorker(const std::string &endpoint)
+{
+    sockaddr_in address = parse_endpoint(endpoint);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        throw std::runtime_error("socket: " + std::string(strerror(errno)));
+
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        throw std::runtime_error(endpoint + ": " + strerror(errno));
+    }
+
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    Worker worker;
+    worker.name = endpoint;
+    worker.fd = fd;
+    workers.push_back(std::move(worker));
+}
+
+bool TileCoordinator::assign(Worker &worker, int tile)
+{
+    Tile &t = tiles[tile];
+    const TileHeader &r = t.rect;
+
+    std::string request = "tile " + std::to_string(cameraIdx) + " " +
+                          std::to_string(r.x0) + " " + std::to_string(r.y0) +
+                          " " + std::to_string(r.x1) + " " +
+                          std::to_string(r.y1) + " " + scenePath + "\n";
+
+    if (!send_all(worker.fd, request.data(), request.size())) {
+        fail(worker);
+        return false;
+    }
+
+    worker.busy = true;
+    worker.generation = generation;
+    worker.tile = tile;
+    worker.rect = r;
+    worker.sent = Clock::now();
+    worker.inbox.clear();
+
+    if (t.inFlight++ == 0 && !t.duplicated)
+        t.firstSent = worker.sent;
+
+    return true;
+}
+
+void TileCoordinator::fail(Worker &worker)
+{
+    std::cerr << "coordinator: worker " << worker.name << " failed\n";
+
+    close(worker.fd);
+    worker.alive = false;
+    ++worker.failures;
+
+    if (worker.busy && worker.generation == generation) {
+        Tile &t = tiles[worker.tile];
+
+        if (--t.inFlight == 0 && !t.done)
+            pending.push_front(worker.tile);
+    }
+
+    worker.busy = false;
+}
+
+// Puts the tile back after the worker answered that it could not render it.
+// The worker stays in use unless that keeps happening.
+void TileCoordinator::reject(Worker &worker)
+{
+    std::cerr << "coordinator: worker " << worker.name
+              << " could not render a tile\n";
+
+    ++worker.tileErrors;
+    if (++worker.errorsInARow >= MAX_TILE_ERRORS) {
+        fail(worker);
+        return;
+    }
+
+    worker.busy = false;
+
+    if (worker.generation != generation)
+        return;
+
+    Tile &t = tiles[worker.tile];
+    --t.inFlight;
+    if (t.done)
+        return;
+
+    if (++t.errors >= MAX_TILE_ERRORS)
+        throw std::runtime_error(
+            "tile at " + std::to_string(t.rect.x0) + "," +
+            std::to_string(t.rect.y0) + " failed " +
+            std::to_string(t.errors) + " times");
+
+    if (t.inFlight == 0)
+        pending.push_back(worker.tile);
+}
+
+void TileCoordinator::receive(Worker &worker, Image &image)
+{
+    unsigned char buffer[1 << 16];
+    ssize_t received = read(worker.fd, buffer, sizeof(buffer));
+
+    if (received == -1 && errno == EINTR)
+        return;
+    if (received <= 0 || !worker.busy) {
+        fail(worker);
+        return;
+    }
+
+    worker.inbox.insert(worker.inbox.end(), buffer, buffer + received);
+
+    if (worker.inbox.size() < sizeof(TileHeader))
+        return;
+
+    TileHeader header;
+    memcpy(&header, worker.inbox.data(), sizeof(header));
+
+    if (header.x0 == -1 && header.y0 == -1 && header.x1 == -1 &&
+        header.y1 == -1) {
+        if (worker.inbox.size() > sizeof(header))
+            fail(worker);
+        else
+            reject(worker);
+        return;
+    }
+
+    const TileHeader &r = worker.rect;
+    if (header.x0 != r.x0 || header.y0 != r.y0 || header.x1 != r.x1 ||
+        header.y1 != r.y1) {
+        fail(worker);
+        return;
+    }
+
+    const int width = r.x1 - r.x0, height = r.y1 - r.y0;
+    const std::size_t size = sizeof(TileHeader) + width * height * 3;
+
+    if (worker.inbox.size() < size)
+        return;
+    if (worker.inbox.size() > size) {
+        fail(worker);
+        return;
+    }
+
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - worker.sent).count();
+    worker.busy = false;
+    worker.busySeconds += seconds;
+    worker.errorsInARow = 0;
+
+    // A reply for a camera that is already finished, from a worker that was
+    // straggling at the time.
+    if (worker.generation != generation) {
+        ++worker.tilesWasted;
+        return;
+    }
+
+    Tile &t = tiles[worker.tile];
+    --t.inFlight;
+
+    if (t.done) {
+        ++worker.tilesWasted;
+        return;
+    }
+
+    const unsigned char *pixels = worker.inbox.data() + sizeof(TileHeader);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const unsigned char *p = pixels + 3 * (y * width + x);
+            image.setPixelValue(r.x0 + x, r.y0 + y, {p[0], p[1], p[2]});
+        }
+    }
+
+    t.done = true;
+    ++tilesDone;
+    tileSeconds += seconds;
+    ++worker.tilesDone;
+    worker.pixelsDone += width * height;
+}
+
+// Returns a tile that has been in flight for much longer than average and has
+// not been duplicated yet, or -1.
+int TileCoordinator::straggler() const
+{
+    if (tilesDone == 0)
+        return -1;
+
+    const double limit = slowFactor * tileSeconds / tilesDone;
+    const auto now = Clock::now();
+
+    for (std::size_t i = 0; i < tiles.size(); ++i) {
+        const Tile &t = tiles[i];
+
+        if (!t.done && !t.duplicated && t.inFlight > 0 &&
+            std::chrono::duration<double>(now - t.firstSent).count() > limit)
+            return i;
+    }
+
+    return -1;
+}
+
+void TileCoordinator::render(const char *xmlPath)
+{
+    // Workers may run in another directory, so hand them an absolute path.
+    char resolved[PATH_MAX];
+    scenePath = realpath(xmlPath, resolved) ? resolved : xmlPath;
+
+    // Only the cameras are needed here, the workers parse the scene.
+    const std::vector<Camera> cameras = load_cameras(xmlPath);
+
+    for (cameraIdx = 0; cameraIdx < int(cameras.size()); ++cameraIdx) {
+        const Camera *camera = &cameras[cameraIdx];
+        const int width = camera->imgPlane.nx, height = camera->imgPlane.ny;
+
+        Image image(width, height);
+
+        ++generation;
+        tiles.clear();
+        pending.clear();
+        tilesDone = 0;
+        tileSeconds = 0;
+
+        for (int y = 0; y < height; y += tileSize) {
+            for (int x = 0; x < width; x += tileSize) {
+                Tile t;
+                t.rect = {x, y, std::min(x + tileSize, width),
+                          std::min(y + tileSize, height)};
+                pending.push_back(tiles.size());
+                tiles.push_back(t);
+            }
+        }
+
+        while (tilesDone < tiles.size()) {
+            for (auto &worker : workers) {
+                if (!worker.alive || worker.busy)
+                    continue;
+
+                if (!pending.empty()) {
+                    int tile = pending.front();
+                    pending.pop_front();
+                    if (!assign(worker, tile))
+                        pending.push_front(tile);
+                } else {
+                    int tile = straggler();
+                    if (tile != -1) {
+                        tiles[tile].duplicated = true;
+                        assign(worker, tile);
+                    }
+                }
+            }
+
+            std::vector<pollfd> fds;
+            std::vector<Worker *> polled;
+            for (auto &worker : workers) {
+                if (worker.alive && worker.busy) {
+                    fds.push_back({worker.fd, POLLIN, 0});
+                    polled.push_back(&worker);
+                }
+            }
+
+            if (fds.empty())
+                throw std::runtime_error("no workers left");
+
+            if (poll(fds.data(), fds.size(), 50) > 0) {
+                for (std::size_t i = 0; i < fds.size(); ++i) {
+                    if (fds[i].revents)
+                        receive(*polled[i], image);
+                }
+            }
+
+            const auto now = Clock::now();
+            for (auto worker : polled) {
+                if (worker->alive && worker->busy &&
+                    std::chrono::duration<double>(now - worker->sent)
+                            .count() > TILE_TIMEOUT) {
+                    std::cerr << "coordinator: worker " << worker->name
+                              << " timed out\n";
+                    if (worker->pid != -1)
+                        kill(worker->pid, SIGKILL);
+                    fail(*worker);
+                }
+            }
+        }
+
+        image.saveImage(camera->imageName.c_str());
+    }
+}
+
+void TileCoordinator::printReport(std::ostream &out) const
+{
+    for (const auto &worker : workers) {
+        double mpixels = worker.pixelsDone / 1e6;
+
+        out << worker.name << ": " << worker.tilesDone << " tiles, "
+            << mpixels << " Mpixels in " << worker.busySeconds << " s ("
+            << (worker.busySeconds > 0 ? mpixels / worker.busySeconds : 0)
+            << " Mpixels/s), " << worker.tilesWasted << " wasted, "
+            << worker.tileErrors << " errors, " << worker.failures
+            << " failures\n";
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef _DISTRIBUTED_H_
+#define _DISTRIBUTED_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "Scene.h"
+
+class Image;
+class SceneCache;
+class ThreadPool;
+
+// Tile protocol, spoken over any stream socket:
+//
+//   coordinator -> worker: "tile <camera> <x0> <y0> <x1> <y1> <scene.xml>\n"
+//   worker -> coordinator: a TileHeader, then (x1 - x0) * (y1 - y0) RGB
+//                          triples, row by row
+//
+// The camera is an index into Scene::cameras, and the tile covers columns
+// [x0, x1) and rows [y0, y1) of its frame. A worker that cannot render the
+// tile answers with a header of all -1 and no pixels. Headers are sent in
+// host byte order, so coordinator and workers must share an architecture.
+struct TileHeader {
+    std::int32_t x0, y0, x1, y1;
+};
+
+// Serves tile requests read from fd until the peer disconnects. A scene is
+// loaded once per connection, so edits to its file while the connection is
+// open are not seen.
+void serve_tiles(int fd, SceneCache &cache, ThreadPool &pool);
+
+// Listens on the TCP endpoint "[host:]port" (host defaults to 127.0.0.1) and
+// serves one coordinator at a time, forever.
+void listen_tiles(const char *endpoint, unsigned int num_threads,
+                  const SceneOptions &options = SceneOptions());
+
+// Renders scenes by splitting each camera's frame into tiles and farming them
+// out to worker processes. Workers are either forked locally or reached over
+// TCP. Tiles of a worker that disconnects, times out or fails are put back in
+// the queue, and so are tiles a worker answers with an error, though that
+// worker is kept unless it keeps erring. Once the queue is empty, tiles that
+// take much longer than average are duplicated on idle workers; whichever
+// copy arrives first is kept.
+class TileCoordinator
+{
+  public:
+    // Tiles in flight longer than slowFactor times the average tile time are
+    // considered straggling. Options apply to the coordinator's own copy of
+    // the scene and to spawned workers.
+    TileCoordinator(int tileSize, double slowFactor,
+                    const SceneOptions &options = SceneOptions());
+    ~TileCoordinator();
+
+    TileCoordinator(const TileCoordinator &) = delete;
+    TileCoordinator &operator=(const TileCoordinator &) = delete;
+
+    // Forks a worker process connected through a socket pair. Must be called
+    // before the calling process starts any threads.
+    void spawnWorker(unsigned int num_threads);
+
+    // Connects to a worker listening on "host:port".
+    void connectWorker(const std::string &endpoint);
+
+    // Renders every camera of the scene and writes their images. Throws
+    // std::runtime_error if every worker has failed, or a tile keeps failing.
+    void render(const char *xmlPath);
+
+    // Per-worker tile counts and throughput, accumulated over all renders.
+    void printReport(std::ostream &out) const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Tile {
+        TileHeader rect;
+        bool done = false;
+        int inFlight = 0; // Workers currently rendering this tile
+        bool duplicated = false;
+        int errors = 0; // Error replies from workers
+        Clock::time_point firstSent;
+    };
+
+    struct Worker {
+        std::string name;
+        int fd;
+        pid_t pid = -1; // For spawned workers
+        bool alive = true;
+
+        // Assignment in flight, if busy. The generation tells replies for
+        // an earlier camera apart from current ones.
+        bool busy = false;
+        unsigned long generation;
+        int tile;
+        TileHeader rect;
+        Clock::time_point sent;
+        std::vector<unsigned char> inbox;
+
+        unsigned long tilesDone = 0;
+        unsigned long tilesWasted = 0; // Lost a race against a duplicate
+        unsigned long pixelsDone = 0;
+        unsigned long tileErrors = 0; // Tiles answered with an error
+        int errorsInARow = 0;
+        unsigned long failures = 0;
+        double busySeconds = 0;
+    };
+
+    bool assign(Worker &worker, int tile);
+    void fail(Worker &worker);
+    void reject(Worker &worker);
+    void receive(Worker &worker, Image &image);
+    int straggler() const;
+
+    int tileSize;
+    double slowFactor;
+    SceneOptions options;
+    std::vector<Worker> workers;
+
+    // State of the camera being rendered.
+    std::string scenePath;
+    int cameraIdx;
+    unsigned long generation = 0;
+    std::vector<Tile> tiles;
+    std::deque<int> pending;
+    std::size_t tilesDone;
+    double tileSeconds; // Summed over completed tiles, for the average
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <new>
+#include <queue>
+#include <vector>
+
+#include "FlatBVH.h"
+#include "RayPacket.h"
+
+using giraffe::vec4f;
+
+static constexpr std::size_t PAGE_SIZE = 4096;
+
+struct FlatBVH::Query {
+    const Ray &ray;
+    vec4f origin, invDirection;
+};
+
+// Node of the source hierarchy, numbered in pre-order.
+struct SourceNode {
+    const BVH *bvh;
+    std::int32_t child[2]; // -1 for the children of leaves
+    int height;            // 1 for leaves
+};
+
+static std::int32_t collect(const BVH *bvh, std::vector<SourceNode> &tree)
+{
+    const std::int32_t idx = tree.size();
+    tree.push_back({bvh, {-1, -1}, 1});
+
+    if (!bvh->isLeaf()) {
+        std::int32_t left = collect(static_cast<const BVH *>(bvh->left), tree);
+        std::int32_t right =
+            collect(static_cast<const BVH *>(bvh->right), tree);
+
+        tree[idx].child[0] = left;
+        tree[idx].child[1] = right;
+        tree[idx].height =
+            1 + std::max(tree[left].height, tree[right].height);
+    }
+
+    return idx;
+}
+
+// Nodes depth levels below node.
+static void level(const std::vector<SourceNode> &tree, std::int32_t node,
+                  int depth, std::vector<std::int32_t> &nodes)
+{
+    if (depth == 0) {
+        nodes.push_back(node);
+        return;
+    }
+
+    for (auto child : tree[node].child)
+        if (child >= 0)
+            level(tree, child, depth - 1, nodes);
+}
+
+// Van Emde Boas order of the top height levels of node's subtree: the upper
+// half of the levels first, then each subtree hanging below it, each laid out
+// the same way. Any subtree of k levels then spans about k / log(B) blocks of
+// B nodes, whatever B is.
+static void van_emde_boas(const std::vector<SourceNode> &tree,
+                          std::int32_t node, int height,
+                          std::vector<std::int32_t> &order)
+{
+    if (height == 1) {
+        order.push_back(node);
+        return;
+    }
+
+    const int top = height / 2;
+    van_emde_boas(tree, node, top, order);
+
+    std::vector<std::int32_t> bottoms;
+    level(tree, node, top, bottoms);
+    for (auto bottom : bottoms)
+        van_emde_boas(tree, bottom, height - top, order);
+}
+
+// Page-sized treelets: starting from a root, the page is filled with the
+// nodes whose boxes are largest, and so most likely to be visited, among
+// those reachable from what is already in it. Whatever does not fit roots
+// the next treelets.
+static void treelets(const std::vector<SourceNode> &tree, std::size_t per_page,
+                     std::vector<std::int32_t> &order)
+{
+    auto smaller = [&tree](std::int32_t a, std::int32_t b) {
+        return tree[a].bvh->bounding_box.surfaceArea() <
+               tree[b].bvh->bounding_box.surfaceArea();
+    };
+
+    std::queue<std::int32_t> roots;
+    roots.push(0);
+
+    while (!roots.empty()) {
+        std::priority_queue<std::int32_t, std::vector<std::int32_t>,
+                            decltype(smaller)>
+            frontier(smaller);
+        frontier.push(roots.front());
+        roots.pop();
+
+        // A treelet that runs out of nodes leaves the rest of its page to
+        // the next one, so that pages stay full.
+        std::size_t room = per_page - order.size() % per_page;
+        while (!frontier.empty() && room > 0) {
+            const std::int32_t node = frontier.top();
+            frontier.pop();
+            order.push_back(node);
+            --room;
+
+            for (auto child : tree[node].child)
+                if (child >= 0)
+                    frontier.push(child);
+        }
+
+        for (; !frontier.empty(); frontier.pop())
+            roots.push(frontier.top());
+    }
+}
+
+FlatBVH::FlatBVH(const BVH &bvh, const Triangle *faces, NodeLayout layout)
+    : Shape(-1, -1), faces(faces)
+{
+    std::vector<SourceNode> tree;
+    collect(&bvh, tree);
+
+    std::vector<std::int32_t> order;
+    order.reserve(tree.size());
+
+    switch (layout) {
+    case NodeLayout::VanEmdeBoas:
+        van_emde_boas(tree, 0, tree[0].height, order);
+        break;
+    case NodeLayout::Treelet:
+        treelets(tree, PAGE_SIZE / sizeof(Node), order);
+        break;
+    default: // Pre-order is how the tree was collected.
+        for (std::size_t i = 0; i < tree.size(); ++i)
+            order.push_back(i);
+        break;
+    }
+
+    std::vector<std::int32_t> position(tree.size());
+    for (std::size_t i = 0; i < order.size(); ++i)
+        position[order[i]] = i;
+
+    count = order.size();
+    const std::size_t size =
+        (count * sizeof(Node) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    nodes.reset(static_cast<Node *>(std::aligned_alloc(PAGE_SIZE, size)));
+    if (!nodes)
+        throw std::bad_alloc();
+
+    for (std::size_t i = 0; i < count; ++i) {
+        const SourceNode &source = tree[order[i]];
+        const BVH *node = source.bvh;
+        Node &flat = nodes[i];
+
+        flat.box = node->bounding_box;
+
+        if (!node->isLeaf()) {
+            flat.child[0] = position[source.child[0]];
+            flat.child[1] = position[source.child[1]];
+        } else if (node->left) {
+            flat.child[0] = ~std::int32_t(
+                static_cast<const Triangle *>(node->left) - faces);
+            flat.child[1] = node->right ? 2 : 1;
+        } else {
+            flat.child[0] = ~0;
+            flat.child[1] = 0;
+        }
+    }
+}
+
+// Same test as Box::intersects.
+static bool intersects(const Box &box, vec4f origin, vec4f inv_direction)
+{
+    ++traversal_work.nodeVisits;
+
+    vec4f t_0 = (vec4f(box.min_point) - origin) * inv_direction,
+          t_1 = (vec4f(box.max_point) - origin) * inv_direction;
+
+    return giraffe::hmax3(giraffe::min(t_0, t_1)) <=
+           giraffe::hmin3(giraffe::max(t_0, t_1));
+}
+
+Hit FlatBVH::hit(const Ray &ray) const
+{
+    const Query query = {ray, vec4f(ray.origin), vec4f(ray.invDirection)};
+
+    return intersect_node(query, 0);
+}
+
+// Mirrors BVH::hit, so that hits and ties resolve exactly as they do for the
+// hierarchy this was copied from.
+Hit FlatBVH::intersect_node(const Query &query, std::int32_t idx) const
+{
+    const Node &node = nodes[idx];
+
+    if (!intersects(node.box, query.origin, query.invDirection))
+        return MISS;
+
+    if (node.child[0] < 0) {
+        const std::int32_t first = ~node.child[0];
+        Hit left_hit = MISS, right_hit = MISS;
+
+        if (node.child[1] > 0)
+            left_hit = faces[first].hit(query.ray);
+        if (node.child[1] > 1)
+            right_hit = faces[first + 1].hit(query.ray);
+
+        return closest(left_hit, right_hit);
+    }
+
+    return closest(intersect_node(query, node.child[0]),
+                   intersect_node(query, node.child[1]));
+}
+
+void FlatBVH::hitPacket(const RayPacket &packet, std::uint64_t active,
+                        Hit *hits) const
+{
+    for_each_ray(active, [&](int i) { hits[i] = MISS; });
+    hit_packet(packet, active, 0, hits);
+}
+
+// Same as BVH::hit_packet.
+void FlatBVH::hit_packet(const RayPacket &packet, std::uint64_t active,
+                         std::int32_t idx, Hit *hits) const
+{
+    const Node &node = nodes[idx];
+
+    if (packet.missesAll(node.box))
+        return;
+
+    active = packet.intersects(node.box, active);
+
+    if (__builtin_popcountll(active) < RayPacket::MIN_ACTIVE) {
+        for_each_ray(active, [&](int i) {
+            const Ray &ray = packet.rays[i];
+            const Query query = {ray, vec4f(ray.origin),
+                                 vec4f(ray.invDirection)};
+
+            hits[i] = closest(hits[i], intersect_node(query, idx));
+        });
+    } else if (node.child[0] < 0) {
+        const std::int32_t first = ~node.child[0];
+
+        for_each_ray(active, [&](int i) {
+            const Ray &ray = packet.rays[i];
+
+            if (node.child[1] > 0)
+                hits[i] = closest(hits[i], faces[first].hit(ray));
+            if (node.child[1] > 1)
+                hits[i] = closest(hits[i], faces[first + 1].hit(ray));
+        });
+    } else {
+        hit_packet(packet, active, node.child[0], hits);
+        hit_packet(packet, active, node.child[1], hits);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef _FLAT_BVH_H_
+#define _FLAT_BVH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+#include "Shape.h"
+
+// Copy of a mesh BVH with all of its nodes in one page-aligned array, in the
+// order layout asks for, so that traversal touches fewer cache lines and
+// pages than it does chasing nodes wherever new put them. Boxes are kept
+// exactly, and children are visited in the same order as BVH::hit, so hits
+// are the same.
+class FlatBVH : public Shape
+{
+  public:
+    // Converts bvh, which must have been built over faces. faces must
+    // outlive the hierarchy. layout must not be NodeLayout::Pointer.
+    FlatBVH(const BVH &bvh, const Triangle *faces, NodeLayout layout);
+    Hit hit(const Ray &ray) const;
+    void hitPacket(const RayPacket &packet, std::uint64_t active,
+                   Hit *hits) const;
+
+    // Memory taken by the nodes.
+    std::size_t bytes() const { return count * sizeof(Node); }
+
+  private:
+    // Two to a cache line.
+    struct alignas(32) Node {
+        Box box;
+        // Inner node: children. Leaf: ~first face and the number of faces.
+        std::int32_t child[2];
+    };
+
+    struct Query; // Ray in the form the box test wants it
+
+    Hit intersect_node(const Query &query, std::int32_t idx) const;
+    void hit_packet(const RayPacket &packet, std::uint64_t active,
+                    std::int32_t idx, Hit *hits) const;
+
+    std::unique_ptr<Node[], decltype(&std::free)> nodes{nullptr, &std::free};
+    std::size_t count = 0;
+    const Triangle *faces;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "GBuffer.h"
+
+// Start of a saved buffer. Records and shadow words follow as they are in
+// memory, so buffers only load on machines like the one that saved them.
+struct GBufferHeader {
+    char magic[8];
+    std::uint64_t key;
+    std::int32_t width, height;
+    std::uint64_t lightCount;
+    std::uint64_t recordSize; // sizeof(HitRecord) of the saving build
+};
+
+static constexpr char MAGIC[8] = {'G', 'B', 'U', 'F', 'F', 'E', 'R', '1'};
+
+GBuffer::GBuffer(int width, int height, std::size_t lightCount,
+                 std::uint64_t key)
+    : width(width), height(height), lightCount(lightCount),
+      words((lightCount + 63) / 64), key(key),
+      records(std::size_t(width) * height, NO_HIT),
+      shadowWords(std::size_t(width) * height * words)
+{
+}
+
+std::unique_ptr<GBuffer> GBuffer::load(const std::string &path, int width,
+                                       int height, std::size_t lightCount,
+                                       std::uint64_t key)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return nullptr;
+
+    GBufferHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) ||
+        header.key != key || header.width != width ||
+        header.height != height || header.lightCount != lightCount ||
+        header.recordSize != sizeof(HitRecord))
+        return nullptr;
+
+    std::unique_ptr<GBuffer> gbuffer(
+        new GBuffer(width, height, lightCount, key));
+
+    if (!file.read(reinterpret_cast<char *>(gbuffer->records.data()),
+                   gbuffer->records.size() * sizeof(HitRecord)) ||
+        !file.read(reinterpret_cast<char *>(gbuffer->shadowWords.data()),
+                   gbuffer->shadowWords.size() * sizeof(std::uint64_t)))
+        throw std::runtime_error("cannot read " + path);
+
+    return gbuffer;
+}
+
+void GBuffer::save(const std::string &path) const
+{
+    GBufferHeader header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.key = key;
+    header.width = width;
+    header.height = height;
+    header.lightCount = lightCount;
+    header.recordSize = sizeof(HitRecord);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(records.data()),
+               records.size() * sizeof(HitRecord));
+    file.write(reinterpret_cast<const char *>(shadowWords.data()),
+               shadowWords.size() * sizeof(std::uint64_t));
+
+    if (!file.flush())
+        throw std::runtime_error("cannot write " + path);
+}
@@ -0,0 +1,67 @@
+#ifndef _G_BUFFER_H_
+#define _G_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+
+// Primary visibility of one camera's image: for every pixel, the closest hit
+// of its primary ray and the lights that hit is shadowed from. Saved next to
+// the image, it lets a later render of the same geometry skip tracing those
+// rays and only shade, which is all that edits to materials or light
+// intensities need.
+class GBuffer
+{
+  public:
+    // An empty buffer for a width x height image lit by lightCount lights,
+    // in a scene whose visibility key is key (see Scene::visibilityKey).
+    GBuffer(int width, int height, std::size_t lightCount, std::uint64_t key);
+
+    // The buffer saved at path, or nullptr if there is none or it was saved
+    // for another key, size or number of lights. Throws std::runtime_error
+    // if the file is there but cut short.
+    static std::unique_ptr<GBuffer> load(const std::string &path, int width,
+                                         int height, std::size_t lightCount,
+                                         std::uint64_t key);
+
+    // Throws std::runtime_error if path cannot be written.
+    void save(const std::string &path) const;
+
+    // Primary hit of pixel (x, y). t is not positive if the ray missed.
+    HitRecord &record(int x, int y) { return records[index(x, y)]; }
+    const HitRecord &record(int x, int y) const
+    {
+        return records[index(x, y)];
+    }
+
+    // Lights the primary hit of pixel (x, y) is shadowed from: light l is
+    // bit l % 64 of word l / 64.
+    std::uint64_t *shadows(int x, int y)
+    {
+        return &shadowWords[index(x, y) * words];
+    }
+    const std::uint64_t *shadows(int x, int y) const
+    {
+        return &shadowWords[index(x, y) * words];
+    }
+
+  private:
+    std::size_t index(int x, int y) const
+    {
+        return std::size_t(y) * width + x;
+    }
+
+    int width, height;
+    std::size_t lightCount;
+    std::size_t words; // Per pixel in shadowWords
+    std::uint64_t key;
+
+    std::vector<HitRecord> records;
+    std::vector<std::uint64_t> shadowWords;
+};
+
+#endif
@@ -1,6 +1,17 @@
 #ifndef GIRAFFE_GEOMETRY_H
 #define GIRAFFE_GEOMETRY_H
 
+#include <cmath>
+#include <cstddef>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Everything in here is defined in the header so that the compiler can inline
+// vector operations into the intersection and shading loops without relying
+// on link-time optimization.
+
 namespace giraffe
 {
 
@@ -23,21 +34,215 @@ struct vec3f {
 };
 
 // Vector addition and subtraction
-vec3f operator-(vec3f vec);
-vec3f operator+(vec3f lhs, vec3f rhs);
-vec3f operator-(vec3f lhs, vec3f rhs);
+constexpr vec3f operator-(vec3f vec) { return {-vec.x, -vec.y, -vec.z}; }
+
+constexpr vec3f operator+(vec3f lhs, vec3f rhs)
+{
+    return {lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z};
+}
+
+constexpr vec3f operator-(vec3f lhs, vec3f rhs)
+{
+    return {lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z};
+}
 
 // Scalar operations
-vec3f operator*(float lhs, vec3f rhs);
-vec3f operator/(vec3f lhs, float rhs);
+constexpr vec3f operator*(float lhs, vec3f rhs)
+{
+    return {lhs * rhs.x, lhs * rhs.y, lhs * rhs.z};
+}
+
+constexpr vec3f operator/(vec3f lhs, float rhs)
+{
+    return {lhs.x / rhs, lhs.y / rhs, lhs.z / rhs};
+}
 
 // Dot and cross products
-float operator*(vec3f lhs, vec3f rhs);
-float dot(vec3f lhs, vec3f rhs);
-vec3f cross(vec3f lhs, vec3f rhs);
+constexpr float dot(vec3f lhs, vec3f rhs)
+{
+    return (lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z);
+}
+
+constexpr float operator*(vec3f lhs, vec3f rhs) { return dot(lhs, rhs); }
+
+constexpr vec3f cross(vec3f lhs, vec3f rhs)
+{
+    return {lhs.y * rhs.z - lhs.z * rhs.y, lhs.z * rhs.x - lhs.x * rhs.z,
+            lhs.x * rhs.y - lhs.y * rhs.x};
+}
 
 // Oymak product
-vec3f oymak(vec3f lhs, vec3f rhs);
+constexpr vec3f oymak(vec3f lhs, vec3f rhs)
+{
+    return {lhs.x * rhs.x, lhs.y * rhs.y, lhs.z * rhs.z};
+}
+
+inline float vec3f::norm() const { return std::sqrt(dot(*this, *this)); }
+
+inline vec3f vec3f::normalize() const
+{
+    float size = this->norm();
+
+    return {this->x / size, this->y / size, this->z / size};
+}
+
+// Four-wide vector, one float per lane. Holds a vec3f in x, y, z with the
+// last lane unused, so that component-wise work on points and directions
+// maps onto single SSE instructions. Operations are done lane by lane in the
+// same order as their vec3f counterparts, so results are bit-identical.
+struct alignas(16) vec4f {
+#ifdef __SSE2__
+    __m128 v;
+
+    vec4f() = default;
+    vec4f(__m128 v) : v(v) {}
+    vec4f(float x, float y, float z, float w = 0) : v(_mm_setr_ps(x, y, z, w))
+    {
+    }
+    explicit vec4f(vec3f vec) : vec4f(vec.x, vec.y, vec.z) {}
+
+    static vec4f splat(float f) { return _mm_set1_ps(f); }
+
+    float operator[](int i) const
+    {
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, v);
+        return lanes[i];
+    }
+#else
+    float v[4];
+
+    vec4f() = default;
+    vec4f(float x, float y, float z, float w = 0) : v{x, y, z, w} {}
+    explicit vec4f(vec3f vec) : vec4f(vec.x, vec.y, vec.z) {}
+
+    static vec4f splat(float f) { return {f, f, f, f}; }
+
+    float operator[](int i) const { return v[i]; }
+#endif
+
+    vec3f xyz() const { return {(*this)[0], (*this)[1], (*this)[2]}; }
+};
+
+#ifdef __SSE2__
+
+inline vec4f operator+(vec4f lhs, vec4f rhs)
+{
+    return _mm_add_ps(lhs.v, rhs.v);
+}
+inline vec4f operator-(vec4f lhs, vec4f rhs)
+{
+    return _mm_sub_ps(lhs.v, rhs.v);
+}
+inline vec4f operator*(vec4f lhs, vec4f rhs)
+{
+    return _mm_mul_ps(lhs.v, rhs.v);
+}
+inline vec4f operator/(vec4f lhs, vec4f rhs)
+{
+    return _mm_div_ps(lhs.v, rhs.v);
+}
+inline vec4f min(vec4f lhs, vec4f rhs) { return _mm_min_ps(lhs.v, rhs.v); }
+inline vec4f max(vec4f lhs, vec4f rhs) { return _mm_max_ps(lhs.v, rhs.v); }
+
+// Dot product of the first three lanes, summed as (x + y) + z like dot().
+inline float dot3(vec4f lhs, vec4f rhs)
+{
+    __m128 m = _mm_mul_ps(lhs.v, rhs.v);
+    __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+}
+
+// Largest of the first three lanes.
+inline float hmax3(vec4f vec)
+{
+    __m128 y = _mm_shuffle_ps(vec.v, vec.v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(vec.v, vec.v, _MM_SHUFFLE(2, 2, 2, 2));
+
+    return _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(vec.v, y), z));
+}
+
+// Smallest of the first three lanes.
+inline float hmin3(vec4f vec)
+{
+    __m128 y = _mm_shuffle_ps(vec.v, vec.v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(vec.v, vec.v, _MM_SHUFFLE(2, 2, 2, 2));
+
+    return _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(vec.v, y), z));
+}
+
+#else
+
+#define GIRAFFE_VEC4_OP(name, expr)                                            \
+    inline vec4f name(vec4f lhs, vec4f rhs)                                    \
+    {                                                                          \
+        vec4f out;                                                             \
+        for (int i = 0; i < 4; ++i) {                                          \
+            float a = lhs.v[i], b = rhs.v[i];                                  \
+            out.v[i] = (expr);                                                 \
+        }                                                                      \
+        return out;                                                            \
+    }
+
+GIRAFFE_VEC4_OP(operator+, a + b)
+GIRAFFE_VEC4_OP(operator-, a - b)
+GIRAFFE_VEC4_OP(operator*, a *b)
+GIRAFFE_VEC4_OP(operator/, a / b)
+GIRAFFE_VEC4_OP(min, b < a ? b : a)
+GIRAFFE_VEC4_OP(max, b > a ? b : a)
+
+#undef GIRAFFE_VEC4_OP
+
+inline float dot3(vec4f lhs, vec4f rhs)
+{
+    return lhs.v[0] * rhs.v[0] + lhs.v[1] * rhs.v[1] + lhs.v[2] * rhs.v[2];
+}
+
+inline float hmax3(vec4f vec)
+{
+    float m = vec.v[1] > vec.v[0] ? vec.v[1] : vec.v[0];
+    return vec.v[2] > m ? vec.v[2] : m;
+}
+
+inline float hmin3(vec4f vec)
+{
+    float m = vec.v[1] < vec.v[0] ? vec.v[1] : vec.v[0];
+    return vec.v[2] < m ? vec.v[2] : m;
+}
+
+#endif
+
+inline vec4f operator*(float lhs, vec4f rhs) { return vec4f::splat(lhs) * rhs; }
+
+inline vec4f normalize(vec4f vec)
+{
+    return vec / vec4f::splat(std::sqrt(dot3(vec, vec)));
+}
+
+// Batch helpers, for loops over many vectors at once (e.g. a column of
+// primary ray directions).
+
+// out[i] = origin + us[i] * du - vs[i] * dv
+inline void lerp_plane(vec3f origin, vec3f du, vec3f dv, const float *us,
+                       const float *vs, vec3f *out, std::size_t n)
+{
+    vec4f o(origin), u(du), v(dv);
+
+    for (std::size_t i = 0; i < n; ++i)
+        out[i] = (o + us[i] * u - vs[i] * v).xyz();
+}
+
+// out[i] = normalize(points[i] - from)
+inline void directions_from(vec3f from, const vec3f *points, vec3f *out,
+                            std::size_t n)
+{
+    vec4f f(from);
+
+    for (std::size_t i = 0; i < n; ++i)
+        out[i] = normalize(vec4f(points[i]) - f).xyz();
+}
 
 } // namespace giraffe
 
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Grid.h"
+
+// Cells per face of the top grid, and of the finer grids in its crowded
+// cells.
+static constexpr float TOP_DENSITY = 1;
+static constexpr float CELL_DENSITY = 2;
+
+// Top cells with more faces than this get a finer grid.
+static constexpr std::size_t MAX_CELL_FACES = 12;
+
+// Cells along any axis, which keeps flat and long thin meshes from asking
+// for huge grids.
+static constexpr int MAX_TOP_RESOLUTION = 256;
+static constexpr int MAX_CELL_RESOLUTION = 32;
+
+static float coordinate(const vec3f &v, int axis) { return (&v.x)[axis]; }
+
+static float &coordinate(vec3f &v, int axis) { return (&v.x)[axis]; }
+
+struct Grid::Builder {
+    Grid &grid;
+    std::vector<vec3f> corners; // Three per face
+    std::vector<Box> boxes;     // One per face
+
+    Builder(Grid &grid) : grid(grid) {}
+
+    // Whether the plane of face passes through the box at center reaching
+    // half out on each axis, grown a little so that faces on the boundary
+    // between cells are in both.
+    bool crosses(std::int32_t face, const vec3f &center,
+                 const vec3f &half) const
+    {
+        const vec3f *v = &corners[3 * face];
+        const vec3f normal = giraffe::cross(v[1] - v[0], v[2] - v[0]);
+        const float reach = 1.001f * (std::fabs(normal.x) * half.x +
+                                      std::fabs(normal.y) * half.y +
+                                      std::fabs(normal.z) * half.z);
+
+        return std::fabs(normal * (center - v[0])) <= reach;
+    }
+
+    // Calls f(cell) for every cell of level face goes in.
+    template <class F>
+    void for_each_cell(const Level &level, std::int32_t face, F f) const
+    {
+        const Box &box = boxes[face];
+        int lo[3], hi[3];
+
+        for (int a = 0; a < 3; ++a) {
+            const float origin = coordinate(level.bounds.min_point, a);
+            const float size = coordinate(level.cellSize, a);
+            const int last = level.resolution[a] - 1;
+
+            lo[a] = std::clamp(
+                int((coordinate(box.min_point, a) - origin) / size), 0, last);
+            hi[a] = std::clamp(
+                int((coordinate(box.max_point, a) - origin) / size), 0, last);
+        }
+
+        const vec3f half = level.cellSize / 2;
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x) {
+                    const vec3f center =
+                        level.bounds.min_point +
+                        vec3f{(x + 0.5f) * level.cellSize.x,
+                              (y + 0.5f) * level.cellSize.y,
+                              (z + 0.5f) * level.cellSize.z};
+                    if (crosses(face, center, half))
+                        f((z * level.resolution[1] + y) *
+                              level.resolution[0] +
+                          x);
+                }
+    }
+
+    // A grid over faces in bounds, with about density cells per face and no
+    // more than maxResolution along any axis.
+    Level build(const std::vector<std::int32_t> &faces, Box bounds,
+                float density, int maxResolution) const
+    {
+        Level level;
+
+        // Flat bounds still get a layer of cells.
+        const vec3f extent = bounds.max_point - bounds.min_point;
+        const float pad =
+            1e-3f * std::max({extent.x, extent.y, extent.z, 1e-6f});
+        bounds.min_point = bounds.min_point - vec3f{pad, pad, pad};
+        bounds.max_point = bounds.max_point + vec3f{pad, pad, pad};
+        level.bounds = bounds;
+
+        const vec3f size = bounds.max_point - bounds.min_point;
+        const float scale =
+            std::cbrt(density * faces.size() / (size.x * size.y * size.z));
+        std::size_t cells = 1;
+        for (int a = 0; a < 3; ++a) {
+            level.resolution[a] = std::clamp(
+                int(coordinate(size, a) * scale), 1, maxResolution);
+            coordinate(level.cellSize, a) =
+                coordinate(size, a) / level.resolution[a];
+            cells *= level.resolution[a];
+        }
+
+        // Count, then fill each cell's share of entries.
+        level.first.assign(cells + 1, 0);
+        for (auto face : faces)
+            for_each_cell(level, face, [&](int cell) { ++level.first[cell]; });
+
+        for (std::size_t c = 0; c < cells; ++c)
+            level.first[c + 1] += level.first[c];
+        level.entries.resize(level.first[cells]);
+
+        for (auto it = faces.rbegin(); it != faces.rend(); ++it)
+            for_each_cell(level, *it, [&](int cell) {
+                level.entries[--level.first[cell]] = *it;
+            });
+
+        return level;
+    }
+
+    // Gives the crowded cells of the top grid finer grids of their own.
+    void refine()
+    {
+        Level &top = grid.levels[0];
+        const std::size_t cells = top.first.size() - 1;
+        std::vector<std::uint32_t> first(cells + 1, 0);
+        std::vector<std::int32_t> entries;
+        std::vector<Level> finer;
+
+        for (std::size_t c = 0; c < cells; ++c) {
+            first[c] = entries.size();
+
+            const auto begin = top.entries.begin() + top.first[c],
+                       end = top.entries.begin() + top.first[c + 1];
+            if (std::size_t(end - begin) <= MAX_CELL_FACES) {
+                entries.insert(entries.end(), begin, end);
+                continue;
+            }
+
+            const int x = c % top.resolution[0],
+                      y = c / top.resolution[0] % top.resolution[1],
+                      z = c / top.resolution[0] / top.resolution[1];
+            const vec3f corner =
+                top.bounds.min_point + vec3f{x * top.cellSize.x,
+                                             y * top.cellSize.y,
+                                             z * top.cellSize.z};
+
+            entries.push_back(~std::int32_t(grid.levels.size() + finer.size()));
+            finer.push_back(build(std::vector<std::int32_t>(begin, end),
+                                  Box(corner, corner + top.cellSize),
+                                  CELL_DENSITY, MAX_CELL_RESOLUTION));
+        }
+        first[cells] = entries.size();
+
+        top.first = std::move(first);
+        top.entries = std::move(entries);
+        for (auto &level : finer)
+            grid.levels.push_back(std::move(level));
+    }
+};
+
+Grid::Grid(const Triangle *faces, std::size_t count)
+    : Shape(-1, -1), faces(faces)
+{
+    if (count == 0)
+        return;
+
+    Builder builder(*this);
+    std::vector<std::int32_t> all(count);
+    Box bounds;
+
+    builder.corners.resize(3 * count);
+    builder.boxes.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        vec3f *v = &builder.corners[3 * i];
+        faces[i].getVertices(v[0], v[1], v[2]);
+
+        all[i] = i;
+        for (int k = 0; k < 3; ++k) {
+            builder.boxes[i].update(v[k]);
+            bounds.update(v[k]);
+        }
+    }
+
+    levels.push_back(
+        builder.build(all, bounds, TOP_DENSITY, MAX_TOP_RESOLUTION));
+    builder.refine();
+}
+
+std::size_t Grid::bytes() const
+{
+    std::size_t total = 0;
+
+    for (auto &level : levels)
+        total += sizeof(Level) + level.first.size() * sizeof(std::uint32_t) +
+                 level.entries.size() * sizeof(std::int32_t);
+
+    return total;
+}
+
+std::size_t Grid::referenceCount() const
+{
+    std::size_t total = 0;
+
+    for (auto &level : levels)
+        for (auto entry : level.entries)
+            total += entry >= 0;
+
+    return total;
+}
+
+Hit Grid::hit(const Ray &ray) const
+{
+    Hit best = MISS;
+
+    if (!levels.empty())
+        traverse(levels[0], ray, 0, std::numeric_limits<float>::max(), best);
+
+    return best;
+}
+
+// Steps ray through the cells of level between t_min and t_max, nearest
+// first, and stops after the first cell that has a hit no farther than
+// where the ray leaves it. Faces in several cells are tested once per cell.
+void Grid::traverse(const Level &level, const Ray &ray, float t_min,
+                    float t_max, Hit &best) const
+{
+    const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float direction[3] = {ray.direction.x, ray.direction.y,
+                                ray.direction.z};
+    const float inverse[3] = {ray.invDirection.x, ray.invDirection.y,
+                              ray.invDirection.z};
+
+    for (int a = 0; a < 3; ++a) {
+        const float lo = coordinate(level.bounds.min_point, a),
+                    hi = coordinate(level.bounds.max_point, a);
+
+        if (direction[a] == 0) {
+            if (origin[a] < lo || origin[a] > hi)
+                return;
+            continue;
+        }
+
+        float t_0 = (lo - origin[a]) * inverse[a],
+              t_1 = (hi - origin[a]) * inverse[a];
+        if (t_0 > t_1)
+            std::swap(t_0, t_1);
+        t_min = std::max(t_min, t_0);
+        t_max = std::min(t_max, t_1);
+    }
+
+    if (t_min > t_max)
+        return;
+
+    int cell[3], step[3];
+    float next[3], delta[3];
+
+    for (int a = 0; a < 3; ++a) {
+        const float lo = coordinate(level.bounds.min_point, a);
+        const float size = coordinate(level.cellSize, a);
+        const float p = origin[a] + t_min * direction[a];
+
+        cell[a] = std::clamp(int((p - lo) / size), 0, level.resolution[a] - 1);
+
+        if (direction[a] > 0) {
+            step[a] = 1;
+            next[a] = (lo + (cell[a] + 1) * size - origin[a]) * inverse[a];
+            delta[a] = size * inverse[a];
+        } else if (direction[a] < 0) {
+            step[a] = -1;
+            next[a] = (lo + cell[a] * size - origin[a]) * inverse[a];
+            delta[a] = -size * inverse[a];
+        } else {
+            step[a] = 0;
+            next[a] = delta[a] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    float t_enter = t_min;
+
+    while (true) {
+        ++traversal_work.nodeVisits;
+
+        const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                           : (next[1] < next[2] ? 1 : 2);
+        const float t_exit = std::min(next[axis], t_max);
+        const std::size_t c =
+            (std::size_t(cell[2]) * level.resolution[1] + cell[1]) *
+                level.resolution[0] +
+            cell[0];
+
+        for (auto i = level.first[c]; i < level.first[c + 1]; ++i) {
+            const std::int32_t entry = level.entries[i];
+
+            if (entry < 0) {
+                traverse(levels[~entry], ray, t_enter, t_exit, best);
+                continue;
+            }
+
+            Hit hit = faces[entry].hit(ray);
+            if (hit.t > 0 && (best.t <= 0 || hit.t < best.t))
+                best = hit;
+        }
+
+        if (best.t > 0 && best.t <= t_exit)
+            return;
+        if (next[axis] >= t_max)
+            return;
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= level.resolution[axis])
+            return;
+
+        t_enter = next[axis];
+        next[axis] += delta[axis];
+    }
+}
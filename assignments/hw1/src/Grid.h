@@ -0,0 +1,51 @@
+#ifndef _GRID_H_
+#define _GRID_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Shape.h"
+
+// Two-level uniform grid over a mesh's faces. The top grid has about as many
+// cells as there are faces, and each face is listed in every cell its box
+// overlaps and its plane passes through. Cells left with many faces, where
+// the mesh is denser than average, get a finer grid of their own. Building
+// is a couple of linear passes with no sorting, much faster than a
+// hierarchy, and rays step through the cells in order with a 3D-DDA, so
+// they stop at the first cell with a hit in it. Best for primitives of
+// about the same size spread evenly through their bounds.
+class Grid : public Shape
+{
+  public:
+    // Builds over faces[0, count). faces must outlive the grid.
+    Grid(const Triangle *faces, std::size_t count);
+    Hit hit(const Ray &ray) const;
+
+    // Memory taken by the cells and their face lists, all levels included.
+    std::size_t bytes() const;
+
+    // Face references in the cells, over all levels.
+    std::size_t referenceCount() const;
+
+  private:
+    struct Level {
+        Box bounds;
+        vec3f cellSize;
+        int resolution[3];
+        // Entries of cell c are entries[first[c], first[c + 1]): faces, or a
+        // single ~index into levels of the finer grid that covers the cell.
+        std::vector<std::uint32_t> first;
+        std::vector<std::int32_t> entries;
+    };
+
+    struct Builder;
+
+    void traverse(const Level &level, const Ray &ray, float t_min,
+                  float t_max, Hit &best) const;
+
+    std::vector<Level> levels; // The top grid first
+    const Triangle *faces;
+};
+
+#endif
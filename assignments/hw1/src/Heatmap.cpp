@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "Heatmap.h"
+#include "Image.h"
+
+// metric of a pixel's Work, or of a tile's totals.
+template <class W> static std::uint64_t value(const W &work, HeatMetric metric)
+{
+    switch (metric) {
+    case HeatMetric::NodeVisits:
+        return work.nodeVisits;
+    case HeatMetric::PrimitiveTests:
+        return work.primitiveTests;
+    case HeatMetric::Rays:
+        return work.rays;
+    default:
+        return 0;
+    }
+}
+
+// x in [0, 1] on the ramp dark blue, blue, cyan, green, yellow, red.
+static Color ramp(float x)
+{
+    static const float stops[][3] = {{0, 0, 64},    {0, 0, 255},
+                                     {0, 255, 255}, {0, 255, 0},
+                                     {255, 255, 0}, {255, 0, 0}};
+    constexpr int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+    const float position = std::min(std::max(x, 0.0f), 1.0f) * last;
+    const int i = std::min(static_cast<int>(position), last - 1);
+    const float f = position - i;
+    Color color;
+
+    for (int c = 0; c < 3; ++c)
+        color.channel[c] = static_cast<unsigned char>(
+            stops[i][c] + f * (stops[i + 1][c] - stops[i][c]) + 0.5f);
+
+    return color;
+}
+
+Heatmap::Heatmap(int width, int height)
+    : width(width), height(height), pixels(std::size_t(width) * height)
+{
+}
+
+void Heatmap::saveImage(const std::string &path, HeatMetric metric) const
+{
+    std::vector<std::uint64_t> values;
+    values.reserve(pixels.size());
+    for (auto &work : pixels)
+        values.push_back(value(work, metric));
+
+    // The 99th percentile, so that a few outliers do not leave the rest of
+    // the image dark.
+    std::vector<std::uint64_t> sorted = values;
+    const std::size_t rank = sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    const float scale = sorted[rank] ? 1.0f / sorted[rank] : 0.0f;
+
+    Image image(width, height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            image.setPixelValue(
+                x, y, ramp(values[std::size_t(y) * width + x] * scale));
+
+    image.saveImage(path.c_str());
+}
+
+void Heatmap::saveTiles(const std::string &path, HeatMetric metric,
+                        int tileSize) const
+{
+    struct Total {
+        int x0, y0, x1, y1;
+        std::uint64_t nodeVisits = 0, primitiveTests = 0, rays = 0;
+    };
+
+    std::vector<Total> tiles;
+
+    for (int y0 = 0; y0 < height; y0 += tileSize) {
+        for (int x0 = 0; x0 < width; x0 += tileSize) {
+            Total total;
+            total.x0 = x0;
+            total.y0 = y0;
+            total.x1 = std::min(x0 + tileSize, width);
+            total.y1 = std::min(y0 + tileSize, height);
+
+            for (int y = total.y0; y < total.y1; ++y) {
+                for (int x = total.x0; x < total.x1; ++x) {
+                    const Work &work = pixels[std::size_t(y) * width + x];
+                    total.nodeVisits += work.nodeVisits;
+                    total.primitiveTests += work.primitiveTests;
+                    total.rays += work.rays;
+                }
+            }
+
+            tiles.push_back(total);
+        }
+    }
+
+    std::stable_sort(tiles.begin(), tiles.end(),
+                     [metric](const Total &a, const Total &b) {
+                         return value(a, metric) > value(b, metric);
+                     });
+
+    std::ofstream file(path);
+    file << "x0,y0,x1,y1,node_visits,primitive_tests,rays\n";
+    for (auto &total : tiles)
+        file << total.x0 << "," << total.y0 << "," << total.x1 << ","
+             << total.y1 << "," << total.nodeVisits << ","
+             << total.primitiveTests << "," << total.rays << "\n";
+
+    if (!file.flush())
+        throw std::runtime_error("cannot write " + path);
+}
@@ -0,0 +1,48 @@
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a heatmap colors pixels by.
+enum class HeatMetric {
+    None,           // No heatmap
+    NodeVisits,     // Rays tested against hierarchy boxes
+    PrimitiveTests, // Rays tested against spheres and triangles
+    Rays,           // Primary, shadow and mirror rays traced
+};
+
+// Work spent on each pixel of one camera's image, to see where render time
+// goes: which geometry is expensive, and whether a hierarchy change helped
+// there.
+class Heatmap
+{
+  public:
+    struct Work {
+        std::uint32_t nodeVisits;
+        std::uint32_t primitiveTests;
+        std::uint32_t rays;
+    };
+
+    Heatmap(int width, int height);
+
+    Work &at(int x, int y) { return pixels[std::size_t(y) * width + x]; }
+
+    // Writes metric as a false color PPM, from dark blue for no work through
+    // cyan, green and yellow to red. Colors are scaled so that only the
+    // costliest 1% of pixels saturate.
+    void saveImage(const std::string &path, HeatMetric metric) const;
+
+    // Writes the totals of every metric over tiles tileSize pixels square
+    // as CSV, costliest by metric first. Throws std::runtime_error if path
+    // cannot be written.
+    void saveTiles(const std::string &path, HeatMetric metric,
+                   int tileSize) const;
+
+  private:
+    int width, height;
+    std::vector<Work> pixels; // Row by row
+};
+
+#endif
@@ -1,6 +1,16 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
 #include "Image.h"
+#include "Trace.h"
+
+static_assert(sizeof(Color) == 3, "Color must be packed RGB");
 
-Image::Image(int width, int height) : width(width), height(height)
+Image::Image(int width, int height, int originX, int originY)
+    : width(width), height(height), originX(originX), originY(originY),
+      ownsPixels(true)
 {
     data = new Color *[height];
 
@@ -9,16 +19,43 @@ Image::Image(int width, int height) : width(width), height(height)
     }
 }
 
+Image::Image(Color *pixels, int width, int height, int originX, int originY)
+    : width(width), height(height), originX(originX), originY(originY),
+      ownsPixels(false)
+{
+    data = new Color *[height];
+
+    for (int y = 0; y < height; ++y) {
+        data[y] = pixels + y * width;
+    }
+}
+
+Image::~Image()
+{
+    if (ownsPixels) {
+        for (int y = 0; y < height; ++y) {
+            delete[] data[y];
+        }
+    }
+
+    delete[] data;
+}
+
 void Image::setPixelValue(int col, int row, const Color &color)
 {
-    data[row][col] = color;
+    data[row - originY][col - originX] = color;
 }
 
 void Image::saveImage(const char *imageName) const
 {
+    TraceSpan span("write", "%s", imageName);
     FILE *output;
 
     output = fopen(imageName, "w");
+    if (!output)
+        throw std::runtime_error(std::string("cannot write ") + imageName +
+                                 ": " + strerror(errno));
+
     fprintf(output, "P3\n");
     fprintf(output, "%d %d\n", width, height);
     fprintf(output, "255\n");
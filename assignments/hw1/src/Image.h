@@ -6,6 +6,7 @@
 
 #include "defs.h"
 
+// Three bytes, so that an array of them is a plain RGB buffer.
 typedef union Color {
     struct {
         unsigned char red;
@@ -22,10 +23,24 @@ class Image
     Color **data;
     int width;
     int height;
+    int originX; // Column of the top-left pixel within the full frame
+    int originY; // Row of the top-left pixel within the full frame
 
-    Image(int width, int height);
+    // An image can cover just a tile of the frame, in which case pixels are
+    // still addressed by their frame coordinates.
+    Image(int width, int height, int originX = 0, int originY = 0);
+    // Image over pixels the caller owns, width * height of them row by row.
+    Image(Color *pixels, int width, int height, int originX = 0,
+          int originY = 0);
+    ~Image();
+    Image(const Image &) = delete;
+    Image &operator=(const Image &) = delete;
     void setPixelValue(int col, int row, const Color &color);
+    // Throws std::runtime_error if the file cannot be created.
     void saveImage(const char *imageName) const;
+
+  private:
+    bool ownsPixels;
 };
 
 #endif
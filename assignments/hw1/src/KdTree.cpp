@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "KdTree.h"
+
+// Relative costs of visiting a node and of testing a face.
+static constexpr float TRAVERSAL_COST = 1;
+static constexpr float INTERSECTION_COST = 1.5f;
+
+// Splits that cut off empty space have their cost scaled by this, so that
+// rays skip over it.
+static constexpr float EMPTY_BONUS = 0.8f;
+
+// Depth limit of 8 + 1.3 log2(faces), and never more than this, which also
+// sizes the traversal stack.
+static constexpr int MAX_DEPTH = 64;
+
+static float coordinate(const vec3f &v, int axis) { return (&v.x)[axis]; }
+
+static float &coordinate(vec3f &v, int axis) { return (&v.x)[axis]; }
+
+struct KdTree::Builder {
+    KdTree &tree;
+    std::vector<Box> boxes; // One per face
+    int maxDepth = 0;
+
+    Builder(KdTree &tree) : tree(tree) {}
+
+    // Cheapest plane to split faces in bounds at, on each axis among the
+    // sides of their boxes. axis stays -1 if none beats a leaf.
+    void find_split(const std::vector<std::int32_t> &faces, const Box &bounds,
+                    int &axis, float &position) const
+    {
+        const std::size_t n = faces.size();
+        const vec3f size = bounds.max_point - bounds.min_point;
+        const float area = bounds.surfaceArea();
+        float best = INTERSECTION_COST * n;
+        std::vector<float> starts(n), ends(n);
+
+        axis = -1;
+        if (!(area > 0))
+            return;
+
+        for (int a = 0; a < 3; ++a) {
+            const float lo = coordinate(bounds.min_point, a),
+                        hi = coordinate(bounds.max_point, a);
+            if (!(hi > lo))
+                continue;
+
+            for (std::size_t k = 0; k < n; ++k) {
+                const Box &box = boxes[faces[k]];
+                starts[k] = std::max(coordinate(box.min_point, a), lo);
+                ends[k] = std::min(coordinate(box.max_point, a), hi);
+            }
+            std::sort(starts.begin(), starts.end());
+            std::sort(ends.begin(), ends.end());
+
+            // Faces across the plane, by its two other sides
+            const float u = coordinate(size, (a + 1) % 3),
+                        v = coordinate(size, (a + 2) % 3);
+
+            // Sweep the planes in order: s faces start before p, e end at
+            // or before it.
+            std::size_t s = 0, e = 0;
+            while (s < n || e < n) {
+                const float p = std::min(
+                    s < n ? starts[s] : std::numeric_limits<float>::max(),
+                    e < n ? ends[e] : std::numeric_limits<float>::max());
+
+                while (e < n && ends[e] <= p)
+                    ++e;
+
+                if (p > lo && p < hi) {
+                    const float left = p - lo, right = hi - p;
+                    const float area_left = 2 * (u * v + (u + v) * left),
+                                area_right = 2 * (u * v + (u + v) * right);
+                    const std::size_t count_left = s, count_right = n - e;
+
+                    float cost = TRAVERSAL_COST +
+                                 INTERSECTION_COST *
+                                     (area_left * count_left +
+                                      area_right * count_right) /
+                                     area;
+                    if (!count_left || !count_right)
+                        cost *= EMPTY_BONUS;
+
+                    if (cost < best) {
+                        best = cost;
+                        axis = a;
+                        position = p;
+                    }
+                }
+
+                while (s < n && starts[s] <= p)
+                    ++s;
+            }
+        }
+    }
+
+    // Appends the subtree over faces in bounds depth first and returns its
+    // root.
+    std::int32_t build(std::vector<std::int32_t> &faces, const Box &bounds,
+                       int depth)
+    {
+        const std::int32_t idx = tree.nodes.size();
+        tree.nodes.emplace_back();
+
+        int axis = -1;
+        float position = 0;
+        if (faces.size() > 1 && depth < maxDepth)
+            find_split(faces, bounds, axis, position);
+
+        // A face lying in the plane goes left.
+        std::vector<std::int32_t> left, right;
+        if (axis >= 0) {
+            for (auto face : faces) {
+                const float lo = coordinate(boxes[face].min_point, axis),
+                            hi = coordinate(boxes[face].max_point, axis);
+                if (lo < position || hi <= position)
+                    left.push_back(face);
+                if (hi > position)
+                    right.push_back(face);
+            }
+        }
+
+        if (axis < 0 ||
+            (left.size() == faces.size() && right.size() == faces.size())) {
+            Node &node = tree.nodes[idx];
+            node.split = 0;
+            node.index = tree.references.size();
+            node.count = faces.size();
+            tree.references.insert(tree.references.end(), faces.begin(),
+                                   faces.end());
+            return idx;
+        }
+
+        std::vector<std::int32_t>().swap(faces);
+
+        Box left_bounds = bounds, right_bounds = bounds;
+        coordinate(left_bounds.max_point, axis) = position;
+        coordinate(right_bounds.min_point, axis) = position;
+
+        build(left, left_bounds, depth + 1);
+        const std::int32_t right_child =
+            build(right, right_bounds, depth + 1);
+
+        Node &node = tree.nodes[idx];
+        node.split = position;
+        node.index = right_child;
+        node.count = -1 - axis;
+        return idx;
+    }
+};
+
+KdTree::KdTree(const Triangle *faces, std::size_t count)
+    : Shape(-1, -1), faces(faces)
+{
+    if (count == 0)
+        return;
+
+    Builder builder(*this);
+    std::vector<std::int32_t> all(count);
+
+    builder.boxes.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        vec3f v[3];
+        faces[i].getVertices(v[0], v[1], v[2]);
+
+        all[i] = i;
+        for (int k = 0; k < 3; ++k) {
+            builder.boxes[i].update(v[k]);
+            bounds.update(v[k]);
+        }
+    }
+
+    builder.maxDepth =
+        std::min(MAX_DEPTH, int(8 + 1.3 * std::log2(double(count))));
+    builder.build(all, bounds, 0);
+
+    nodes.shrink_to_fit();
+    references.shrink_to_fit();
+}
+
+// Leaves are visited front to back along the ray, each over the stretch of
+// it inside the leaf, until one has a hit within that stretch.
+Hit KdTree::hit(const Ray &ray) const
+{
+    if (nodes.empty())
+        return MISS;
+
+    const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float direction[3] = {ray.direction.x, ray.direction.y,
+                                ray.direction.z};
+    const float inverse[3] = {ray.invDirection.x, ray.invDirection.y,
+                              ray.invDirection.z};
+
+    float t_min = 0, t_max = std::numeric_limits<float>::max();
+    for (int a = 0; a < 3; ++a) {
+        const float lo = coordinate(bounds.min_point, a),
+                    hi = coordinate(bounds.max_point, a);
+
+        if (direction[a] == 0) {
+            if (origin[a] < lo || origin[a] > hi)
+                return MISS;
+            continue;
+        }
+
+        float t_0 = (lo - origin[a]) * inverse[a],
+              t_1 = (hi - origin[a]) * inverse[a];
+        if (t_0 > t_1)
+            std::swap(t_0, t_1);
+        t_min = std::max(t_min, t_0);
+        t_max = std::min(t_max, t_1);
+    }
+
+    if (t_min > t_max)
+        return MISS;
+
+    struct Pending {
+        std::int32_t node;
+        float t_min, t_max;
+    } stack[MAX_DEPTH + 1];
+    int top = 0;
+    std::int32_t idx = 0;
+    Hit best = MISS;
+
+    while (true) {
+        ++traversal_work.nodeVisits;
+        const Node &node = nodes[idx];
+
+        if (node.count < 0) {
+            const int axis = -1 - node.count;
+
+            // The near child is the side the ray starts on, or heads into
+            // from the plane.
+            std::int32_t near = idx + 1, far = node.index;
+            if (origin[axis] > node.split ||
+                (origin[axis] == node.split && direction[axis] > 0))
+                std::swap(near, far);
+
+            if (direction[axis] == 0) {
+                idx = near;
+                continue;
+            }
+
+            const float t_split = (node.split - origin[axis]) * inverse[axis];
+            if (t_split > t_max || t_split <= 0) {
+                idx = near;
+            } else if (t_split < t_min) {
+                idx = far;
+            } else {
+                stack[top++] = {far, t_split, t_max};
+                idx = near;
+                t_max = t_split;
+            }
+            continue;
+        }
+
+        for (std::int32_t i = 0; i < node.count; ++i) {
+            Hit hit = faces[references[node.index + i]].hit(ray);
+            if (hit.t > 0 && (best.t <= 0 || hit.t < best.t))
+                best = hit;
+        }
+
+        if ((best.t > 0 && best.t <= t_max) || !top)
+            return best;
+
+        --top;
+        idx = stack[top].node;
+        t_min = stack[top].t_min;
+        t_max = stack[top].t_max;
+    }
+}
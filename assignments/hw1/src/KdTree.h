@@ -0,0 +1,51 @@
+#ifndef _KD_TREE_H_
+#define _KD_TREE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Shape.h"
+
+// Kd-tree over a mesh's faces, split with the surface area heuristic at
+// the bounds of the faces. Unlike a BVH it splits space rather than faces,
+// so children never overlap and a face straddling a plane is in both.
+// Rays visit leaves strictly front to back and stop at the first one with
+// a hit inside it, which pays off where faces vary widely in size. Building
+// sorts every node's faces along each axis, which makes it the slowest of
+// the mesh accelerators to build.
+class KdTree : public Shape
+{
+  public:
+    // Builds over faces[0, count). faces must outlive the tree.
+    KdTree(const Triangle *faces, std::size_t count);
+    Hit hit(const Ray &ray) const;
+
+    // Memory taken by the nodes and the reference list.
+    std::size_t bytes() const
+    {
+        return nodes.size() * sizeof(Node) +
+               references.size() * sizeof(std::int32_t);
+    }
+
+    // Face references in the leaves, at least one per face.
+    std::size_t referenceCount() const { return references.size(); }
+
+  private:
+    struct Node {
+        float split; // Inner node: position of the plane
+        // Leaf: first entry in references. Inner node: right child, the
+        // left child being the next node.
+        std::int32_t index;
+        std::int32_t count; // Faces in a leaf, -1 - axis for an inner node
+    };
+
+    struct Builder;
+
+    std::vector<Node> nodes;
+    std::vector<std::int32_t> references; // Faces of the leaves
+    Box bounds;
+    const Triangle *faces;
+};
+
+#endif
@@ -7,7 +7,7 @@ PointLight::PointLight(const vec3f &position, const vec3f &intensity)
 {
 }
 
-vec3f PointLight::computeLightContribution(const vec3f &p)
+vec3f PointLight::computeLightContribution(const vec3f &p) const
 {
     return intensity / std::pow((p - position).norm(), 2);
 }
@@ -9,7 +9,7 @@ class PointLight
     vec3f position;
 
     PointLight(const vec3f &position, const vec3f &intensity);
-    vec3f computeLightContribution(const vec3f &p);
+    vec3f computeLightContribution(const vec3f &p) const;
 
   private:
     vec3f intensity;
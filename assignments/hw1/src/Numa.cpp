@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "Camera.h"
+#include "Image.h"
+#include "Numa.h"
+#include "ThreadPool.h"
+
+// Parses a kernel CPU list such as "0-17,36-53".
+static std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+
+    while (std::getline(in, range, ',')) {
+        if (range.empty() || range == "\n")
+            continue;
+
+        int first = atoi(range.c_str()), last = first;
+        auto dash = range.find('-');
+        if (dash != std::string::npos)
+            last = atoi(range.c_str() + dash + 1);
+
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+std::vector<NumaNode> numa_nodes()
+{
+    std::vector<NumaNode> nodes;
+    std::string online;
+
+    std::ifstream online_file("/sys/devices/system/node/online");
+    if (std::getline(online_file, online)) {
+        for (int id : parse_cpu_list(online)) {
+            std::ifstream cpulist("/sys/devices/system/node/node" +
+                                  std::to_string(id) + "/cpulist");
+            std::string list;
+            std::getline(cpulist, list);
+
+            auto cpus = parse_cpu_list(list);
+            if (!cpus.empty())
+                nodes.push_back({id, cpus});
+        }
+    }
+
+    if (nodes.empty()) {
+        NumaNode all = {0, {}};
+        unsigned int count = std::max(std::thread::hardware_concurrency(), 1u);
+        for (unsigned int cpu = 0; cpu < count; ++cpu)
+            all.cpus.push_back(cpu);
+        nodes.push_back(all);
+    }
+
+    return nodes;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+NumaRenderer::NumaRenderer(const char *xmlPath, const SceneOptions &options,
+                           unsigned int num_threads, bool replicate,
+                           int bandHeight)
+    : bandHeight(bandHeight), replicate(replicate)
+{
+    auto topology = numa_nodes();
+
+    std::size_t total_cpus = 0;
+    for (auto &node : topology)
+        total_cpus += node.cpus.size();
+    if (num_threads == 0)
+        num_threads = total_cpus;
+
+    // Copies are loaded by a thread on their node, so that their memory is
+    // first touched there.
+    auto load_on = [&](const NumaNode &node) {
+        return std::async(std::launch::async, [&] {
+                   pin_current_thread(node.cpus);
+                   return new Scene(xmlPath, options);
+               })
+            .get();
+    };
+
+    scene.reset(replicate ? load_on(topology.front())
+                          : new Scene(xmlPath, options));
+
+    for (auto &node_topology : topology) {
+        auto node = std::make_unique<Node>();
+        node->topology = node_topology;
+
+        unsigned int node_threads = std::max<long>(
+            std::lround(double(num_threads) * node_topology.cpus.size() /
+                        total_cpus),
+            1);
+        node->pool.reset(new ThreadPool(node_threads, node_topology.cpus));
+        threads += node_threads;
+
+        if (replicate && !nodes.empty())
+            node->replica.reset(load_on(node_topology));
+
+        node->scene = node->replica ? node->replica.get() : scene.get();
+        nodes.push_back(std::move(node));
+    }
+}
+
+NumaRenderer::~NumaRenderer() {}
+
+// Claims the next band of node's own run, or failing that, the last band of
+// the run of whichever other node has the most left.
+bool NumaRenderer::claim(Node &node, int &band, bool &stolen)
+{
+    {
+        std::lock_guard<std::mutex> lock(node.mutex);
+        if (node.next < node.end) {
+            band = node.next++;
+            stolen = false;
+            return true;
+        }
+    }
+
+    for (;;) {
+        Node *victim = nullptr;
+        int most = 0;
+
+        for (auto &other : nodes) {
+            std::lock_guard<std::mutex> lock(other->mutex);
+            if (other->end - other->next > most) {
+                most = other->end - other->next;
+                victim = other.get();
+            }
+        }
+
+        if (!victim)
+            return false;
+
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if (victim->next < victim->end) {
+            band = --victim->end;
+            stolen = true;
+            return true;
+        }
+    }
+}
+
+RenderStats NumaRenderer::render_bands(Node &node, const Camera *camera,
+                                       Image &frame)
+{
+    RenderStats stats;
+    int band;
+    bool stolen;
+
+    pin_current_thread(node.topology.cpus);
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (claim(node, band, stolen)) {
+        const int y0 = band * bandHeight;
+        const int y1 = std::min(y0 + bandHeight, frame.height);
+
+        Image tile(frame.width, y1 - y0, 0, y0);
+        stats += node.scene->renderTile(camera, tile, *node.pool);
+
+        for (int y = y0; y < y1; ++y)
+            std::copy_n(tile.data[y - y0], frame.width, frame.data[y]);
+
+        ++(stolen ? node.stolenBands : node.localBands);
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    node.busySeconds += elapsed.count();
+
+    return stats;
+}
+
+void NumaRenderer::render(bool printStats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (std::size_t i = 0; i < scene->cameras.size(); ++i) {
+        const int width = scene->cameras[i]->imgPlane.nx,
+                  height = scene->cameras[i]->imgPlane.ny;
+        const int bands = (height + bandHeight - 1) / bandHeight;
+
+        // Runs sized by each node's share of the threads.
+        int first = 0;
+        unsigned int threads_before = 0;
+        for (auto &node : nodes) {
+            threads_before += node->pool->size();
+            node->next = first;
+            node->end = first = bands * threads_before / threads;
+        }
+
+        Image frame(width, height);
+        std::vector<std::future<RenderStats>> tasks;
+
+        for (auto &node : nodes) {
+            const Camera *camera = node->scene->cameras[i];
+            Node *n = node.get();
+            tasks.push_back(std::async(std::launch::async, [=, &frame] {
+                return render_bands(*n, camera, frame);
+            }));
+        }
+
+        RenderStats stats;
+        for (auto &task : tasks)
+            stats += task.get();
+
+        const Camera *camera = scene->cameras[i];
+        frame.saveImage(camera->imageName.c_str());
+
+        if (printStats)
+            scene->reportStats(camera, stats);
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    renderSeconds += elapsed.count();
+}
+
+void NumaRenderer::printReport(std::ostream &out) const
+{
+    out << "numa: " << nodes.size() << " nodes, " << threads << " threads"
+        << (replicate ? ", scene replicated per node" : "") << "\n";
+
+    for (auto &node : nodes) {
+        const auto &cpus = node->topology.cpus;
+
+        out << "  node " << node->topology.id << ": cpus " << cpus.front()
+            << "-" << cpus.back() << " (" << cpus.size() << "), "
+            << node->pool->size() << " threads, " << node->localBands
+            << " local bands, " << node->stolenBands << " stolen, busy "
+            << std::fixed << std::setprecision(3) << node->busySeconds
+            << " s\n";
+    }
+
+    out << "  render time " << std::fixed << std::setprecision(3)
+        << renderSeconds << " s\n";
+}
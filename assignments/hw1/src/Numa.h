@@ -0,0 +1,86 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Scene.h"
+
+class Image;
+class ThreadPool;
+
+// A NUMA node as the kernel reports it under /sys/devices/system/node.
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// Nodes that have CPUs. Machines without NUMA, or without sysfs, show up as
+// a single node holding every CPU.
+std::vector<NumaNode> numa_nodes();
+
+// Restricts the calling thread to the given CPUs. Returns false if the kernel
+// refuses, in which case the thread keeps running where it was.
+bool pin_current_thread(const std::vector<int> &cpus);
+
+// Renders scenes with one thread pool per NUMA node, its workers pinned to
+// the node's CPUs. Frames are cut into bands of rows, and each node owns a
+// contiguous run of them, sized by its share of the threads. A node renders
+// its bands into buffers it allocates itself, so that their pages are first
+// touched, and thus placed, on the node. It then steals bands from the far
+// end of other nodes' runs once its own are done.
+//
+// With replicate set, every node also loads its own copy of the scene from a
+// thread pinned to it, so that BVHs and vertices live in local memory too.
+class NumaRenderer
+{
+  public:
+    // Zero threads means one per CPU, otherwise they are spread over the
+    // nodes in proportion to their CPUs. Throws std::runtime_error if the
+    // scene cannot be loaded.
+    NumaRenderer(const char *xmlPath, const SceneOptions &options,
+                 unsigned int num_threads, bool replicate,
+                 int bandHeight = 16);
+    ~NumaRenderer();
+
+    NumaRenderer(const NumaRenderer &) = delete;
+    NumaRenderer &operator=(const NumaRenderer &) = delete;
+
+    // Renders every camera and writes their images.
+    void render(bool printStats);
+
+    // Per-node placement, band counts and timings, accumulated over all
+    // renders.
+    void printReport(std::ostream &out) const;
+
+  private:
+    struct Node {
+        NumaNode topology;
+        std::unique_ptr<ThreadPool> pool;
+        std::unique_ptr<Scene> replica; // Only if replicating
+        const Scene *scene;
+
+        // Bands [next, end) of the current frame still unclaimed in this
+        // node's run. Owners take from the front, thieves from the back.
+        std::mutex mutex;
+        int next, end;
+
+        unsigned long localBands = 0;
+        unsigned long stolenBands = 0;
+        double busySeconds = 0;
+    };
+
+    bool claim(Node &node, int &band, bool &stolen);
+    RenderStats render_bands(Node &node, const Camera *camera, Image &frame);
+
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::unique_ptr<Scene> scene; // Shared copy, also the replicas' model
+    int bandHeight;
+    bool replicate;
+    unsigned int threads = 0;
+    double renderSeconds = 0;
+};
+
+#endif
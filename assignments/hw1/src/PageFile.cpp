@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#include "PageFile.h"
+
+PageFile::PageFile(const char *directory, std::size_t cacheBytes)
+    : capacity(std::max<std::size_t>(cacheBytes / PAGE_SIZE, 1))
+{
+    static std::atomic<unsigned long> files{0};
+    serialNumber = ++files;
+
+    std::string name = std::string(directory) + "/giraffe-pages-XXXXXX";
+
+    fd = mkstemp(&name[0]);
+    if (fd == -1)
+        throw std::runtime_error("cannot create page file in " +
+                                 std::string(directory) + ": " +
+                                 strerror(errno));
+
+    unlink(name.c_str());
+}
+
+PageFile::~PageFile() { close(fd); }
+
+std::int32_t PageFile::append(const std::vector<PagedRecord> &records)
+{
+    const std::size_t first = pages * RECORDS_PER_PAGE;
+    Page page;
+
+    for (std::size_t i = 0; i < records.size(); i += RECORDS_PER_PAGE) {
+        auto end = std::min(i + RECORDS_PER_PAGE, records.size());
+
+        page.assign(records.begin() + i, records.begin() + end);
+        page.resize(RECORDS_PER_PAGE);
+
+        const std::size_t size = page.size() * sizeof(PagedRecord);
+        if (pwrite(fd, page.data(), size, pages * PAGE_SIZE) != ssize_t(size))
+            throw std::runtime_error("cannot write page file: " +
+                                     std::string(strerror(errno)));
+
+        ++pages;
+    }
+
+    if (pages * RECORDS_PER_PAGE > INT32_MAX)
+        throw std::runtime_error("page file too large");
+
+    return first;
+}
+
+std::shared_ptr<const PageFile::Page> PageFile::load(std::size_t page)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = index.find(page);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            ++cacheHits;
+            return it->second->second;
+        }
+    }
+
+    // Read without holding the lock, so that threads hitting the cache are
+    // not held up by the disk.
+    auto data = std::make_shared<Page>(RECORDS_PER_PAGE);
+    const std::size_t size = RECORDS_PER_PAGE * sizeof(PagedRecord);
+    if (pread(fd, data->data(), size, page * PAGE_SIZE) != ssize_t(size))
+        throw std::runtime_error("cannot read page file: " +
+                                 std::string(strerror(errno)));
+
+    ++pageFaults;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Another thread may have faulted the same page in meanwhile.
+    auto it = index.find(page);
+    if (it != index.end())
+        return it->second->second;
+
+    lru.emplace_front(page, data);
+    index[page] = lru.begin();
+
+    while (lru.size() > capacity) {
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+
+    return data;
+}
+
+PagedRecord PageFile::fetch(std::int32_t record, Cursor &cursor)
+{
+    const std::size_t page = record / RECORDS_PER_PAGE;
+    const std::size_t slot = page % Cursor::SLOTS;
+
+    if (cursor.file != serialNumber) {
+        cursor = Cursor();
+        cursor.file = serialNumber;
+    }
+
+    if (cursor.page[slot] != page) {
+        cursor.data[slot] = load(page);
+        cursor.page[slot] = page;
+    }
+
+    return (*cursor.data[slot])[record % RECORDS_PER_PAGE];
+}
@@ -0,0 +1,91 @@
+#ifndef _PAGE_FILE_H_
+#define _PAGE_FILE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// One fixed-size record of out-of-core mesh data: either a BVH node or a
+// triangle with its three vertices baked in.
+struct PagedRecord {
+    float data[9]; // Node: box min and max. Triangle: vertices a, b and c.
+    std::int32_t left;  // Node only: left child record, -1 if none
+    std::int32_t right; // Node only: right child record, -1 if none
+    std::uint32_t flags;
+
+    static constexpr std::uint32_t LEAF = 1; // Children are triangles
+};
+
+// Append-only file of PagedRecords, read back through an LRU cache of pages
+// whose total size stays under a memory cap. Records are never split across
+// pages. The file is created unlinked, so it disappears with the process.
+//
+// fetch() is safe to call from several threads at once.
+class PageFile
+{
+  public:
+    static constexpr std::size_t PAGE_SIZE = 64 * 1024;
+    static constexpr std::size_t RECORDS_PER_PAGE =
+        PAGE_SIZE / sizeof(PagedRecord);
+
+    using Page = std::vector<PagedRecord>;
+
+    // The last few pages a reader looked at, direct-mapped by page index.
+    // Holding on to them keeps them alive even if the cache evicts them, and
+    // spares a locked cache lookup while traversal stays on the same pages.
+    struct Cursor {
+        static constexpr std::size_t SLOTS = 8;
+
+        unsigned long file = 0; // serial() of the file the pages belong to
+        std::size_t page[SLOTS] = {SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX,
+                                   SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX};
+        std::shared_ptr<const Page> data[SLOTS];
+    };
+
+    // Throws std::runtime_error if no file can be created in directory.
+    PageFile(const char *directory, std::size_t cacheBytes);
+    ~PageFile();
+
+    PageFile(const PageFile &) = delete;
+    PageFile &operator=(const PageFile &) = delete;
+
+    // Appends records starting on a fresh page and returns the index of the
+    // first one.
+    std::int32_t append(const std::vector<PagedRecord> &records);
+
+    // Index the next append will return.
+    std::int32_t nextRecord() const { return pages * RECORDS_PER_PAGE; }
+
+    PagedRecord fetch(std::int32_t record, Cursor &cursor);
+
+    // Unique among all PageFiles created by the process, unlike addresses.
+    unsigned long serial() const { return serialNumber; }
+
+    std::size_t pageCount() const { return pages; }
+    unsigned long hits() const { return cacheHits; }
+    unsigned long faults() const { return pageFaults; }
+
+  private:
+    std::shared_ptr<const Page> load(std::size_t page);
+
+    int fd;
+    unsigned long serialNumber;
+    std::size_t pages = 0;
+    std::size_t capacity; // In pages
+
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<std::pair<std::size_t, std::shared_ptr<const Page>>> lru;
+    std::unordered_map<std::size_t, decltype(lru)::iterator> index;
+
+    std::atomic<unsigned long> cacheHits{0};
+    std::atomic<unsigned long> pageFaults{0};
+};
+
+#endif
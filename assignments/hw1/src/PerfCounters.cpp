@@ -0,0 +1,114 @@
+#include <cstring>
+#include <iomanip>
+#include <string>
+
+#include "PerfCounters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static constexpr std::uint64_t cache_event(std::uint64_t cache,
+                                           std::uint64_t op,
+                                           std::uint64_t result)
+{
+    return cache | op << 8 | result << 16;
+}
+
+static int open_counter(std::uint32_t type, std::uint64_t config)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PerfCounters::PerfCounters()
+{
+    counters = {
+        {"cache references",
+         open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES)},
+        {"cache misses",
+         open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)},
+        {"L1d read misses",
+         open_counter(PERF_TYPE_HW_CACHE,
+                      cache_event(PERF_COUNT_HW_CACHE_L1D,
+                                  PERF_COUNT_HW_CACHE_OP_READ,
+                                  PERF_COUNT_HW_CACHE_RESULT_MISS))},
+        {"LLC read misses",
+         open_counter(PERF_TYPE_HW_CACHE,
+                      cache_event(PERF_COUNT_HW_CACHE_LL,
+                                  PERF_COUNT_HW_CACHE_OP_READ,
+                                  PERF_COUNT_HW_CACHE_RESULT_MISS))},
+        {"dTLB read misses",
+         open_counter(PERF_TYPE_HW_CACHE,
+                      cache_event(PERF_COUNT_HW_CACHE_DTLB,
+                                  PERF_COUNT_HW_CACHE_OP_READ,
+                                  PERF_COUNT_HW_CACHE_RESULT_MISS))},
+        {"page faults",
+         open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS)},
+    };
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (auto &counter : counters)
+        if (counter.fd >= 0)
+            close(counter.fd);
+}
+
+// Enabling, disabling and reading the counters of the process also covers
+// those its threads inherited.
+void PerfCounters::start()
+{
+    for (auto &counter : counters) {
+        if (counter.fd >= 0) {
+            ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::stop()
+{
+    for (auto &counter : counters)
+        if (counter.fd >= 0)
+            ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+void PerfCounters::print(std::ostream &out) const
+{
+    out << "perf counters:\n";
+
+    for (auto &counter : counters) {
+        std::uint64_t value;
+
+        out << "  " << std::left << std::setw(20)
+            << std::string(counter.name) + ":" << std::right;
+        if (counter.fd >= 0 &&
+            read(counter.fd, &value, sizeof(value)) == sizeof(value))
+            out << value << "\n";
+        else
+            out << "unavailable\n";
+    }
+}
+#else
+PerfCounters::PerfCounters() {}
+PerfCounters::~PerfCounters() {}
+void PerfCounters::start() {}
+void PerfCounters::stop() {}
+
+void PerfCounters::print(std::ostream &out) const
+{
+    out << "perf counters: unavailable\n";
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Cache, TLB and page fault counts of the whole process, through Linux's
+// perf_event_open. Threads started after construction are counted too, so
+// create it before the pool that renders. Counters the kernel or the machine
+// does not offer, such as hardware ones inside most VMs, are reported as
+// unavailable.
+class PerfCounters
+{
+  public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Zeroes the counters and starts counting.
+    void start();
+    void stop();
+
+    void print(std::ostream &out) const;
+
+  private:
+    struct Counter {
+        const char *name;
+        int fd; // -1 if unavailable
+    };
+
+    std::vector<Counter> counters;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "QuantizedBVH.h"
+
+using giraffe::vec4f;
+
+template <typename T> struct QuantizedBVH<T>::Query {
+    const Ray &ray;
+    vec4f origin, invDirection;
+};
+
+static constexpr std::int32_t leaf_child(std::int32_t first, int count)
+{
+    return ~(first * 2 + count - 1);
+}
+
+// Size of one offset step inside the box [min, max].
+template <typename T> static vec4f step(vec4f min, vec4f max)
+{
+    constexpr float QMAX = std::numeric_limits<T>::max();
+
+    return (max - min) * vec4f::splat(1 / QMAX);
+}
+
+template <typename T> static vec4f widen(const T (&q)[3])
+{
+#ifdef __SSE2__
+    return _mm_cvtepi32_ps(_mm_setr_epi32(q[0], q[1], q[2], 0));
+#else
+    return {float(q[0]), float(q[1]), float(q[2])};
+#endif
+}
+
+// Child box of the node with box [min, max]. Both ends are measured inwards
+// from the matching end of the parent, so that an offset of 0 decodes to
+// exactly the parent's bound.
+template <typename T>
+static void decode(vec4f min, vec4f max, vec4f scale, const T (&qmin)[3],
+                   const T (&qmax)[3], vec4f &child_min, vec4f &child_max)
+{
+    child_min = min + widen(qmin) * scale;
+    child_max = max - widen(qmax) * scale;
+}
+
+// Same test as Box::intersects.
+static bool intersects(vec4f min, vec4f max, vec4f origin, vec4f inv_direction)
+{
+    ++traversal_work.nodeVisits;
+
+    vec4f t_0 = (min - origin) * inv_direction,
+          t_1 = (max - origin) * inv_direction;
+
+    return giraffe::hmax3(giraffe::min(t_0, t_1)) <=
+           giraffe::hmin3(giraffe::max(t_0, t_1));
+}
+
+template <typename T>
+QuantizedBVH<T>::QuantizedBVH(const BVH &bvh, const Triangle *faces)
+    : Shape(-1, -1), faces(faces), rootBox(bvh.bounding_box),
+      empty(!bvh.left)
+{
+    if (empty)
+        root = 0;
+    else if (bvh.isLeaf())
+        root = leaf_child(static_cast<const Triangle *>(bvh.left) - faces,
+                          bvh.right ? 2 : 1);
+    else
+        root = convert(&bvh, vec4f(rootBox.min_point),
+                       vec4f(rootBox.max_point));
+
+    nodes.shrink_to_fit();
+}
+
+// Appends node, whose box decodes to [min, max], and its subtree depth first.
+template <typename T>
+std::int32_t QuantizedBVH<T>::convert(const BVH *node, vec4f min, vec4f max)
+{
+    constexpr int QMAX = std::numeric_limits<T>::max();
+
+    const std::int32_t idx = nodes.size();
+    nodes.emplace_back();
+
+    Node quantized;
+    const BVH *children[2] = {static_cast<const BVH *>(node->left),
+                              static_cast<const BVH *>(node->right)};
+    vec4f child_min[2], child_max[2];
+    const vec4f scale = step<T>(min, max);
+
+    for (int i = 0; i < 2; ++i) {
+        const vec4f exact_min(children[i]->bounding_box.min_point),
+            exact_max(children[i]->bounding_box.max_point);
+        const vec4f extent = max - min;
+
+        // Nearest offsets first, then widened one step at a time until the
+        // decoded box contains the exact one. Offsets of 0 always do.
+        for (int k = 0; k < 3; ++k) {
+            float lo = 0, hi = 0;
+            if (extent[k] > 0) {
+                lo = std::floor((exact_min[k] - min[k]) / extent[k] * QMAX);
+                hi = std::floor((max[k] - exact_max[k]) / extent[k] * QMAX);
+            }
+            quantized.min[i][k] = std::clamp<float>(lo, 0, QMAX);
+            quantized.max[i][k] = std::clamp<float>(hi, 0, QMAX);
+        }
+
+        for (;;) {
+            decode(min, max, scale, quantized.min[i], quantized.max[i],
+                   child_min[i], child_max[i]);
+
+            bool conservative = true;
+            for (int k = 0; k < 3; ++k) {
+                if (child_min[i][k] > exact_min[k]) {
+                    --quantized.min[i][k];
+                    conservative = false;
+                }
+                if (child_max[i][k] < exact_max[k]) {
+                    --quantized.max[i][k];
+                    conservative = false;
+                }
+            }
+
+            if (conservative)
+                break;
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        const BVH *child = children[i];
+
+        if (child->isLeaf())
+            quantized.child[i] =
+                leaf_child(static_cast<const Triangle *>(child->left) - faces,
+                           child->right ? 2 : 1);
+        else
+            quantized.child[i] = convert(child, child_min[i], child_max[i]);
+    }
+
+    nodes[idx] = quantized;
+    return idx;
+}
+
+template <typename T>
+Hit QuantizedBVH<T>::hit(const Ray &ray) const
+{
+    if (empty || !rootBox.intersects(ray))
+        return MISS;
+
+    const Query query = {ray, vec4f(ray.origin), vec4f(ray.invDirection)};
+
+    return intersect_child(query, root, vec4f(rootBox.min_point),
+                           vec4f(rootBox.max_point));
+}
+
+// Visits the children in the same order as BVH::hit, so that hits and
+// ties resolve exactly as they do for the full hierarchy.
+template <typename T>
+Hit QuantizedBVH<T>::intersect_child(const Query &query, std::int32_t child,
+                                     vec4f min, vec4f max) const
+{
+    if (child < 0) {
+        const std::int32_t first = ~child / 2;
+        Hit left_hit = faces[first].hit(query.ray);
+
+        if (~child % 2 == 0)
+            return closest(left_hit, MISS);
+
+        return closest(left_hit, faces[first + 1].hit(query.ray));
+    }
+
+    const Node &node = nodes[child];
+    Hit hit[2] = {MISS, MISS};
+    const vec4f scale = step<T>(min, max);
+
+    for (int i = 0; i < 2; ++i) {
+        vec4f child_min, child_max;
+        decode(min, max, scale, node.min[i], node.max[i], child_min,
+               child_max);
+
+        if (intersects(child_min, child_max, query.origin,
+                       query.invDirection))
+            hit[i] = intersect_child(query, node.child[i], child_min,
+                                     child_max);
+    }
+
+    return closest(hit[0], hit[1]);
+}
+
+template class QuantizedBVH<std::uint8_t>;
+template class QuantizedBVH<std::uint16_t>;
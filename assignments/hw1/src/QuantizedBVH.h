@@ -0,0 +1,51 @@
+#ifndef _QUANTIZED_BVH_H_
+#define _QUANTIZED_BVH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Shape.h"
+
+// Compact copy of a mesh BVH. Nodes are stored in one array, and each node
+// keeps the boxes of its two children as T-sized integer offsets into its own
+// box, in steps of 1 / numeric_limits<T>::max() of its size. Offsets are
+// rounded outwards, so that a decoded box always contains the exact one.
+// Leaves are folded into their parents as ranges of the mesh's faces.
+//
+// T is std::uint8_t or std::uint16_t, for 20 or 32 byte nodes.
+template <typename T> class QuantizedBVH : public Shape
+{
+  public:
+    // Converts bvh, which must have been built over faces. faces must
+    // outlive the hierarchy.
+    QuantizedBVH(const BVH &bvh, const Triangle *faces);
+    Hit hit(const Ray &ray) const;
+
+    // Memory taken by the nodes.
+    std::size_t bytes() const { return nodes.size() * sizeof(Node); }
+
+  private:
+    struct Node {
+        // Child boxes, as steps inwards from the min and max corners of this
+        // node's box.
+        T min[2][3], max[2][3];
+        // Node index if >= 0, otherwise ~(first face * 2 + face count - 1).
+        std::int32_t child[2];
+    };
+
+    struct Query; // Ray in the form the box test wants it
+
+    std::int32_t convert(const BVH *node, giraffe::vec4f min,
+                         giraffe::vec4f max);
+    Hit intersect_child(const Query &query, std::int32_t child,
+                        giraffe::vec4f min, giraffe::vec4f max) const;
+
+    std::vector<Node> nodes;
+    const Triangle *faces;
+    Box rootBox;
+    std::int32_t root;
+    bool empty;
+};
+
+#endif
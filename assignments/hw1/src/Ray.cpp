@@ -3,13 +3,15 @@
 #include "Ray.h"
 
 Ray::Ray()
-    : origin({std::numeric_limits<float>::max(), 0, 0}), direction({0, 0, 0})
+    : origin({std::numeric_limits<float>::max(), 0, 0}), direction({0, 0, 0}),
+      invDirection({0, 0, 0})
 {
     ;
 }
 
 Ray::Ray(const vec3f &origin, const vec3f &direction)
-    : origin(origin), direction(direction)
+    : origin(origin), direction(direction),
+      invDirection({1 / direction.x, 1 / direction.y, 1 / direction.z})
 {
     ;
 }
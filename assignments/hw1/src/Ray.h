@@ -7,8 +7,17 @@
 class Ray
 {
   public:
-    vec3f origin;    // Origin of the ray
-    vec3f direction; // Direction of the ray
+    vec3f origin;       // Origin of the ray
+    vec3f direction;    // Direction of the ray
+    vec3f invDirection; // Component-wise reciprocal of the direction, used by
+                        // the slab test in Box::intersects
+
+    // Width of the bundle of rays this one stands for, such as those
+    // through its pixel: coneWidth at the origin, changing by coneSpread
+    // per unit of t. Meshes with levels of detail pick one by it. Rays of
+    // no width at the origin, like primary rays, see full detail.
+    float coneWidth = 0;
+    float coneSpread = 0;
 
     Ray();                                            // Constuctor
     Ray(const vec3f &origin, const vec3f &direction); // Constuctor
@@ -17,6 +26,7 @@ class Ray
         float t) const; // Return the point along the ray at ray parameter t
     float gett(const vec3f &p)
         const; // Return the t parameter at point p along the ray
+    float widthAt(float t) const { return coneWidth + coneSpread * t; }
 
   private:
     // Write any other stuff here.
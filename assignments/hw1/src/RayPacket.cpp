@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cmath>
+
+#include "RayPacket.h"
+#include "Shape.h"
+
+RayPacket::RayPacket(const Ray *rays, int count) : rays(rays), count(count)
+{
+    for (int k = 0; k < 3; ++k) {
+        originMin[k] = invMin[k] = INFINITY;
+        originMax[k] = invMax[k] = -INFINITY;
+        bounded[k] = true;
+    }
+
+    // Unused lanes repeat the last ray, so that they never need masking
+    // within a group of four.
+    for (int i = 0; i < SIZE; ++i) {
+        const Ray &ray = rays[std::min(i, count - 1)];
+        const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        const float inv[3] = {ray.invDirection.x, ray.invDirection.y,
+                              ray.invDirection.z};
+
+        for (int k = 0; k < 3; ++k) {
+            origin[k][i] = o[k];
+            invDirection[k][i] = inv[k];
+
+            originMin[k] = std::min(originMin[k], o[k]);
+            originMax[k] = std::max(originMax[k], o[k]);
+            invMin[k] = std::min(invMin[k], inv[k]);
+            invMax[k] = std::max(invMax[k], inv[k]);
+        }
+    }
+
+    for (int k = 0; k < 3; ++k)
+        bounded[k] = std::isfinite(invMin[k]) && std::isfinite(invMax[k]) &&
+                     (invMin[k] > 0 || invMax[k] < 0);
+}
+
+// Smallest and largest of (a - o) * i for o in [o_min, o_max] and i in
+// [i_min, i_max]. Rounding is monotonic, so the corners bound the rounded
+// results of every ray as well as the exact ones.
+static void product_range(float a, float o_min, float o_max, float i_min,
+                          float i_max, float &lo, float &hi)
+{
+    const float d_0 = a - o_max, d_1 = a - o_min;
+    const float p[4] = {d_0 * i_min, d_0 * i_max, d_1 * i_min, d_1 * i_max};
+
+    lo = std::min({p[0], p[1], p[2], p[3]});
+    hi = std::max({p[0], p[1], p[2], p[3]});
+}
+
+bool RayPacket::missesAll(const Box &box) const
+{
+    const float min[3] = {box.min_point.x, box.min_point.y, box.min_point.z},
+                max[3] = {box.max_point.x, box.max_point.y, box.max_point.z};
+
+    // Lower bound on every ray's entry distance, upper bound on every
+    // ray's exit distance.
+    float entry = -INFINITY, exit = INFINITY;
+
+    for (int k = 0; k < 3; ++k) {
+        if (!bounded[k])
+            continue;
+
+        // With positive directions rays enter through the min side,
+        // otherwise through the max side.
+        const float near = invMin[k] > 0 ? min[k] : max[k],
+                    far = invMin[k] > 0 ? max[k] : min[k];
+        float lo, hi, unused;
+
+        product_range(near, originMin[k], originMax[k], invMin[k],
+                      invMax[k], lo, unused);
+        product_range(far, originMin[k], originMax[k], invMin[k], invMax[k],
+                      unused, hi);
+
+        entry = std::max(entry, lo);
+        exit = std::min(exit, hi);
+    }
+
+    return entry > exit;
+}
+
+std::uint64_t RayPacket::intersects(const Box &box,
+                                    std::uint64_t active) const
+{
+    std::uint64_t hits = 0;
+
+#ifdef __SSE2__
+    traversal_work.nodeVisits += __builtin_popcountll(active);
+
+    const __m128 min_x = _mm_set1_ps(box.min_point.x),
+                 min_y = _mm_set1_ps(box.min_point.y),
+                 min_z = _mm_set1_ps(box.min_point.z),
+                 max_x = _mm_set1_ps(box.max_point.x),
+                 max_y = _mm_set1_ps(box.max_point.y),
+                 max_z = _mm_set1_ps(box.max_point.z);
+
+    for (int group = 0; group < SIZE / 4; ++group) {
+        if (!(active >> 4 * group & 0xf))
+            continue;
+
+        const int i = 4 * group;
+        const __m128 o_x = _mm_load_ps(&origin[0][i]),
+                     o_y = _mm_load_ps(&origin[1][i]),
+                     o_z = _mm_load_ps(&origin[2][i]),
+                     inv_x = _mm_load_ps(&invDirection[0][i]),
+                     inv_y = _mm_load_ps(&invDirection[1][i]),
+                     inv_z = _mm_load_ps(&invDirection[2][i]);
+
+        // Lane by lane the same operations, in the same order and with the
+        // same operand order, as Box::intersects does on one ray.
+        const __m128 t_0x = _mm_mul_ps(_mm_sub_ps(min_x, o_x), inv_x),
+                     t_0y = _mm_mul_ps(_mm_sub_ps(min_y, o_y), inv_y),
+                     t_0z = _mm_mul_ps(_mm_sub_ps(min_z, o_z), inv_z),
+                     t_1x = _mm_mul_ps(_mm_sub_ps(max_x, o_x), inv_x),
+                     t_1y = _mm_mul_ps(_mm_sub_ps(max_y, o_y), inv_y),
+                     t_1z = _mm_mul_ps(_mm_sub_ps(max_z, o_z), inv_z);
+
+        const __m128 t_min =
+            _mm_max_ps(_mm_max_ps(_mm_min_ps(t_0x, t_1x),
+                                  _mm_min_ps(t_0y, t_1y)),
+                       _mm_min_ps(t_0z, t_1z));
+        const __m128 t_max =
+            _mm_min_ps(_mm_min_ps(_mm_max_ps(t_0x, t_1x),
+                                  _mm_max_ps(t_0y, t_1y)),
+                       _mm_max_ps(t_0z, t_1z));
+
+        hits |= std::uint64_t(_mm_movemask_ps(_mm_cmple_ps(t_min, t_max)))
+                << i;
+    }
+
+    return hits & active;
+#else
+    for_each_ray(active, [&](int i) {
+        if (box.intersects(rays[i]))
+            hits |= std::uint64_t(1) << i;
+    });
+
+    return hits;
+#endif
+}
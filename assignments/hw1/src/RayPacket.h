@@ -0,0 +1,65 @@
+#ifndef _RAY_PACKET_H_
+#define _RAY_PACKET_H_
+
+#include <cstdint>
+
+#include "Ray.h"
+
+struct Box;
+
+// Up to SIZE coherent rays, such as the primary rays of an 8x8 block of
+// pixels or their shadow rays toward one light, traced through the scene
+// together. Subsets of the rays are given as bit masks.
+//
+// Besides the rays themselves, the packet keeps them lane by lane for four
+// wide box tests, and bounds on their origins and inverse directions. Those
+// bound the slab distances of every ray at once, which makes a conservative
+// frustum test: a box that fails it is missed by each ray on its own too.
+struct RayPacket {
+    static constexpr int SIZE = 64;
+    // Hierarchies trace the rays left in a subtree one by one once fewer
+    // than this many are; the packet has diverged too far to pay off.
+    static constexpr int MIN_ACTIVE = 8;
+
+    // rays must outlive the packet. count is at most SIZE.
+    RayPacket(const Ray *rays, int count);
+
+    // Mask of all rays.
+    std::uint64_t all() const
+    {
+        return count == SIZE ? ~std::uint64_t(0)
+                             : (std::uint64_t(1) << count) - 1;
+    }
+
+    // True if none of the rays can hit box.
+    bool missesAll(const Box &box) const;
+
+    // The rays in active that pass the same test as Box::intersects, with
+    // bit-identical results.
+    std::uint64_t intersects(const Box &box, std::uint64_t active) const;
+
+    const Ray *rays;
+    int count;
+
+  private:
+    alignas(16) float origin[3][SIZE];
+    alignas(16) float invDirection[3][SIZE];
+
+    // Per axis. Bounds on the inverse directions are only kept, and boxes
+    // only culled on that axis, if they all have the same sign and are
+    // finite.
+    float originMin[3], originMax[3];
+    float invMin[3], invMax[3];
+    bool bounded[3];
+};
+
+// Calls f with the index of each ray in mask, lowest first.
+template <class F> inline void for_each_ray(std::uint64_t mask, F f)
+{
+    while (mask) {
+        f(__builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+}
+
+#endif
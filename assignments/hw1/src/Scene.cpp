@@ -1,20 +1,31 @@
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
+#include <exception>
 #include <future>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <stdexcept>
 #include <thread>
 
 #include "tinyxml2.h"
 
 #include "Camera.h"
+#include "Checkpoint.h"
+#include "GBuffer.h"
 #include "Image.h"
 #include "Light.h"
 #include "Material.h"
+#include "PageFile.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "Scene.h"
 #include "Shape.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "VisibilityBuffer.h"
 
 using namespace tinyxml2;
 
@@ -25,22 +36,538 @@ Color to_output_color(vec3f color)
             (unsigned char)std::min(color.b, 255.0f)};
 }
 
-void Scene::render_partial(Image &image, Camera *camera, int u_min,
-                           int u_max) const
+RenderStats &RenderStats::operator+=(const RenderStats &other)
 {
-    auto width = camera->imgPlane.nx;
-    auto height = camera->imgPlane.ny;
+    shadowRays += other.shadowRays;
+    occludedRays += other.occludedRays;
+    occluderCacheHits += other.occluderCacheHits;
+    mirrorRays += other.mirrorRays;
+    cutPaths += other.cutPaths;
+    gBufferPixels += other.gBufferPixels;
+    resumedPixels += other.resumedPixels;
+    shadowMapLookups += other.shadowMapLookups;
+    rasterPixels += other.rasterPixels;
+
+    return *this;
+}
+
+// Scrambles a pixel's coordinates into a nonzero xorshift state.
+static std::uint32_t pixel_seed(std::uint32_t x, std::uint32_t y)
+{
+    std::uint32_t h = x * 0x9e3779b1u ^ y * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+
+    return h ? h : 1;
+}
+
+// Uniform in [0, 1).
+static float next_random(std::uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return (state >> 8) * (1.0f / (1u << 24));
+}
+
+// FNV-1a of size bytes at data, continuing from hash.
+static void hash_bytes(std::uint64_t &hash, const void *data, std::size_t size)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+}
+
+// Text along with its terminator, so that consecutive strings cannot run
+// into each other.
+static void hash_text(std::uint64_t &hash, const char *text)
+{
+    hash_bytes(hash, text, std::strlen(text) + 1);
+}
+
+// Hashes element and everything in it but cameras, which renders hash
+// themselves (see camera_key). Unless shading is set, the elements that only
+// change how hits are shaded are left out too (see Scene::visibilityKey).
+static void hash_element(std::uint64_t &hash, const XMLElement *element,
+                         bool shading)
+{
+    static const char *const shading_only[] = {
+        "Materials", "Intensity", "AmbientLight", "BackgroundColor",
+        "MaxRecursionDepth"};
+
+    if (!std::strcmp(element->Name(), "Cameras"))
+        return;
+    if (!shading)
+        for (auto name : shading_only)
+            if (!std::strcmp(element->Name(), name))
+                return;
+
+    hash_text(hash, element->Name());
+    for (auto attribute = element->FirstAttribute(); attribute;
+         attribute = attribute->Next()) {
+        hash_text(hash, attribute->Name());
+        hash_text(hash, attribute->Value());
+    }
+    if (element->GetText())
+        hash_text(hash, element->GetText());
+
+    for (auto child = element->FirstChildElement(); child;
+         child = child->NextSiblingElement())
+        hash_element(hash, child, shading);
+}
+
+// key with what camera sees of the scene added in, everything but its image
+// name.
+static std::uint64_t camera_key(std::uint64_t key, const Camera *camera)
+{
+    hash_bytes(key, &camera->getPosition(), sizeof(vec3f));
+    hash_bytes(key, &camera->getGaze(), sizeof(vec3f));
+    hash_bytes(key, &camera->getUp(), sizeof(vec3f));
+    hash_bytes(key, &camera->imgPlane, sizeof(camera->imgPlane));
+
+    return key;
+}
+
+// Side of the blocks of pixels traced as one packet.
+static constexpr int PACKET_SIDE = 8;
+static_assert(PACKET_SIDE * PACKET_SIDE <= RayPacket::SIZE,
+              "a block must fit in a packet");
+
+// Side of the tiles heatmaps total their work over.
+static constexpr int HEAT_TILE_SIZE = 32;
+
+// Side of the tiles checkpoints keep. Small enough that little work is lost
+// with the tiles in flight, large enough that each is worth a write.
+static constexpr int CHECKPOINT_TILE_SIZE = 64;
+
+RenderStats Scene::render_partial(Image &image, const Camera *camera,
+                                  int u_min, int u_max, GBuffer *gbuffer,
+                                  Heatmap *heat) const
+{
+    const int v_min = image.originY;
+    const int v_max = image.originY + image.height;
+    TraceSpan span("tile", "x %d-%d, y %d-%d", u_min, u_max, v_min, v_max);
+
+    ThreadState state;
+    state.lastOccluder.assign(lights.size(), Occluder());
+
+    // Only packets keep primary hits and shadows apart from shading, for a
+    // G-buffer to take. Heatmaps need the work of each pixel on its own.
+    if ((packets && !heat) || gbuffer) {
+        for (int u = u_min; u < u_max; u += PACKET_SIDE)
+            for (int v = v_min; v < v_max; v += PACKET_SIDE)
+                trace_block(image, camera,
+                            {u, v, std::min(u + PACKET_SIDE, u_max),
+                             std::min(v + PACKET_SIDE, v_max)},
+                            gbuffer, state);
+
+        return state.stats;
+    }
+
+    std::vector<Ray> column(v_max - v_min);
 
     for (std::size_t i = u_min; i < u_max; ++i) {
-        for (std::size_t j = 0; j < height; ++j) {
-            Ray ray = camera->getPrimaryRay(i, j);
-            vec3f color = ray_color(ray, 0);
+        camera->getPrimaryRays(i, v_min, v_max, column.data());
+
+        for (std::size_t j = v_min; j < v_max; ++j) {
+            const TraversalWork work = traversal_work;
+            const RenderStats stats = state.stats;
+
+            state.random = pixel_seed(i, j);
+            vec3f color = ray_color(column[j - v_min], 0, {1, 1, 1}, state);
+            image.setPixelValue(i, j, to_output_color(color));
+
+            if (heat)
+                heat->at(i, j) = {
+                    static_cast<std::uint32_t>(traversal_work.nodeVisits -
+                                               work.nodeVisits),
+                    static_cast<std::uint32_t>(traversal_work.primitiveTests -
+                                               work.primitiveTests),
+                    static_cast<std::uint32_t>(
+                        1 + state.stats.shadowRays - stats.shadowRays +
+                        state.stats.mirrorRays - stats.mirrorRays)};
+        }
+    }
+
+    return state.stats;
+}
+
+// Renders the columns [u_min, u_max) of image from the primary hits and
+// shadows in gbuffer. Only mirror bounces are traced.
+RenderStats Scene::reshade_partial(Image &image, const Camera *camera,
+                                   const GBuffer &gbuffer, int u_min,
+                                   int u_max) const
+{
+    const int v_min = image.originY;
+    const int v_max = image.originY + image.height;
+    TraceSpan span("reshade", "x %d-%d, y %d-%d", u_min, u_max, v_min,
+                   v_max);
+
+    ThreadState state;
+    state.lastOccluder.assign(lights.size(), Occluder());
+
+    std::vector<Ray> column(v_max - v_min);
+
+    for (int i = u_min; i < u_max; ++i) {
+        camera->getPrimaryRays(i, v_min, v_max, column.data());
+
+        for (int j = v_min; j < v_max; ++j) {
+            state.random = pixel_seed(i, j);
+            vec3f color = shade_primary(column[j - v_min],
+                                        gbuffer.record(i, j),
+                                        gbuffer.shadows(i, j), state);
+            image.setPixelValue(i, j, to_output_color(color));
+        }
+    }
+
+    state.stats.gBufferPixels = std::size_t(u_max - u_min) * (v_max - v_min);
+
+    return state.stats;
+}
+
+// Renders the columns [u_min, u_max) of image with the primitive vbuf sees
+// at each pixel in place of tracing its primary ray. The hit is worked out
+// again from the ray, so it is the one tracing gives wherever both agree.
+RenderStats Scene::render_visible(Image &image, const Camera *camera,
+                                  const VisibilityBuffer &vbuf, int u_min,
+                                  int u_max) const
+{
+    const int v_min = image.originY;
+    const int v_max = image.originY + image.height;
+    TraceSpan span("shade", "x %d-%d, y %d-%d", u_min, u_max, v_min, v_max);
+
+    ThreadState state;
+    state.lastOccluder.assign(lights.size(), Occluder());
+
+    std::vector<Ray> column(v_max - v_min);
+
+    for (int i = u_min; i < u_max; ++i) {
+        camera->getPrimaryRays(i, v_min, v_max, column.data());
+
+        for (int j = v_min; j < v_max; ++j) {
+            const Ray &ray = column[j - v_min];
+            const Shape *shape = vbuf.at(i, j);
+            vec3f color;
+
+            state.random = pixel_seed(i, j);
+            if (!shape) {
+                color = shade_primary(ray, NO_HIT, nullptr, state);
+            } else if (Hit hit = shape->hit(ray); hit.t > 0) {
+                color = shade_primary(ray, hit.shape->hitRecord(ray, hit),
+                                      nullptr, state);
+            } else {
+                // Rasterized onto a pixel its ray just misses
+                color = ray_color(ray, 0, {1, 1, 1}, state);
+            }
             image.setPixelValue(i, j, to_output_color(color));
         }
     }
+
+    state.stats.rasterPixels = std::size_t(u_max - u_min) * (v_max - v_min);
+
+    return state.stats;
+}
+
+// Renders block, at most PACKET_SIDE pixels square, with its primary rays as
+// one packet. Shadow rays toward each light go out from all of the hits as
+// one packet too, and shading then only traces the mirror bounces. Every
+// pixel gets the color ray_color would give it. The hits and shadows are
+// also stored in gbuffer, if given.
+void Scene::trace_block(Image &image, const Camera *camera, const Tile &block,
+                        GBuffer *gbuffer, ThreadState &state) const
+{
+    const int height = block.y1 - block.y0;
+    Ray rays[RayPacket::SIZE];
+
+    for (int u = block.x0; u < block.x1; ++u)
+        camera->getPrimaryRays(u, block.y0, block.y1,
+                               rays + (u - block.x0) * height);
+
+    const RayPacket packet(rays, (block.x1 - block.x0) * height);
+    Hit hits[RayPacket::SIZE];
+    HitRecord records[RayPacket::SIZE];
+    std::uint64_t hit_mask = 0;
+
+    closest_hits(packet, hits);
+    for_each_ray(packet.all(), [&](int i) {
+        if (hits[i].t > 0) {
+            records[i] = hits[i].shape->hitRecord(rays[i], hits[i]);
+            hit_mask |= std::uint64_t(1) << i;
+        } else {
+            records[i] = NO_HIT;
+        }
+    });
+
+    // Shading looks shadows up itself when there are shadow maps.
+    const std::size_t words = (lights.size() + 63) / 64;
+    std::vector<std::uint64_t> shadowed(RayPacket::SIZE * words);
+    for (std::size_t l = 0; l < lights.size() && shadowMaps.empty(); ++l)
+        trace_shadows(rays, records, hit_mask, l, shadowed.data(), words,
+                      state);
+
+    for_each_ray(packet.all(), [&](int i) {
+        const int u = block.x0 + i / height, v = block.y0 + i % height;
+        const std::uint64_t *pixel_shadowed = &shadowed[i * words];
+
+        if (gbuffer) {
+            gbuffer->record(u, v) = records[i];
+            std::copy(pixel_shadowed, pixel_shadowed + words,
+                      gbuffer->shadows(u, v));
+        }
+
+        state.random = pixel_seed(u, v);
+        vec3f color = shade_primary(rays[i], records[i], pixel_shadowed, state);
+        image.setPixelValue(u, v, to_output_color(color));
+    });
+}
+
+// What ray_color gives a primary ray whose closest hit, if any, is hr, and
+// whose shadow rays have already been traced.
+vec3f Scene::shade_primary(const Ray &ray, const HitRecord &hr,
+                           const std::uint64_t *shadowed,
+                           ThreadState &state) const
+{
+    if (maxRecursionDepth < 0)
+        return {0, 0, 0};
+    if (hr.t <= 0)
+        return backgroundColor;
+
+    const CompiledMaterial &material = compiledMaterials[hr.materialIdx - 1];
+
+    state.knownShadows = shadowed;
+    vec3f color =
+        (this->*material.kernel)(ray, hr, material, 0, {1, 1, 1}, state);
+    state.knownShadows = nullptr;
+
+    return color;
 }
 
-vec3f Scene::ray_color(Ray ray, int depth) const
+// Closest hit in the scene of every ray of packet, resolved between objects
+// like ray_color does.
+void Scene::closest_hits(const RayPacket &packet, Hit *hits) const
+{
+    Hit object_hits[RayPacket::SIZE];
+    float t_min[RayPacket::SIZE];
+
+    for_each_ray(packet.all(), [&](int i) {
+        hits[i] = MISS;
+        t_min[i] = std::numeric_limits<float>::max();
+    });
+
+    for (auto object : objects) {
+        object->hitPacket(packet, packet.all(), object_hits);
+
+        for_each_ray(packet.all(), [&](int i) {
+            const float t_hit = object_hits[i].t;
+
+            if (t_hit > 0 && t_hit < t_min[i]) {
+                t_min[i] = t_hit;
+                hits[i] = object_hits[i];
+            }
+        });
+    }
+}
+
+// Traces the shadow rays toward light lightIdx from the hits in active of
+// rays as one packet, and sets that light's bit in shadowed, words per hit,
+// for those it is blocked from. The occluder cache is left alone: whole
+// objects are tested at once here, not single primitives.
+void Scene::trace_shadows(const Ray *rays, const HitRecord *records,
+                          std::uint64_t active, std::size_t lightIdx,
+                          std::uint64_t *shadowed, std::size_t words,
+                          ThreadState &state) const
+{
+    Ray shadow_rays[RayPacket::SIZE];
+    float distances[RayPacket::SIZE];
+    int pixels[RayPacket::SIZE]; // Index in the block of each ray
+    int count = 0;
+
+    for_each_ray(active, [&](int i) {
+        shadow_rays[count] = shadow_ray(records[i].pos, lights[lightIdx],
+                                        rays[i].widthAt(records[i].t),
+                                        distances[count]);
+        pixels[count++] = i;
+    });
+
+    if (!count)
+        return;
+
+    const RayPacket packet(shadow_rays, count);
+    Hit hits[RayPacket::SIZE];
+    std::uint64_t pending = packet.all();
+
+    state.stats.shadowRays += count;
+
+    for (auto object : objects) {
+        if (!pending)
+            break;
+
+        object->hitPacket(packet, pending, hits);
+
+        for_each_ray(pending, [&](int k) {
+            if (hits[k].t > 0 && hits[k].t <= distances[k]) {
+                pending &= ~(std::uint64_t(1) << k);
+                shadowed[pixels[k] * words + lightIdx / 64] |=
+                    std::uint64_t(1) << lightIdx % 64;
+                ++state.stats.occludedRays;
+            }
+        });
+    }
+}
+
+// Ray from pos on a surface toward light, starting just off the surface. It
+// is width across there, the footprint of the ray that found pos, and
+// narrows to nothing at the light.
+Ray Scene::shadow_ray(const vec3f &pos, const PointLight *light, float width,
+                      float &light_distance) const
+{
+    vec3f light_vector = light->position - pos;
+    vec3f light_direction = light_vector.normalize();
+    light_distance = light_vector.norm();
+
+    Ray ray(pos + shadowRayEps * light_direction, light_direction);
+    ray.coneWidth = width;
+    ray.coneSpread = -width / light_distance;
+
+    return ray;
+}
+
+bool Scene::in_shadow(const Ray &light_ray, float light_distance, int lightIdx,
+                      ThreadState &state) const
+{
+    auto occludes = [&light_distance](const Hit &hit_shadow) {
+        return hit_shadow.t > 0 && hit_shadow.t <= light_distance;
+    };
+
+    ++state.stats.shadowRays;
+
+    // Any hit closer than the light puts the point in shadow, so the cached
+    // primitive can answer without touching the rest of the scene.
+    Occluder &cached = state.lastOccluder[lightIdx];
+    if (cached.shape &&
+        (!cached.mesh || cached.mesh->levelFor(light_ray) == cached.level) &&
+        occludes(cached.shape->hit(light_ray))) {
+        ++state.stats.occludedRays;
+        ++state.stats.occluderCacheHits;
+        return true;
+    }
+
+    for (auto object : objects) {
+        auto hit_shadow = object->hit(light_ray);
+        if (occludes(hit_shadow)) {
+            ++state.stats.occludedRays;
+            // Triangles of paged meshes are not shapes of their own, and
+            // retesting the whole mesh would be no shortcut.
+            if (hit_shadow.index == -1)
+                cached = {hit_shadow.shape};
+            else if (hit_shadow.index < -1)
+                cached = {hit_shadow.shape, static_cast<const Mesh *>(object),
+                          lod_level(hit_shadow.index)};
+            else
+                cached = {};
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Renders the shadow map of every light, one task per face on pool.
+void Scene::build_shadow_maps(ThreadPool &pool)
+{
+    TraceSpan span("shadow maps", "%zu lights, %d texels", lights.size(),
+                   shadowMapSize);
+
+    shadowMaps.clear();
+    for (auto light : lights)
+        shadowMaps.emplace_back(light->position, shadowMapSize);
+
+    std::vector<std::future<void>> tasks;
+    for (std::size_t l = 0; l < lights.size(); ++l)
+        for (int face = 0; face < 6; ++face)
+            tasks.push_back(pool.submit([this, l, face] {
+                render_shadow_face(lights[l], shadowMaps[l], face);
+            }));
+
+    // Every task refers to the maps, so all of them must be done before an
+    // error can leave.
+    std::exception_ptr error;
+    for (auto &task : tasks) {
+        try {
+            task.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Finds the nearest surface through each texel of one face of map, tracing
+// rays out from light in packets of PACKET_SIDE texels square.
+void Scene::render_shadow_face(const PointLight *light, ShadowMap &map,
+                               int face) const
+{
+    const int size = map.resolution();
+    Ray rays[RayPacket::SIZE];
+    Hit hits[RayPacket::SIZE];
+
+    for (int y0 = 0; y0 < size; y0 += PACKET_SIDE) {
+        for (int x0 = 0; x0 < size; x0 += PACKET_SIDE) {
+            const int x1 = std::min(x0 + PACKET_SIDE, size);
+            const int y1 = std::min(y0 + PACKET_SIDE, size);
+            int count = 0;
+
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    rays[count++] =
+                        Ray(light->position, map.direction(face, x, y));
+
+            const RayPacket packet(rays, count);
+            closest_hits(packet, hits);
+
+            count = 0;
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x, ++count)
+                    if (hits[count].t > 0)
+                        map.depth(face, x, y) = hits[count].t;
+        }
+    }
+}
+
+// Decides whether a mirror bounce with the given throughput is traced, and
+// if so with what weight its result counts.
+bool Scene::keep_path(const vec3f &throughput, float &weight,
+                      ThreadState &state) const
+{
+    const float strongest =
+        std::max({throughput.r, throughput.g, throughput.b});
+
+    weight = 1;
+    if (strongest >= pathCutoff)
+        return true;
+
+    if (russianRoulette) {
+        const float survival = strongest / pathCutoff;
+        if (next_random(state.random) < survival) {
+            weight = 1 / survival;
+            return true;
+        }
+    }
+
+    ++state.stats.cutPaths;
+    return false;
+}
+
+vec3f Scene::ray_color(Ray ray, int depth, const vec3f &throughput,
+                       ThreadState &state) const
 {
     vec3f color = {0, 0, 0};
 
@@ -48,121 +575,709 @@ vec3f Scene::ray_color(Ray ray, int depth) const
         return color;
 
     float t_min = std::numeric_limits<float>::max();
-    HitRecord hr_min = NO_HIT;
+    Hit hit_min = MISS;
 
     for (auto object : objects) {
-        HitRecord hr = object->intersect(ray);
-        auto t_hit = hr.t;
+        Hit hit = object->hit(ray);
+        auto t_hit = hit.t;
 
         if (t_hit > 0 && t_hit < t_min) {
             t_min = t_hit;
-            hr_min = hr;
+            hit_min = hit;
         }
     }
 
-    if (hr_min.t > 0) {
-        // Viewing ray intersected with an object.
-        Material *material = materials[hr_min.materialIdx - 1];
+    if (hit_min.t > 0) {
+        // Viewing ray intersected with an object. Only now is it worth
+        // working out where and at what angle.
+        HitRecord hr_min = hit_min.shape->hitRecord(ray, hit_min);
+        const CompiledMaterial &material =
+            compiledMaterials[hr_min.materialIdx - 1];
 
-        if (material->mirrorRef.norm() > 0) {
-            vec3f reflection_vector =
-                ray.direction -
-                2.0f * (hr_min.normal * ray.direction) * hr_min.normal;
-            Ray reflection_ray(hr_min.pos + shadowRayEps * reflection_vector,
-                               reflection_vector.normalize());
+        return (this->*material.kernel)(ray, hr_min, material, depth,
+                                        throughput, state);
+    }
 
-            // Mirror component
-            vec3f mirror = giraffe::oymak(material->mirrorRef,
-                                          ray_color(reflection_ray, depth + 1));
-            color = color + mirror;
-        }
+    return backgroundColor;
+}
 
-        // Ambient shading
-        vec3f ambient = giraffe::oymak(ambientLight, material->ambientRef);
-        color = color + ambient;
-
-        for (auto light : lights) {
-            vec3f light_vector = light->position - hr_min.pos;
-            float light_distance = light_vector.norm();
-            vec3f light_contribution =
-                light->computeLightContribution(hr_min.pos);
-            Ray light_ray(hr_min.pos + shadowRayEps * light_vector.normalize(),
-                          light_vector.normalize());
-
-            // Shadow computation
-            bool in_shadow = std::any_of(
-                objects.cbegin(), objects.cend(),
-                [&light_ray, &light_distance](auto object) {
-                    auto hr_shadow = object->intersect(light_ray);
-                    return hr_shadow.t > 0 && hr_shadow.t <= light_distance;
-                });
-            if (in_shadow)
+// x to the power of n, in double precision like std::pow(float, int). Small
+// exponents are unrolled at compile time; Exp < 0 leaves n to run time.
+template <int Exp> static double phong_power(double x, int n)
+{
+    if constexpr (Exp == 0) {
+        return 1;
+    } else if constexpr (Exp > 0) {
+        return phong_power<Exp - 1>(x, n) * x;
+    } else {
+        return std::pow(x, n);
+    }
+}
+
+// Shading for a hit on material. Terms the material does not have are
+// compiled out, rather than computed and found to be zero.
+template <bool Mirror, bool Specular, int Exp>
+vec3f Scene::shade(const Ray &ray, const HitRecord &hr,
+                   const CompiledMaterial &material, int depth,
+                   const vec3f &throughput, ThreadState &state) const
+{
+    vec3f color = {0, 0, 0};
+    float weight;
+
+    // Past the depth limit the bounce would come back black anyway.
+    if (Mirror && depth < maxRecursionDepth &&
+        keep_path(giraffe::oymak(throughput, material.mirrorRef), weight,
+                  state)) {
+        vec3f reflection_vector =
+            ray.direction - 2.0f * (hr.normal * ray.direction) * hr.normal;
+        Ray reflection_ray(hr.pos + shadowRayEps * reflection_vector,
+                           reflection_vector.normalize());
+        // As wide as the ray was here, and spreading as fast, as off a
+        // flat mirror
+        reflection_ray.coneWidth = ray.widthAt(hr.t);
+        reflection_ray.coneSpread = ray.coneSpread;
+        vec3f reflected_throughput =
+            weight * giraffe::oymak(throughput, material.mirrorRef);
+
+        ++state.stats.mirrorRays;
+
+        // Mirror component
+        vec3f mirror = weight * giraffe::oymak(material.mirrorRef,
+                                               ray_color(reflection_ray,
+                                                         depth + 1,
+                                                         reflected_throughput,
+                                                         state));
+        color = color + mirror;
+    }
+
+    // Ambient shading
+    color = color + material.ambient;
+
+    vec3f to_eye;
+    if (Specular)
+        to_eye = -ray.direction.normalize();
+
+    for (std::size_t l = 0; l < lights.size(); ++l) {
+        auto light = lights[l];
+        float light_distance;
+        Ray light_ray =
+            shadow_ray(hr.pos, light, ray.widthAt(hr.t), light_distance);
+        const vec3f &light_direction = light_ray.direction;
+        vec3f light_contribution = light->computeLightContribution(hr.pos);
+
+        // Shadow computation: looked up in the light's shadow map if there
+        // are any, already done for primary hits traced in packets or read
+        // from a G-buffer, or traced here
+        if (!shadowMaps.empty()) {
+            const float visibility =
+                shadowMaps[l].visibility(hr.pos, hr.normal, shadowMapKernel);
+            ++state.stats.shadowMapLookups;
+            if (visibility <= 0)
                 continue;
+            light_contribution = visibility * light_contribution;
+        } else if (depth == 0 && state.knownShadows
+                       ? state.knownShadows[l / 64] >> l % 64 & 1
+                       : in_shadow(light_ray, light_distance, l, state)) {
+            continue;
+        }
 
-            // Diffuse component
-            vec3f diffuse =
-                std::max(0.0f, hr_min.normal * light_vector.normalize()) *
-                giraffe::oymak(material->diffuseRef, light_contribution);
-            color = color + diffuse;
+        // Diffuse component
+        vec3f diffuse = std::max(0.0f, hr.normal * light_direction) *
+                        giraffe::oymak(material.diffuseRef, light_contribution);
+        color = color + diffuse;
 
+        if (Specular) {
             // Specular component (Blinn-Phong)
-            vec3f h = -ray.direction.normalize() + light_vector.normalize();
+            vec3f h = to_eye + light_direction;
             h = h / h.norm();
             vec3f specular =
-                std::pow(std::max(0.0f, hr_min.normal * h),
-                         material->phongExp) *
-                giraffe::oymak(material->specularRef, light_contribution);
+                phong_power<Exp>(std::max(0.0f, hr.normal * h),
+                                 material.phongExp) *
+                giraffe::oymak(material.specularRef, light_contribution);
             color = color + specular;
         }
+    }
 
-        return color;
+    return color;
+}
+
+static double percentage(unsigned long part, unsigned long whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+void Scene::reportStats(const Camera *camera, const RenderStats &stats) const
+{
+    std::cerr << camera->imageName << ":\n";
+    std::cerr << "  shadow rays:          " << stats.shadowRays << "\n";
+    std::cerr << "  occluded shadow rays: " << stats.occludedRays << " ("
+              << percentage(stats.occludedRays, stats.shadowRays) << "%)\n";
+    std::cerr << "  occluder cache hits:  " << stats.occluderCacheHits << " ("
+              << percentage(stats.occluderCacheHits, stats.occludedRays)
+              << "% of occluded)\n";
+
+    if (stats.shadowMapLookups)
+        std::cerr << "  shadow map lookups:   " << stats.shadowMapLookups
+                  << " (" << shadowMaps.size() << " maps of 6x"
+                  << shadowMapSize << "x" << shadowMapSize << ")\n";
+
+    if (stats.gBufferPixels)
+        std::cerr << "  g-buffer pixels:      " << stats.gBufferPixels
+                  << " (primary rays not traced)\n";
+
+    if (stats.rasterPixels)
+        std::cerr << "  rasterized pixels:    " << stats.rasterPixels
+                  << " (primary rays not traced)\n";
+
+    if (stats.resumedPixels)
+        std::cerr << "  resumed pixels:       " << stats.resumedPixels
+                  << " (taken from a checkpoint)\n";
+
+    if (stats.mirrorRays || stats.cutPaths)
+        std::cerr << "  mirror rays:          " << stats.mirrorRays << " ("
+                  << stats.cutPaths << " cut for low throughput)\n";
+
+    if (meshHierarchyBytes)
+        std::cerr << "  mesh hierarchies:     " << meshHierarchyBytes / 1024
+                  << " KiB\n";
+
+    if (gridMeshes || kdTreeMeshes)
+        std::cerr << "  mesh accelerators:    " << gridMeshes << " grid, "
+                  << kdTreeMeshes << " kd-tree (the rest bvh)\n";
+
+    if (meshLevels)
+        std::cerr << "  mesh lods:            " << meshLevels
+                  << " simplified levels\n";
+
+    if (splitMeshFaces)
+        std::cerr << "  spatial splits:       " << splitMeshReferences
+                  << " references to " << splitMeshFaces << " faces (+"
+                  << percentage(splitMeshReferences - splitMeshFaces,
+                                splitMeshFaces)
+                  << "%)\n";
+
+    if (pageFile) {
+        std::cerr << "  mesh pages:           " << pageFile->pageCount()
+                  << " (" << pageFile->pageCount() * PageFile::PAGE_SIZE / 1024
+                  << " KiB on disk)\n";
+        std::cerr << "  page cache hits:      " << pageFile->hits() << "\n";
+        std::cerr << "  page faults:          " << pageFile->faults() << "\n";
     }
+}
 
-    return backgroundColor;
+// imageName with suffix inserted before its extension, and the extension
+// replaced if one is given: "output.ppm" and "_heat" make "output_heat.ppm".
+static std::string image_name_with(const std::string &imageName,
+                                   const char *suffix,
+                                   const char *extension = nullptr)
+{
+    auto dot = imageName.rfind('.');
+    if (dot == std::string::npos ||
+        imageName.find('/', dot) != std::string::npos)
+        dot = imageName.size();
+
+    return imageName.substr(0, dot) + suffix +
+           (extension ? extension : imageName.substr(dot));
 }
 
-void Scene::renderScene(void)
+// Calls render_columns(u_min, u_max) on pool for an even share of tile's
+// columns per thread, and adds up the stats they return.
+template <class F>
+static RenderStats split_columns(const Image &tile, ThreadPool &pool,
+                                 F render_columns)
 {
-    for (auto camera : cameras) {
-        auto width = camera->imgPlane.nx;
-        auto height = camera->imgPlane.ny;
+    const int width = tile.width;
+    const int x0 = tile.originX;
+    RenderStats stats;
 
-        Image image(width, height);
+    const unsigned int num_threads = pool.size();
+    const int stride = static_cast<int>(width / num_threads);
 
-        // std::thread::hardware_concurrency returns zero when the value is not
-        // well defined or computable, so we force the rendering to run in a
-        // single thread in that case.
-        const unsigned int num_threads =
-            std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::future<RenderStats>> tasks;
 
-        const int stride = static_cast<int>(width / num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i) {
+        tasks.push_back(pool.submit([&, i] {
+            return render_columns(x0 + i * stride, x0 + (i + 1) * stride);
+        }));
+    }
+
+    // One last task in case width is not divisible by num_threads
+    if (width % num_threads) {
+        tasks.push_back(pool.submit([&] {
+            return render_columns(x0 + num_threads * stride, x0 + width);
+        }));
+    }
 
-        // Block scope for async tasks ensure they are waited for, before saving
-        // the image.
+    for (auto &task : tasks)
+        stats += task.get();
+
+    return stats;
+}
+
+RenderStats Scene::renderTile(const Camera *camera, Image &tile,
+                              ThreadPool &pool) const
+{
+    return split_columns(tile, pool, [&](int u_min, int u_max) {
+        return render_partial(tile, camera, u_min, u_max);
+    });
+}
+
+RenderStats Scene::render(const Camera *camera, const Tile &tile,
+                          unsigned char *buffer, ThreadPool &pool) const
+{
+    Image image(reinterpret_cast<Color *>(buffer), tile.x1 - tile.x0,
+                tile.y1 - tile.y0, tile.x0, tile.y0);
+
+    return renderTile(camera, image, pool);
+}
+
+RenderStats Scene::render(const Camera *camera, const Tile &tile,
+                          unsigned char *buffer) const
+{
+    Image image(reinterpret_cast<Color *>(buffer), tile.x1 - tile.x0,
+                tile.y1 - tile.y0, tile.x0, tile.y0);
+
+    return render_partial(image, camera, tile.x0, tile.x1);
+}
+
+// Renders the tiles of image that checkpoint does not have yet, one task per
+// tile on pool, and hands each to checkpoint as it finishes.
+RenderStats Scene::render_checkpointed(const Camera *camera, Image &image,
+                                       Checkpoint &checkpoint,
+                                       ThreadPool &pool) const
+{
+    std::vector<std::future<RenderStats>> tasks;
+
+    for (int i = 0; i < checkpoint.tileCount(); ++i) {
+        if (checkpoint.isDone(i))
+            continue;
+
+        tasks.push_back(pool.submit([&, i] {
+            const Tile tile = checkpoint.tile(i);
+            const int width = tile.x1 - tile.x0;
+            std::vector<Color> pixels(std::size_t(width) *
+                                      (tile.y1 - tile.y0));
+
+            RenderStats stats =
+                render(camera, tile,
+                       reinterpret_cast<unsigned char *>(pixels.data()));
+
+            for (int y = tile.y0; y < tile.y1; ++y)
+                std::copy(&pixels[std::size_t(y - tile.y0) * width],
+                          &pixels[std::size_t(y - tile.y0) * width] + width,
+                          image.data[y] + tile.x0);
+            checkpoint.save(i, pixels.data());
+
+            return stats;
+        }));
+    }
+
+    // Every task refers to image and checkpoint, so all of them must be done
+    // before an error can leave.
+    RenderStats stats;
+    std::exception_ptr error;
+
+    for (auto &task : tasks) {
+        try {
+            stats += task.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    return stats;
+}
+
+// Every sphere and triangle in the scene, as they are now. False if some
+// object cannot list its own, and primary rays have to be traced.
+bool Scene::collect_primitives(std::vector<RasterPrimitive> &primitives) const
+{
+    for (auto object : objects)
+        if (!object->collectPrimitives(primitives))
+            return false;
+
+    return true;
+}
+
+RenderStats Scene::renderCamera(const Camera *camera, ThreadPool &pool,
+                                const char *imageName) const
+{
+    Image image(camera->imgPlane.nx, camera->imgPlane.ny);
+    const std::string name = imageName ? imageName : camera->imageName;
+    std::unique_ptr<Checkpoint> checkpoint;
+    std::vector<RasterPrimitive> primitives;
+    RenderStats stats;
+
+    if (heatmap != HeatMetric::None) {
+        Heatmap heat(image.width, image.height);
+
+        stats = split_columns(image, pool, [&](int u_min, int u_max) {
+            return render_partial(image, camera, u_min, u_max, nullptr,
+                                  &heat);
+        });
+
+        heat.saveImage(image_name_with(name, "_heat"), heatmap);
+        heat.saveTiles(image_name_with(name, "_heat", ".csv"), heatmap,
+                       HEAT_TILE_SIZE);
+    } else if (gBuffers) {
+        // Shade from the last render's G-buffer if the geometry is still
+        // what it was, otherwise trace and keep a new one.
+        const std::string path = name + ".gbuffer";
+        const std::uint64_t key = camera_key(visibilityKey, camera);
+        auto gbuffer = GBuffer::load(path, image.width, image.height,
+                                     lights.size(), key);
+
+        if (gbuffer) {
+            stats = split_columns(image, pool, [&](int u_min, int u_max) {
+                return reshade_partial(image, camera, *gbuffer, u_min, u_max);
+            });
+        } else {
+            gbuffer.reset(
+                new GBuffer(image.width, image.height, lights.size(), key));
+            stats = split_columns(image, pool, [&](int u_min, int u_max) {
+                return render_partial(image, camera, u_min, u_max,
+                                      gbuffer.get());
+            });
+            gbuffer->save(path);
+        }
+    } else if (checkpoints) {
+        checkpoint.reset(new Checkpoint(name + ".checkpoint", image,
+                                        CHECKPOINT_TILE_SIZE,
+                                        camera_key(imageKey, camera), resume,
+                                        checkpointInterval));
+        stats = render_checkpointed(camera, image, *checkpoint, pool);
+        stats.resumedPixels = checkpoint->restoredPixels();
+    } else if (rasterPrimary && collect_primitives(primitives)) {
+        std::unique_ptr<VisibilityBuffer> vbuf;
         {
-            std::vector<std::future<void>> tasks;
+            TraceSpan span("raster", "%zu primitives", primitives.size());
+            vbuf.reset(
+                new VisibilityBuffer(camera, std::move(primitives), pool));
+        }
+        stats = split_columns(image, pool, [&](int u_min, int u_max) {
+            return render_visible(image, camera, *vbuf, u_min, u_max);
+        });
+    } else {
+        stats = renderTile(camera, image, pool);
+    }
 
-            for (std::size_t i = 0; i < num_threads; ++i) {
-                tasks.push_back(std::async(std::launch::async, [&, i] {
-                    render_partial(image, camera, i * stride, (i + 1) * stride);
-                }));
-            }
+    image.saveImage(name.c_str());
 
-            // One last thread in case width is not divisible by num_threads
-            if (width % num_threads) {
-                tasks.push_back(std::async(std::launch::async, [&] {
-                    render_partial(image, camera, num_threads * stride, width);
-                }));
-            }
+    // The image is complete on disk now.
+    if (checkpoint)
+        checkpoint->remove();
+
+    if (printStats)
+        reportStats(camera, stats);
+
+    return stats;
+}
+
+void Scene::renderScene(void)
+{
+    ThreadPool pool;
+
+    for (auto camera : cameras)
+        renderCamera(camera, pool);
+}
+
+int Scene::setVertices(const std::vector<vec3f> &positions, ThreadPool &pool,
+                       float rebuildRatio)
+{
+    if (pageFile)
+        throw std::runtime_error("out-of-core scenes cannot be animated");
+    if (positions.size() != vertices.size())
+        throw std::runtime_error("frame has " +
+                                 std::to_string(positions.size()) +
+                                 " vertices, scene has " +
+                                 std::to_string(vertices.size()));
+
+    TraceSpan span("refit");
+    vertices = positions;
+
+    // Saved G-buffers and checkpoints are for the vertices of the frame
+    // they were saved with.
+    if (gBuffers)
+        hash_bytes(visibilityKey, positions.data(),
+                   positions.size() * sizeof(vec3f));
+    if (checkpoints)
+        hash_bytes(imageKey, positions.data(),
+                   positions.size() * sizeof(vec3f));
+
+    int rebuilt = 0;
+    for (auto object : objects)
+        rebuilt += object->refit(pool, rebuildRatio);
+
+    if (!shadowMaps.empty())
+        build_shadow_maps(pool);
+
+    return rebuilt;
+}
+
+// "output.ppm" becomes "output_0007.ppm" for frame 7.
+static std::string frame_image_name(const std::string &imageName, int frame)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", frame);
+
+    return image_name_with(imageName, suffix);
+}
+
+void Scene::renderSequence(const std::vector<const char *> &frames,
+                           float rebuildRatio)
+{
+    ThreadPool pool;
+
+    for (std::size_t frame = 0; frame <= frames.size(); ++frame) {
+        if (frame > 0) {
+            auto start = std::chrono::steady_clock::now();
+            int rebuilt =
+                setVertices(load_vertex_stream(frames[frame - 1]), pool,
+                            rebuildRatio);
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+            if (printStats)
+                std::cerr << "frame " << frame << ": " << frames[frame - 1]
+                          << " loaded and refitted in " << elapsed.count()
+                          << " ms, " << rebuilt << " meshes rebuilt\n";
         }
 
-        image.saveImage(camera->imageName.c_str());
+        for (auto camera : cameras)
+            renderCamera(camera, pool,
+                         frame_image_name(camera->imageName, frame).c_str());
+    }
+}
+
+void Scene::setCameras(const std::vector<Camera> &replacement)
+{
+    for (auto camera : cameras)
+        delete camera;
+    cameras.clear();
+
+    for (auto &camera : replacement)
+        cameras.push_back(new Camera(camera));
+}
+
+Scene::~Scene()
+{
+    for (auto camera : cameras)
+        delete camera;
+    for (auto light : lights)
+        delete light;
+    for (auto material : materials)
+        delete material;
+    for (auto object : objects)
+        delete object;
+
+    delete pageFile;
+}
+
+template <bool Mirror, bool Specular>
+Scene::ShadeKernel Scene::kernel_for(int phongExp)
+{
+    if (!Specular)
+        return &Scene::shade<Mirror, false, -1>;
+
+    switch (phongExp) {
+    case 0:
+        return &Scene::shade<Mirror, Specular, 0>;
+    case 1:
+        return &Scene::shade<Mirror, Specular, 1>;
+    case 2:
+        return &Scene::shade<Mirror, Specular, 2>;
+    case 3:
+        return &Scene::shade<Mirror, Specular, 3>;
+    case 4:
+        return &Scene::shade<Mirror, Specular, 4>;
+    case 5:
+        return &Scene::shade<Mirror, Specular, 5>;
+    case 6:
+        return &Scene::shade<Mirror, Specular, 6>;
+    case 7:
+        return &Scene::shade<Mirror, Specular, 7>;
+    case 8:
+        return &Scene::shade<Mirror, Specular, 8>;
+    default:
+        return &Scene::shade<Mirror, Specular, -1>;
+    }
+}
+
+// Flattens materials into compiledMaterials and picks a kernel for each.
+// Needs the ambient light.
+void Scene::compile_materials()
+{
+    for (auto material : materials) {
+        CompiledMaterial compiled;
+        compiled.ambient = giraffe::oymak(ambientLight, material->ambientRef);
+        compiled.diffuseRef = material->diffuseRef;
+        compiled.specularRef = material->specularRef;
+        compiled.mirrorRef = material->mirrorRef;
+        compiled.phongExp = material->phongExp;
+
+        const bool mirror = material->mirrorRef.norm() > 0;
+        const bool specular = material->specularRef.x != 0 ||
+                              material->specularRef.y != 0 ||
+                              material->specularRef.z != 0;
+
+        if (mirror && specular)
+            compiled.kernel = kernel_for<true, true>(compiled.phongExp);
+        else if (mirror)
+            compiled.kernel = kernel_for<true, false>(compiled.phongExp);
+        else if (specular)
+            compiled.kernel = kernel_for<false, true>(compiled.phongExp);
+        else
+            compiled.kernel = kernel_for<false, false>(compiled.phongExp);
+
+        compiledMaterials.push_back(compiled);
+    }
+}
+
+// Drops the vertices only paged meshes refer to, since those carry copies.
+void Scene::compact_vertices()
+{
+    std::vector<bool> used(vertices.size());
+    for (auto object : objects)
+        object->collectVertices(used);
+
+    std::vector<int> remap(vertices.size());
+    std::vector<vec3f> compacted;
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        if (used[i]) {
+            compacted.push_back(vertices[i]);
+            remap[i] = compacted.size();
+        }
+    }
+
+    for (auto object : objects)
+        object->remapVertices(remap);
+
+    vertices.swap(compacted);
+    vertices.shrink_to_fit();
+}
+
+// Appends the whitespace separated triples in str to vertices.
+static void parse_vertices(const char *str, std::vector<vec3f> &vertices)
+{
+    int cursor = 0;
+    vec3f tmpPoint;
+    while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
+        cursor++;
+    while (str[cursor] != '\0') {
+        for (int cnt = 0; cnt < 3; cnt++) {
+            if (cnt == 0)
+                tmpPoint.x = atof(str + cursor);
+            else if (cnt == 1)
+                tmpPoint.y = atof(str + cursor);
+            else
+                tmpPoint.z = atof(str + cursor);
+            while (str[cursor] != ' ' && str[cursor] != '\t' &&
+                   str[cursor] != '\n')
+                cursor++;
+            while (str[cursor] == ' ' || str[cursor] == '\t' ||
+                   str[cursor] == '\n')
+                cursor++;
+        }
+        vertices.push_back(tmpPoint);
     }
 }
 
+static Camera parse_camera(const XMLElement *pCamera)
+{
+    const XMLElement *camElement;
+    const char *str;
+    int id;
+    char imageName[64];
+    vec3f pos, gaze, up;
+    ImagePlane imgPlane;
+
+    pCamera->QueryIntAttribute("id", &id);
+    camElement = pCamera->FirstChildElement("Position");
+    str = camElement->GetText();
+    sscanf(str, "%f %f %f", &pos.x, &pos.y, &pos.z);
+    camElement = pCamera->FirstChildElement("Gaze");
+    str = camElement->GetText();
+    sscanf(str, "%f %f %f", &gaze.x, &gaze.y, &gaze.z);
+    camElement = pCamera->FirstChildElement("Up");
+    str = camElement->GetText();
+    sscanf(str, "%f %f %f", &up.x, &up.y, &up.z);
+    camElement = pCamera->FirstChildElement("NearPlane");
+    str = camElement->GetText();
+    sscanf(str, "%f %f %f %f", &imgPlane.left, &imgPlane.right,
+           &imgPlane.bottom, &imgPlane.top);
+    camElement = pCamera->FirstChildElement("NearDistance");
+    camElement->QueryFloatText(&imgPlane.distance);
+    camElement = pCamera->FirstChildElement("ImageResolution");
+    str = camElement->GetText();
+    sscanf(str, "%d %d", &imgPlane.nx, &imgPlane.ny);
+    camElement = pCamera->FirstChildElement("ImageName");
+    str = camElement->GetText();
+    strcpy(imageName, str);
+
+    return Camera(id, imageName, pos, gaze, up, imgPlane);
+}
+
+std::vector<vec3f> load_vertex_stream(const char *xmlPath)
+{
+    XMLDocument xmlDoc;
+
+    if (xmlDoc.LoadFile(xmlPath) != XML_SUCCESS)
+        throw std::runtime_error(std::string("cannot load frame ") + xmlPath +
+                                 ": " + xmlDoc.ErrorName());
+
+    XMLElement *pElement =
+        xmlDoc.FirstChild()->FirstChildElement("VertexData");
+    if (!pElement || !pElement->GetText())
+        throw std::runtime_error(std::string("no vertex data in ") + xmlPath);
+
+    std::vector<vec3f> positions;
+    parse_vertices(pElement->GetText(), positions);
+
+    return positions;
+}
+
+std::vector<Camera> load_cameras(const char *xmlPath)
+{
+    XMLDocument xmlDoc;
+
+    if (xmlDoc.LoadFile(xmlPath) != XML_SUCCESS)
+        throw std::runtime_error(std::string("cannot load scene ") + xmlPath +
+                                 ": " + xmlDoc.ErrorName());
+
+    XMLElement *pElement = xmlDoc.FirstChild()->FirstChildElement("Cameras");
+    if (!pElement)
+        throw std::runtime_error(std::string("no cameras in ") + xmlPath);
+
+    std::vector<Camera> cameras;
+    for (XMLElement *pCamera = pElement->FirstChildElement("Camera");
+         pCamera != nullptr; pCamera = pCamera->NextSiblingElement("Camera"))
+        cameras.push_back(parse_camera(pCamera));
+
+    return cameras;
+}
+
+std::uint64_t scene_content_key(const char *xmlPath)
+{
+    XMLDocument xmlDoc;
+
+    if (xmlDoc.LoadFile(xmlPath) != XML_SUCCESS)
+        throw std::runtime_error(std::string("cannot load scene ") + xmlPath +
+                                 ": " + xmlDoc.ErrorName());
+
+    std::uint64_t key = 14695981039346656037ull;
+    hash_element(key, xmlDoc.FirstChild()->ToElement(), true);
+
+    return key;
+}
+
 // Parses XML file.
-Scene::Scene(const char *xmlPath)
+Scene::Scene(const char *xmlPath, const SceneOptions &options)
 {
+    TraceSpan span("parse", "%s", xmlPath);
     const char *str;
     XMLDocument xmlDoc;
     XMLError eResult;
@@ -170,11 +1285,51 @@ Scene::Scene(const char *xmlPath)
 
     maxRecursionDepth = 1;
     shadowRayEps = 0.001;
+    pathCutoff = options.pathCutoff;
+    russianRoulette = options.russianRoulette;
+    packets = options.packets;
+    gBuffers = options.gBuffers;
+    heatmap = options.heatmap;
+    checkpoints = options.checkpoints;
+    checkpointInterval = options.checkpointInterval;
+    resume = options.resume;
+    shadowMapSize = options.shadowMapSize;
+    shadowMapKernel = std::max(options.shadowMapKernel, 1);
+    rasterPrimary = options.rasterPrimary;
 
     eResult = xmlDoc.LoadFile(xmlPath);
+    if (eResult != XML_SUCCESS)
+        throw std::runtime_error(std::string("cannot load scene ") + xmlPath +
+                                 ": " + xmlDoc.ErrorName());
 
     XMLNode *pRoot = xmlDoc.FirstChild();
 
+    if (gBuffers) {
+        visibilityKey = 14695981039346656037ull;
+        hash_element(visibilityKey, pRoot->ToElement(), false);
+        // Shadows in the G-buffer depend on the levels of detail
+        hash_bytes(visibilityKey, &options.lodLevels,
+                   sizeof(options.lodLevels));
+        hash_bytes(visibilityKey, &options.lodTolerance,
+                   sizeof(options.lodTolerance));
+        hash_bytes(visibilityKey, &shadowMapSize, sizeof(shadowMapSize));
+    }
+
+    if (checkpoints) {
+        imageKey = 14695981039346656037ull;
+        hash_element(imageKey, pRoot->ToElement(), true);
+        hash_bytes(imageKey, &pathCutoff, sizeof(pathCutoff));
+        hash_bytes(imageKey, &russianRoulette, sizeof(russianRoulette));
+        hash_bytes(imageKey, &options.lodLevels, sizeof(options.lodLevels));
+        hash_bytes(imageKey, &options.lodTolerance,
+                   sizeof(options.lodTolerance));
+        hash_bytes(imageKey, &shadowMapSize, sizeof(shadowMapSize));
+        hash_bytes(imageKey, &shadowMapKernel, sizeof(shadowMapKernel));
+    }
+
+    if (options.outOfCoreDir)
+        pageFile = new PageFile(options.outOfCoreDir, options.pageCacheBytes);
+
     pElement = pRoot->FirstChildElement("MaxRecursionDepth");
     if (pElement != nullptr)
         pElement->QueryIntText(&maxRecursionDepth);
@@ -195,38 +1350,8 @@ Scene::Scene(const char *xmlPath)
     // Parse cameras
     pElement = pRoot->FirstChildElement("Cameras");
     XMLElement *pCamera = pElement->FirstChildElement("Camera");
-    XMLElement *camElement;
     while (pCamera != nullptr) {
-        int id;
-        char imageName[64];
-        vec3f pos, gaze, up;
-        ImagePlane imgPlane;
-
-        eResult = pCamera->QueryIntAttribute("id", &id);
-        camElement = pCamera->FirstChildElement("Position");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &pos.x, &pos.y, &pos.z);
-        camElement = pCamera->FirstChildElement("Gaze");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &gaze.x, &gaze.y, &gaze.z);
-        camElement = pCamera->FirstChildElement("Up");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &up.x, &up.y, &up.z);
-        camElement = pCamera->FirstChildElement("NearPlane");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f %f", &imgPlane.left, &imgPlane.right,
-               &imgPlane.bottom, &imgPlane.top);
-        camElement = pCamera->FirstChildElement("NearDistance");
-        eResult = camElement->QueryFloatText(&imgPlane.distance);
-        camElement = pCamera->FirstChildElement("ImageResolution");
-        str = camElement->GetText();
-        sscanf(str, "%d %d", &imgPlane.nx, &imgPlane.ny);
-        camElement = pCamera->FirstChildElement("ImageName");
-        str = camElement->GetText();
-        strcpy(imageName, str);
-
-        cameras.push_back(new Camera(id, imageName, pos, gaze, up, imgPlane));
-
+        cameras.push_back(new Camera(parse_camera(pCamera)));
         pCamera = pCamera->NextSiblingElement("Camera");
     }
 
@@ -273,28 +1398,7 @@ Scene::Scene(const char *xmlPath)
 
     // Parse vertex data
     pElement = pRoot->FirstChildElement("VertexData");
-    int cursor = 0;
-    vec3f tmpPoint;
-    str = pElement->GetText();
-    while (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-        cursor++;
-    while (str[cursor] != '\0') {
-        for (int cnt = 0; cnt < 3; cnt++) {
-            if (cnt == 0)
-                tmpPoint.x = atof(str + cursor);
-            else if (cnt == 1)
-                tmpPoint.y = atof(str + cursor);
-            else
-                tmpPoint.z = atof(str + cursor);
-            while (str[cursor] != ' ' && str[cursor] != '\t' &&
-                   str[cursor] != '\n')
-                cursor++;
-            while (str[cursor] == ' ' || str[cursor] == '\t' ||
-                   str[cursor] == '\n')
-                cursor++;
-        }
-        vertices.push_back(tmpPoint);
-    }
+    parse_vertices(pElement->GetText(), vertices);
 
     // Parse objects
     pElement = pRoot->FirstChildElement("Objects");
@@ -379,19 +1483,47 @@ Scene::Scene(const char *xmlPath)
                        str[cursor] == '\n')
                     cursor++;
             }
-            faces.push_back(*(new Triangle(-1, matIndex, p1Index, p2Index,
-                                           p3Index, &vertices)));
+            faces.push_back(
+                Triangle(-1, matIndex, p1Index, p2Index, p3Index, &vertices));
             meshIndices->push_back(p1Index);
             meshIndices->push_back(p2Index);
             meshIndices->push_back(p3Index);
         }
 
-        objects.push_back(
-            new Mesh(id, matIndex, faces, meshIndices, &vertices));
+        TraceSpan build("build", "mesh %d, %zu faces", id, faces.size());
+        if (pageFile) {
+            // Only one mesh is ever fully in memory, while it is written out.
+            BVH bvh(&vertices, faces.data(), faces.data() + faces.size(), 0);
+            objects.push_back(new PagedMesh(id, matIndex, bvh, pageFile));
+            delete meshIndices;
+        } else {
+            const bool spatial =
+                options.spatialSplitAll ||
+                std::count(options.spatialSplitMeshes.begin(),
+                           options.spatialSplitMeshes.end(), id);
+            auto mesh = new Mesh(id, matIndex, faces, meshIndices, &vertices,
+                                 options.bvhBits,
+                                 spatial ? options.splitBudget : -1,
+                                 options.bvhLayout, options.lazyBVH,
+                                 options.lodLevels, options.lodTolerance,
+                                 options.meshAccelerator);
+            meshHierarchyBytes += mesh->hierarchyBytes();
+            meshLevels += mesh->lodCount();
+            gridMeshes += mesh->accelerator() == MeshAccelerator::Grid;
+            kdTreeMeshes += mesh->accelerator() == MeshAccelerator::KdTree;
+            if (spatial) {
+                splitMeshFaces += mesh->faceCount();
+                splitMeshReferences += mesh->referenceCount();
+            }
+            objects.push_back(mesh);
+        }
 
         pObject = pObject->NextSiblingElement("Mesh");
     }
 
+    if (pageFile)
+        compact_vertices();
+
     // Parse lights
     int id;
     vec3f position;
@@ -417,4 +1549,11 @@ Scene::Scene(const char *xmlPath)
 
         pLight = pLight->NextSiblingElement("PointLight");
     }
+
+    compile_materials();
+
+    if (shadowMapSize > 0) {
+        ThreadPool pool;
+        build_shadow_maps(pool);
+    }
 }
@@ -1,6 +1,7 @@
 #ifndef _SCENE_H_
 #define _SCENE_H_
 
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -8,17 +9,152 @@
 #include <string>
 #include <vector>
 
+#include "Heatmap.h"
 #include "Image.h"
 #include "Ray.h"
+#include "ShadowMap.h"
+#include "Shape.h"
 #include "defs.h"
 
 // Forward declarations to avoid cyclic references
 class Camera;
+class Checkpoint;
+class GBuffer;
 class PointLight;
 class Material;
+class PageFile;
 class Shape;
+class ThreadPool;
+class VisibilityBuffer;
+struct RayPacket;
 
-// Class to hold everything related to a scene.
+// Load-time settings that change how a scene is stored, not how it looks.
+struct SceneOptions {
+    // Store mesh BVHs and triangles in a page file in this directory and
+    // fault them in on demand, instead of keeping them in memory.
+    const char *outOfCoreDir = nullptr;
+    // Memory cap for the pages of an out-of-core scene.
+    std::size_t pageCacheBytes = std::size_t(256) << 20;
+    // Bits per coordinate of the child boxes in in-memory mesh BVHs: 0 keeps
+    // full floats, 8 or 16 store them quantized.
+    int bvhBits = 0;
+    // Memory order of the nodes of full float mesh BVHs.
+    NodeLayout bvhLayout = NodeLayout::Pointer;
+    // Build pointer-layout mesh BVHs on demand as rays reach their nodes,
+    // rather than while loading (see BVH).
+    bool lazyBVH = false;
+    // In-memory meshes, by id, whose hierarchies are built with spatial
+    // splits (see SpatialBVH), or all of them.
+    std::vector<int> spatialSplitMeshes;
+    bool spatialSplitAll = false;
+    // Extra face references spatial splits may add, as a fraction of the
+    // faces of the mesh.
+    float splitBudget = 0.3f;
+    // Structure over the faces of each in-memory mesh. Auto picks one per
+    // mesh (see Mesh); the others force it on all of them, for comparing.
+    MeshAccelerator meshAccelerator = MeshAccelerator::Auto;
+    // Mirror bounces whose throughput, the fraction of the pixel they can
+    // still add to, falls below this in every channel are not traced. 0
+    // traces every bounce up to MaxRecursionDepth.
+    float pathCutoff = 0;
+    // Instead of dropping such bounces, trace them with probability
+    // throughput / pathCutoff and weight those that survive to match.
+    bool russianRoulette = false;
+    // Trace primary rays, and their shadow rays toward each light, in
+    // packets of 8x8 pixels (see RayPacket). The image is the same either
+    // way.
+    bool packets = false;
+    // Keep the primary visibility of each camera in a G-buffer next to its
+    // image, as the image name plus ".gbuffer", and only shade from it
+    // while the geometry, cameras and light positions stay the same (see
+    // GBuffer).
+    bool gBuffers = false;
+    // Write a heatmap of this metric next to each camera's image, as the
+    // image name with "_heat", and its per-tile totals as "_heat.csv".
+    // Rays are then traced one at a time, without packets or G-buffers, so
+    // that all work can be put down to single pixels.
+    HeatMetric heatmap = HeatMetric::None;
+    // Append the tiles of each camera's image to a checkpoint file, the
+    // image name plus ".checkpoint", as they finish, syncing it to disk
+    // every checkpointInterval seconds, and delete it once the image is
+    // written (see Checkpoint). Not used with heatmaps or G-buffers.
+    bool checkpoints = false;
+    float checkpointInterval = 30;
+    // Take the tiles an interrupted render of the same image left in its
+    // checkpoint, rather than rendering them again. Needs checkpoints.
+    bool resume = false;
+    // Give in-memory meshes up to this many simplified copies, which
+    // shadow and mirror rays trace instead once the copy's edges are no
+    // longer than lodTolerance times the footprint of the pixel the ray is
+    // for (see Mesh). Primary visibility stays exact, but shadows and
+    // reflections of dense meshes change slightly.
+    int lodLevels = 0;
+    float lodTolerance = 1;
+    // Look shadows up in a cube shadow map of this many texels square per
+    // face for each light, rendered when the scene is loaded, instead of
+    // tracing shadow rays (see ShadowMap). For previews: shadows get soft,
+    // blocky edges, and thin gaps may close. 0 traces shadow rays.
+    int shadowMapSize = 0;
+    // Side of the square of texels each lookup filters over.
+    int shadowMapKernel = 3;
+    // Find what each pixel of a camera sees by rasterizing the scene's
+    // spheres and triangles into a visibility buffer, rather than tracing
+    // primary rays (see VisibilityBuffer). Pixels on the edges between
+    // primitives may see the other one. Scenes with out-of-core meshes or
+    // lazy hierarchies are traced. Not used with heatmaps, G-buffers or
+    // checkpoints.
+    bool rasterPrimary = false;
+};
+
+// Rectangle of a camera's frame: columns [x0, x1) and rows [y0, y1).
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Counters collected by each render thread and summed up per camera.
+struct RenderStats {
+    unsigned long shadowRays = 0;        // Shadow rays that were traced
+    unsigned long occludedRays = 0;      // Shadow rays that hit something
+    unsigned long occluderCacheHits = 0; // Shadow rays blocked by the cached
+                                         // last occluder
+    unsigned long mirrorRays = 0;        // Mirror bounces that were traced
+    unsigned long cutPaths = 0; // Mirror bounces dropped for low throughput
+    unsigned long gBufferPixels = 0; // Pixels shaded from a saved G-buffer
+    unsigned long resumedPixels = 0; // Pixels taken from a checkpoint
+    unsigned long shadowMapLookups = 0; // Shadow tests answered by a map
+    unsigned long rasterPixels = 0; // Pixels shaded from a visibility buffer
+
+    RenderStats &operator+=(const RenderStats &other);
+};
+
+// Primitive that blocked a shadow ray. One of a mesh with levels of detail
+// only stands in for the mesh for rays that see it at the same level.
+struct Occluder {
+    const Shape *shape = nullptr;
+    const Mesh *mesh = nullptr;
+    int level = -1;
+};
+
+// State private to a single render thread.
+struct ThreadState {
+    // Last primitive that blocked a shadow ray, one slot per light. Adjacent
+    // pixels are usually shadowed by the same primitive, so it is tested
+    // before traversing the whole scene.
+    std::vector<Occluder> lastOccluder;
+    RenderStats stats;
+    // Russian roulette state, reseeded for every pixel so that the image
+    // does not depend on how it was split between threads.
+    std::uint32_t random = 0;
+    // Lights the primary hit being shaded is known to be blocked from, one
+    // bit per light, when its shadow rays were already traced in a packet
+    // or come from a G-buffer.
+    const std::uint64_t *knownShadows = nullptr;
+};
+
+// Class to hold everything related to a scene. A scene owns all of its data
+// and rendering only reads it, so any number of renders may run at once, on
+// the same scene or on different ones. Loading, setVertices(), setCameras()
+// and destruction must not overlap with renders of the same scene.
 class Scene
 {
   public:
@@ -36,16 +172,170 @@ class Scene
     std::vector<vec3f> vertices;  // Vector holding all vertices (vertex data)
     std::vector<Shape *> objects; // Vector holding all shapes
 
-    Scene(const char *xmlPath); // Constructor. Parses XML file and initializes
-                                // vectors above. Implemented for you.
+    bool printStats = false; // Print render statistics for each camera
+
+    // Hash of everything in the scene that decides which primitive each
+    // primary ray hits and which lights that point sees: all of the scene
+    // file except cameras, materials, light intensities, the ambient light,
+    // the background color and the recursion depth. Renders add in their
+    // camera. Only computed with SceneOptions::gBuffers, 0 otherwise.
+    std::uint64_t visibilityKey = 0;
+
+    // Hash of everything that decides the pixels of the scene's images: all
+    // of the scene file except cameras, and the options that change how it
+    // looks. Renders add in their camera. Only computed with
+    // SceneOptions::checkpoints, 0 otherwise.
+    std::uint64_t imageKey = 0;
+
+    // Constructor. Parses XML file and initializes vectors above. Implemented
+    // for you. Throws std::runtime_error if the file cannot be loaded.
+    Scene(const char *xmlPath, const SceneOptions &options = SceneOptions());
+    ~Scene();
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
 
     void
     renderScene(void); // Method to render scene, an image is created for each
                        // camera in the scene. You will implement this.
 
+    // Renders tile of the camera's frame into buffer, as (x1 - x0) *
+    // (y1 - y0) RGB triples row by row, splitting the work over pool.
+    RenderStats render(const Camera *camera, const Tile &tile,
+                       unsigned char *buffer, ThreadPool &pool) const;
+
+    // Same, but entirely on the calling thread, for callers that render
+    // several scenes side by side themselves.
+    RenderStats render(const Camera *camera, const Tile &tile,
+                       unsigned char *buffer) const;
+
+    // Renders the part of the camera's frame covered by tile on the given
+    // pool.
+    RenderStats renderTile(const Camera *camera, Image &tile,
+                           ThreadPool &pool) const;
+
+    // Renders a single camera on the given pool and writes its image, to
+    // imageName if given instead of the camera's own.
+    RenderStats renderCamera(const Camera *camera, ThreadPool &pool,
+                             const char *imageName = nullptr) const;
+
+    // Prints the statistics of a render of camera to std::cerr.
+    void reportStats(const Camera *camera, const RenderStats &stats) const;
+
+    // Moves the vertices to the next frame of an animation and refits the
+    // mesh hierarchies on pool, rebuilding those whose quality dropped past
+    // rebuildRatio (see Mesh::refit). positions must match the existing
+    // vertices one for one. Returns the number of rebuilt meshes, throws
+    // std::runtime_error if the counts differ or the scene is out of core.
+    int setVertices(const std::vector<vec3f> &positions, ThreadPool &pool,
+                    float rebuildRatio);
+
+    // Replaces the cameras with copies of the given ones.
+    void setCameras(const std::vector<Camera> &replacement);
+
+    // Renders an animation: every camera once with the vertices the scene
+    // was loaded with, then once more for the vertex data of each frame
+    // file. Frame n of a camera is written as its image name with "_000n"
+    // before the extension.
+    void renderSequence(const std::vector<const char *> &frames,
+                        float rebuildRatio);
+
   private:
-    void render_partial(Image &image, Camera *camera, int minV, int maxV) const;
-    vec3f ray_color(Ray ray, int depth) const;
+    struct CompiledMaterial;
+    using ShadeKernel = vec3f (Scene::*)(const Ray &ray, const HitRecord &hr,
+                                         const CompiledMaterial &material,
+                                         int depth, const vec3f &throughput,
+                                         ThreadState &state) const;
+
+    // Material in the form shading wants it, along with the kernel compiled
+    // for the terms it actually has.
+    struct CompiledMaterial {
+        vec3f ambient; // Already multiplied by the ambient light
+        vec3f diffuseRef;
+        vec3f specularRef;
+        vec3f mirrorRef;
+        int phongExp;
+        ShadeKernel kernel;
+    };
+
+    // Indexed like materials.
+    std::vector<CompiledMaterial> compiledMaterials;
+
+    float pathCutoff;
+    bool russianRoulette;
+    bool packets;
+    bool gBuffers;
+    HeatMetric heatmap;
+    bool checkpoints;
+    float checkpointInterval;
+    bool resume;
+
+    PageFile *pageFile = nullptr; // Backing store of out-of-core meshes
+    std::size_t meshHierarchyBytes = 0; // Summed over in-memory meshes
+    std::size_t splitMeshFaces = 0;      // Summed over spatial split meshes
+    std::size_t splitMeshReferences = 0; // Likewise
+    std::size_t meshLevels = 0;          // Levels of detail of all meshes
+    std::size_t gridMeshes = 0;          // Meshes under a Grid
+    std::size_t kdTreeMeshes = 0;        // Meshes under a KdTree
+
+    std::vector<ShadowMap> shadowMaps; // One per light, or none
+    int shadowMapSize;
+    int shadowMapKernel;
+    bool rasterPrimary;
+
+    void compact_vertices();
+    void compile_materials();
+    void build_shadow_maps(ThreadPool &pool);
+    void render_shadow_face(const PointLight *light, ShadowMap &map,
+                            int face) const;
+    template <bool Mirror, bool Specular>
+    static ShadeKernel kernel_for(int phongExp);
+    template <bool Mirror, bool Specular, int Exp>
+    vec3f shade(const Ray &ray, const HitRecord &hr,
+                const CompiledMaterial &material, int depth,
+                const vec3f &throughput, ThreadState &state) const;
+    RenderStats render_partial(Image &image, const Camera *camera, int minU,
+                               int maxU, GBuffer *gbuffer = nullptr,
+                               Heatmap *heat = nullptr) const;
+    RenderStats render_checkpointed(const Camera *camera, Image &image,
+                                    Checkpoint &checkpoint,
+                                    ThreadPool &pool) const;
+    bool collect_primitives(std::vector<RasterPrimitive> &primitives) const;
+    RenderStats render_visible(Image &image, const Camera *camera,
+                               const VisibilityBuffer &vbuf, int minU,
+                               int maxU) const;
+    RenderStats reshade_partial(Image &image, const Camera *camera,
+                                const GBuffer &gbuffer, int minU,
+                                int maxU) const;
+    void trace_block(Image &image, const Camera *camera, const Tile &block,
+                     GBuffer *gbuffer, ThreadState &state) const;
+    vec3f shade_primary(const Ray &ray, const HitRecord &hr,
+                        const std::uint64_t *shadowed,
+                        ThreadState &state) const;
+    void closest_hits(const RayPacket &packet, Hit *hits) const;
+    void trace_shadows(const Ray *rays, const HitRecord *records,
+                       std::uint64_t active, std::size_t lightIdx,
+                       std::uint64_t *shadowed, std::size_t words,
+                       ThreadState &state) const;
+    vec3f ray_color(Ray ray, int depth, const vec3f &throughput,
+                    ThreadState &state) const;
+    bool keep_path(const vec3f &throughput, float &weight,
+                   ThreadState &state) const;
+    Ray shadow_ray(const vec3f &pos, const PointLight *light, float width,
+                   float &light_distance) const;
+    bool in_shadow(const Ray &light_ray, float light_distance, int lightIdx,
+                   ThreadState &state) const;
 };
 
+// Reads just the VertexData of a scene file, as one frame of an animation.
+// Throws std::runtime_error if there is none.
+std::vector<vec3f> load_vertex_stream(const char *xmlPath);
+
+// Reads just the Cameras of a scene file, without building its objects.
+std::vector<Camera> load_cameras(const char *xmlPath);
+
+// Hash of a scene file without its cameras. Files with the same key load into
+// the same objects, lights and materials. Throws std::runtime_error if the
+// file cannot be loaded.
+std::uint64_t scene_content_key(const char *xmlPath);
+
 #endif
@@ -0,0 +1,69 @@
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "Camera.h"
+#include "Scene.h"
+#include "SceneCache.h"
+
+SceneCache::SceneCache(std::size_t capacity, const SceneOptions &options)
+    : capacity(capacity ? capacity : 1), options(options)
+{
+}
+
+SceneCache::~SceneCache()
+{
+    for (auto &entry : lru)
+        delete entry.scene;
+}
+
+Scene *SceneCache::load(const std::string &path, bool &cached)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) == -1)
+        throw std::runtime_error("cannot read " + path);
+
+    const std::int64_t modified =
+        std::int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+
+    auto it = index.find(path);
+    if (it != index.end() && it->second->modified == modified &&
+        it->second->size == info.st_size) {
+        lru.splice(lru.begin(), lru, it->second);
+        cached = true;
+        return lru.front().scene;
+    }
+
+    const std::uint64_t key = scene_content_key(path.c_str());
+
+    if (it != index.end()) {
+        Entry &entry = *it->second;
+        lru.splice(lru.begin(), lru, it->second);
+
+        if (entry.key == key) {
+            entry.scene->setCameras(load_cameras(path.c_str()));
+            entry.modified = modified;
+            entry.size = info.st_size;
+            cached = true;
+            return entry.scene;
+        }
+
+        delete entry.scene;
+        lru.pop_front();
+        index.erase(it);
+    }
+
+    Scene *scene = new Scene(path.c_str(), options);
+
+    lru.push_front({path, scene, key, modified, info.st_size});
+    index[path] = lru.begin();
+    cached = false;
+
+    while (lru.size() > capacity) {
+        index.erase(lru.back().path);
+        delete lru.back().scene;
+        lru.pop_back();
+    }
+
+    return scene;
+}
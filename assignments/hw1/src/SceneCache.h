@@ -0,0 +1,48 @@
+#ifndef _SCENE_CACHE_H_
+#define _SCENE_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "Scene.h"
+
+// LRU cache of parsed scenes, BVHs included, by the path of their file. A
+// file whose size and modification time are unchanged is taken as is,
+// without reading it. Otherwise it is hashed without its cameras (see
+// scene_content_key), and if only the cameras changed they are reloaded
+// into the cached scene instead of parsing it again.
+class SceneCache
+{
+  public:
+    SceneCache(std::size_t capacity,
+               const SceneOptions &options = SceneOptions());
+    ~SceneCache();
+
+    SceneCache(const SceneCache &) = delete;
+    SceneCache &operator=(const SceneCache &) = delete;
+
+    // Returns the scene stored in the file at path, parsing it unless it is
+    // cached. The scene stays owned by the cache and is valid until the next
+    // call. Throws std::runtime_error if the file cannot be read or loaded.
+    Scene *load(const std::string &path, bool &cached);
+
+  private:
+    struct Entry {
+        std::string path;
+        Scene *scene;
+        std::uint64_t key; // scene_content_key() of the file
+        std::int64_t modified; // Modification time of the file, in ns
+        std::int64_t size;
+    };
+
+    std::size_t capacity;
+    SceneOptions options; // Used for every scene the cache parses
+
+    // Most recently used first.
+    std::list<Entry> lru;
+    std::unordered_map<std::string, decltype(lru)::iterator> index;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Camera.h"
+#include "Scene.h"
+#include "Server.h"
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+}
+
+// Overrides a job applies on top of the cameras in the scene file.
+struct CameraOverrides {
+    int cameraId = -1; // -1 renders every camera
+    std::string output;
+    bool hasPosition = false, hasGaze = false, hasUp = false;
+    bool hasNearPlane = false, hasDistance = false, hasResolution = false;
+    vec3f position, gaze, up;
+    ImagePlane imgPlane;
+
+    Camera apply(const Camera *camera) const;
+};
+
+Camera CameraOverrides::apply(const Camera *camera) const
+{
+    ImagePlane plane = camera->imgPlane;
+
+    if (hasNearPlane) {
+        plane.left = imgPlane.left;
+        plane.right = imgPlane.right;
+        plane.bottom = imgPlane.bottom;
+        plane.top = imgPlane.top;
+    }
+    if (hasDistance)
+        plane.distance = imgPlane.distance;
+    if (hasResolution) {
+        plane.nx = imgPlane.nx;
+        plane.ny = imgPlane.ny;
+    }
+
+    return Camera(camera->id,
+                  output.empty() ? camera->imageName.c_str() : output.c_str(),
+                  hasPosition ? position : camera->getPosition(),
+                  hasGaze ? gaze : camera->getGaze(),
+                  hasUp ? up : camera->getUp(), plane);
+}
+
+static bool parse_override(const std::string &token, CameraOverrides &ov)
+{
+    auto eq = token.find('=');
+    if (eq == std::string::npos)
+        return false;
+
+    std::string key = token.substr(0, eq);
+    const char *value = token.c_str() + eq + 1;
+    ImagePlane &p = ov.imgPlane;
+
+    if (key == "camera")
+        return sscanf(value, "%d", &ov.cameraId) == 1;
+    if (key == "output") {
+        ov.output = value;
+        return !ov.output.empty();
+    }
+    if (key == "position")
+        return (ov.hasPosition = sscanf(value, "%f,%f,%f", &ov.position.x,
+                                        &ov.position.y, &ov.position.z) == 3);
+    if (key == "gaze")
+        return (ov.hasGaze = sscanf(value, "%f,%f,%f", &ov.gaze.x, &ov.gaze.y,
+                                    &ov.gaze.z) == 3);
+    if (key == "up")
+        return (ov.hasUp = sscanf(value, "%f,%f,%f", &ov.up.x, &ov.up.y,
+                                  &ov.up.z) == 3);
+    if (key == "nearplane")
+        return (ov.hasNearPlane = sscanf(value, "%f,%f,%f,%f", &p.left,
+                                         &p.right, &p.bottom, &p.top) == 4);
+    if (key == "distance")
+        return (ov.hasDistance = sscanf(value, "%f", &p.distance) == 1);
+    if (key == "resolution")
+        return (ov.hasResolution =
+                    sscanf(value, "%dx%d", &p.nx, &p.ny) == 2 && p.nx > 0 &&
+                    p.ny > 0);
+
+    return false;
+}
+
+RenderServer::RenderServer(std::size_t cacheSize, bool printStats,
+                           const SceneOptions &options)
+    : cache(cacheSize, options), printStats(printStats)
+{
+}
+
+std::string RenderServer::handle(const std::string &job)
+{
+    std::istringstream tokens(job);
+    std::string path, token;
+    CameraOverrides overrides;
+
+    tokens >> path;
+    while (tokens >> token) {
+        if (!parse_override(token, overrides))
+            return "error bad argument " + token;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool cached;
+    Scene *scene;
+
+    try {
+        scene = cache.load(path, cached);
+    } catch (const std::exception &e) {
+        return std::string("error ") + e.what();
+    }
+
+    std::vector<Camera> jobCameras;
+    for (auto camera : scene->cameras) {
+        if (overrides.cameraId == -1 || overrides.cameraId == camera->id)
+            jobCameras.push_back(overrides.apply(camera));
+    }
+
+    if (jobCameras.empty())
+        return "error no such camera";
+    if (jobCameras.size() > 1 && !overrides.output.empty())
+        return "error output needs a camera when the scene has several";
+
+    double setup = elapsed_ms(start);
+
+    scene->printStats = printStats;
+
+    start = std::chrono::steady_clock::now();
+    try {
+        for (auto &camera : jobCameras)
+            scene->renderCamera(&camera, pool);
+    } catch (const std::exception &e) {
+        return std::string("error ") + e.what();
+    }
+    double render = elapsed_ms(start);
+
+    std::ostringstream reply;
+    reply << "ok " << (cached ? "cached" : "parsed") << " setup=" << setup
+          << " render=" << render;
+    for (auto &camera : jobCameras)
+        reply << " " << camera.imageName;
+
+    return reply.str();
+}
+
+void RenderServer::serve(FILE *in, FILE *out)
+{
+    char *line = nullptr;
+    std::size_t capacity = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &capacity, in)) != -1) {
+        std::string job(line, length);
+        job.erase(job.find_last_not_of(" \t\r\n") + 1);
+
+        if (job.empty())
+            continue;
+        if (job == "quit")
+            break;
+
+        fprintf(out, "%s\n", handle(job).c_str());
+        fflush(out);
+    }
+
+    free(line);
+}
+
+void RenderServer::listen(const char *socketPath)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        throw std::runtime_error("socket path too long");
+    strcpy(address.sun_path, socketPath);
+
+    // A client that hangs up before its reply must not take the server down
+    // with it; the write just fails instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1)
+        throw std::runtime_error("socket: " + std::string(strerror(errno)));
+
+    unlink(socketPath);
+    if (bind(server, (sockaddr *)&address, sizeof(address)) == -1 ||
+        ::listen(server, 8) == -1) {
+        close(server);
+        throw std::runtime_error(std::string(socketPath) + ": " +
+                                 strerror(errno));
+    }
+
+    for (;;) {
+        int client = accept(server, nullptr, nullptr);
+        if (client == -1)
+            continue;
+
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+
+        serve(in, out);
+
+        fclose(out);
+        fclose(in);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <cstdio>
+#include <string>
+
+#include "SceneCache.h"
+#include "ThreadPool.h"
+
+// Long-running render server. Reads one job per line:
+//
+//   <scene.xml> [camera=<id>] [output=<file.ppm>] [position=x,y,z]
+//               [gaze=x,y,z] [up=x,y,z] [nearplane=l,r,b,t] [distance=d]
+//               [resolution=WxH]
+//
+// and answers each with a single line, either
+//
+//   ok <cached|parsed> setup=<ms> render=<ms> <output.ppm>...
+//   error <message>
+//
+// Parsed scenes are kept in a SceneCache, and rendering reuses one warm thread
+// pool. A job that only changes camera overrides therefore skips parsing and
+// BVH construction.
+class RenderServer
+{
+  public:
+    RenderServer(std::size_t cacheSize, bool printStats,
+                 const SceneOptions &options = SceneOptions());
+
+    // Serves jobs read from in until EOF or a "quit" line.
+    void serve(FILE *in, FILE *out);
+
+    // Listens on a UNIX socket and serves one client at a time, forever.
+    void listen(const char *socketPath);
+
+  private:
+    std::string handle(const std::string &job);
+
+    ThreadPool pool;
+    SceneCache cache;
+    bool printStats;
+};
+
+#endif
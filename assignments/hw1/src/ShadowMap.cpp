@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ShadowMap.h"
+
+// How far points are moved off their surface, along its normal, and then
+// toward the light, in texels at their distance. Enough that a surface at
+// a slant to the light is not shadowed by its own samples in the texels
+// around it; more makes shadows start short of contact points.
+static constexpr float NORMAL_OFFSET = 1;
+static constexpr float DEPTH_BIAS = 0.5f;
+
+ShadowMap::ShadowMap(const vec3f &position, int resolution)
+    : position(position), size(resolution),
+      depths(std::size_t(6) * resolution * resolution,
+             std::numeric_limits<float>::infinity())
+{
+}
+
+vec3f ShadowMap::direction(int face, int x, int y) const
+{
+    const int axis = face / 2;
+    vec3f d;
+
+    (&d.x)[axis] = face % 2 ? -1 : 1;
+    (&d.x)[(axis + 1) % 3] = (x + 0.5f) / size * 2 - 1;
+    (&d.x)[(axis + 2) % 3] = (y + 0.5f) / size * 2 - 1;
+
+    return d.normalize();
+}
+
+float ShadowMap::visibility(const vec3f &p, const vec3f &normal,
+                            int kernel) const
+{
+    vec3f d = p - position;
+    const float distance = d.norm();
+    if (distance == 0)
+        return 1;
+
+    // Width of a texel at p, where the faces are widest apart
+    const float texel = 2 * distance / size;
+    const vec3f off = normal * d > 0 ? -normal : normal;
+    d = d + NORMAL_OFFSET * texel * off;
+    const float reach = d.norm() - DEPTH_BIAS * texel;
+
+    const float ad[3] = {std::fabs(d.x), std::fabs(d.y), std::fabs(d.z)};
+    const int axis = ad[0] >= ad[1] && ad[0] >= ad[2] ? 0
+                     : ad[1] >= ad[2]                 ? 1
+                                                      : 2;
+    const int face = 2 * axis + ((&d.x)[axis] < 0);
+    const float u = (&d.x)[(axis + 1) % 3] / ad[axis];
+    const float v = (&d.x)[(axis + 2) % 3] / ad[axis];
+    const int x = std::min(int((u + 1) / 2 * size), size - 1);
+    const int y = std::min(int((v + 1) / 2 * size), size - 1);
+
+    // Texels past the edge of the face are clamped to it rather than taken
+    // from the next face, which only matters for wide kernels.
+    const int radius = kernel / 2;
+    const float *texels = &depths[std::size_t(face) * size * size];
+    int lit = 0;
+
+    for (int j = y - radius; j < y - radius + kernel; ++j) {
+        const float *row = texels + std::size_t(std::clamp(j, 0, size - 1)) *
+                                        size;
+        for (int i = x - radius; i < x - radius + kernel; ++i)
+            lit += row[std::clamp(i, 0, size - 1)] >= reach;
+    }
+
+    return float(lit) / (kernel * kernel);
+}
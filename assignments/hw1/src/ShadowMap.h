@@ -0,0 +1,43 @@
+#ifndef _SHADOW_MAP_H_
+#define _SHADOW_MAP_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "defs.h"
+
+// Distance from a point light to the nearest surface in every direction,
+// sampled on the six faces of a cube around the light. A point is lit if
+// nothing the map saw is closer to the light than the point is, which
+// answers a shadow query with a few lookups instead of a ray. Face 2a + s
+// looks down axis a, toward negative for s = 1.
+class ShadowMap
+{
+  public:
+    // resolution texels square per face, all seeing nothing to begin with.
+    ShadowMap(const vec3f &position, int resolution);
+
+    int resolution() const { return size; }
+
+    // Unit direction from the light through the center of texel (x, y) of
+    // face, and the distance along it to the nearest surface.
+    vec3f direction(int face, int x, int y) const;
+    float &depth(int face, int x, int y)
+    {
+        return depths[(std::size_t(face) * size + y) * size + x];
+    }
+
+    // Fraction of the kernel x kernel texels around the direction of p that
+    // see nothing closer than p (percentage closer filtering): 0 in shadow,
+    // 1 lit, and in between along the edges of shadows. normal is that of
+    // the surface at p, which is moved off it by about a texel so that the
+    // surface does not shadow itself.
+    float visibility(const vec3f &p, const vec3f &normal, int kernel) const;
+
+  private:
+    vec3f position;
+    int size;
+    std::vector<float> depths;
+};
+
+#endif
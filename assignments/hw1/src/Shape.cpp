@@ -1,10 +1,20 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <future>
 #include <limits>
 
-#include "Scene.h"
+#include "FlatBVH.h"
+#include "Grid.h"
+#include "KdTree.h"
+#include "QuantizedBVH.h"
+#include "RayPacket.h"
 #include "Shape.h"
+#include "Simplify.h"
+#include "SpatialBVH.h"
+#include "ThreadPool.h"
+
+thread_local TraversalWork traversal_work;
 
 Shape::Shape(void) {}
 
@@ -18,10 +28,27 @@ Sphere::Sphere(int id, int matIndex, int cIndex, float R,
 {
 }
 
-HitRecord Sphere::intersect(const Ray &ray) const
+HitRecord Shape::intersect(const Ray &ray) const
+{
+    Hit closest_hit = hit(ray);
+    if (closest_hit.t > 0)
+        return closest_hit.shape->hitRecord(ray, closest_hit);
+
+    return NO_HIT;
+}
+
+void Shape::hitPacket(const RayPacket &packet, std::uint64_t active,
+                      Hit *hits) const
+{
+    for_each_ray(active, [&](int i) { hits[i] = hit(packet.rays[i]); });
+}
+
+Hit Sphere::hit(const Ray &ray) const
 {
     float a, b, c; // Coefficients of the quadratic equation.
-    vec3f sphereCenter = pScene->vertices[centerIdx - 1];
+    vec3f sphereCenter = (*vertices)[centerIdx - 1];
+
+    ++traversal_work.primitiveTests;
 
     auto ro_minus_sc = ray.origin - sphereCenter;
     a = ray.direction * ray.direction;
@@ -36,20 +63,43 @@ HitRecord Sphere::intersect(const Ray &ray) const
         auto t2 = (-b + std::sqrt(discriminant)) / 2 * a;
 
         if (t1 < 0 && t2 < 0) {
-            return NO_HIT;
+            return MISS;
         } else if (t1 > 0 && t2 > 0) {
             t_hit = std::min(t1, t2);
         } else {
             t_hit = std::max(t1, t2);
         }
 
-        vec3f pos_hit = ray.origin + t_hit * ray.direction;
-        vec3f normal_hit = (pos_hit - sphereCenter).normalize();
-
-        return {t_hit, pos_hit, normal_hit, matIndex};
+        return {t_hit, 0, 0, -1, this};
     }
 
-    return NO_HIT;
+    return MISS;
+}
+
+HitRecord Sphere::hitRecord(const Ray &ray, const Hit &hit) const
+{
+    vec3f sphereCenter = (*vertices)[centerIdx - 1];
+    vec3f pos_hit = ray.origin + hit.t * ray.direction;
+    vec3f normal_hit = (pos_hit - sphereCenter).normalize();
+
+    return {hit.t, pos_hit, normal_hit, matIndex};
+}
+
+void Sphere::collectVertices(std::vector<bool> &used) const
+{
+    used[centerIdx - 1] = true;
+}
+
+void Sphere::remapVertices(const std::vector<int> &remap)
+{
+    centerIdx = remap[centerIdx - 1];
+}
+
+bool Sphere::collectPrimitives(std::vector<RasterPrimitive> &primitives) const
+{
+    primitives.push_back({this, (*vertices)[centerIdx - 1], {}, {}, radius});
+
+    return true;
 }
 
 Triangle::Triangle(void) {}
@@ -61,15 +111,10 @@ Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index,
 {
 }
 
-HitRecord Triangle::intersect(const Ray &ray) const
+Hit intersect_triangle(const vec3f &a, const vec3f &b, const vec3f &c,
+                       const Ray &ray)
 {
-    if (ray.origin.x == std::numeric_limits<float>::max()) {
-        return {-1, {0, 0, 0}, {0, 0, 0}, aIdx, bIdx, cIdx};
-    }
-
-    vec3f a = pScene->vertices[aIdx - 1];
-    vec3f b = pScene->vertices[bIdx - 1];
-    vec3f c = pScene->vertices[cIdx - 1];
+    ++traversal_work.primitiveTests;
 
     vec3f ab = a - b, ac = a - c;
 
@@ -86,7 +131,7 @@ HitRecord Triangle::intersect(const Ray &ray) const
               m;
 
     if (t_hit <= 0)
-        return NO_HIT;
+        return MISS;
 
     float gamma =
         (ray.direction.z * ak_minus_jb + ray.direction.y * jc_minus_al +
@@ -94,29 +139,598 @@ HitRecord Triangle::intersect(const Ray &ray) const
         m;
 
     if (gamma < 0 || gamma > 1)
-        return NO_HIT;
+        return MISS;
 
     float beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / m;
 
     if (beta < 0 || beta > 1 - gamma)
-        return NO_HIT;
+        return MISS;
 
-    vec3f pos_hit = ray.origin + t_hit * ray.direction;
+    return {t_hit, beta, gamma, -1, nullptr};
+}
+
+HitRecord triangle_hit_record(const vec3f &a, const vec3f &b, const vec3f &c,
+                              const Ray &ray, const Hit &hit, int matIndex)
+{
+    vec3f pos_hit = ray.origin + hit.t * ray.direction;
     vec3f normal_hit = giraffe::cross(b - a, c - a).normalize();
 
-    return {t_hit, pos_hit, normal_hit, matIndex};
+    return {hit.t, pos_hit, normal_hit, matIndex};
+}
+
+Hit Triangle::hit(const Ray &ray) const
+{
+    vec3f a, b, c;
+    getVertices(a, b, c);
+
+    Hit hit = intersect_triangle(a, b, c, ray);
+    hit.shape = this;
+
+    return hit;
+}
+
+HitRecord Triangle::hitRecord(const Ray &ray, const Hit &hit) const
+{
+    vec3f a, b, c;
+    getVertices(a, b, c);
+
+    return triangle_hit_record(a, b, c, ray, hit, matIndex);
+}
+
+HitRecord Triangle::intersect(const Ray &ray) const
+{
+    if (ray.origin.x == std::numeric_limits<float>::max()) {
+        return {-1, {0, 0, 0}, {0, 0, 0}, aIdx, bIdx, cIdx};
+    }
+
+    return Shape::intersect(ray);
+}
+
+void Triangle::getVertices(vec3f &a, vec3f &b, vec3f &c) const
+{
+    a = (*vertices)[aIdx - 1];
+    b = (*vertices)[bIdx - 1];
+    c = (*vertices)[cIdx - 1];
+}
+
+void Triangle::collectVertices(std::vector<bool> &used) const
+{
+    used[aIdx - 1] = used[bIdx - 1] = used[cIdx - 1] = true;
+}
+
+void Triangle::remapVertices(const std::vector<int> &remap)
+{
+    aIdx = remap[aIdx - 1];
+    bIdx = remap[bIdx - 1];
+    cIdx = remap[cIdx - 1];
+}
+
+bool Triangle::collectPrimitives(std::vector<RasterPrimitive> &primitives) const
+{
+    RasterPrimitive primitive = {this, {}, {}, {}, 0};
+    getVertices(primitive.a, primitive.b, primitive.c);
+    primitives.push_back(primitive);
+
+    return true;
 }
 
 Mesh::Mesh() {}
 
+static std::size_t count_nodes(const BVH *node)
+{
+    if (node->isLeaf() || !node->isSplit())
+        return 1;
+
+    return 1 + count_nodes(static_cast<const BVH *>(node->left)) +
+           count_nodes(static_cast<const BVH *>(node->right));
+}
+
+// Meshes smaller than this keep a BVH, which is as quick to build and
+// trace as anything at that size.
+static constexpr std::size_t MIN_AUTO_FACES = 4096;
+
+// Faces whose sizes spread wider than this, as the standard deviation over
+// the mean of the diagonals of their boxes, get a kd-tree: large faces
+// among small ones land in many cells of a grid.
+static constexpr double KD_TREE_SPREAD = 1.5;
+
+// So do faces that leave more than MAX_EMPTY_CELLS of a grid of one cell
+// per GRID_FACES_PER_CELL faces empty, huddled in a few corners of their
+// bounds. Surface meshes leave 60-90% empty, which the finer grids of
+// crowded cells handle well.
+static constexpr double GRID_FACES_PER_CELL = 8;
+static constexpr double MAX_EMPTY_CELLS = 0.95;
+
+// Accelerator for a mesh of faces, from how widely the sizes of its faces
+// vary and how evenly their centers fill its bounds.
+static MeshAccelerator choose_accelerator(const std::vector<Triangle> &faces)
+{
+    const std::size_t n = faces.size();
+    if (n < MIN_AUTO_FACES)
+        return MeshAccelerator::BVH;
+
+    std::vector<vec3f> centers(n);
+    Box bounds;
+    double sum = 0, sum_squares = 0;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        vec3f a, b, c;
+        faces[i].getVertices(a, b, c);
+
+        Box box;
+        box.update(a);
+        box.update(b);
+        box.update(c);
+        const double size = (box.max_point - box.min_point).norm();
+        sum += size;
+        sum_squares += size * size;
+
+        centers[i] = (box.min_point + box.max_point) / 2;
+        bounds.update(centers[i]);
+    }
+
+    const double mean = sum / n;
+    const double spread =
+        mean > 0 ? std::sqrt(std::max(sum_squares / n - mean * mean, 0.0)) /
+                       mean
+                 : 0;
+    if (spread > KD_TREE_SPREAD)
+        return MeshAccelerator::KdTree;
+
+    // Cells along each axis in proportion to the bounds, flat sides getting
+    // just one.
+    const vec3f extent = bounds.max_point - bounds.min_point;
+    const double largest = std::max({extent.x, extent.y, extent.z});
+    if (!(largest > 0))
+        return MeshAccelerator::Grid;
+
+    const double cells = n / GRID_FACES_PER_CELL;
+    double volume = 1;
+    int flat = 0;
+    for (float e : {extent.x, extent.y, extent.z}) {
+        if (e > largest * 1e-3)
+            volume *= e / largest;
+        else
+            ++flat;
+    }
+    const double scale = std::pow(cells / volume, 1.0 / (3 - flat));
+
+    int resolution[3];
+    for (int a = 0; a < 3; ++a)
+        resolution[a] = std::max(1, int(scale * (&extent.x)[a] / largest));
+
+    std::vector<bool> occupied(std::size_t(resolution[0]) * resolution[1] *
+                               resolution[2]);
+    std::size_t filled = 0;
+    for (auto &center : centers) {
+        std::size_t cell = 0;
+        for (int a = 2; a >= 0; --a) {
+            const float offset = (&center.x)[a] - (&bounds.min_point.x)[a];
+            const float size = (&extent.x)[a];
+            cell = cell * resolution[a] +
+                   (size > 0 ? std::min(int(offset / size * resolution[a]),
+                                        resolution[a] - 1)
+                             : 0);
+        }
+        if (!occupied[cell]) {
+            occupied[cell] = true;
+            ++filled;
+        }
+    }
+
+    const double empty = 1 - double(filled) / occupied.size();
+    return empty > MAX_EMPTY_CELLS ? MeshAccelerator::KdTree
+                                   : MeshAccelerator::Grid;
+}
+
 Mesh::Mesh(int id, int matIndex, const std::vector<Triangle> &faces,
-           std::vector<int> *pIndices, std::vector<vec3f> *vertices)
-    : Shape(id, matIndex), faces(faces), pIndices(pIndices), vertices(vertices)
+           std::vector<int> *pIndices, std::vector<vec3f> *vertices,
+           int quantizationBits, float splitBudget, NodeLayout layout,
+           bool lazy, int lodLevels, float lodTolerance,
+           MeshAccelerator accelerator)
+    : Shape(id, matIndex), faces(faces), pIndices(pIndices),
+      vertices(vertices), kind(accelerator),
+      quantizationBits(quantizationBits), splitBudget(splitBudget),
+      layout(layout), lazy(lazy), lodTolerance(lodTolerance)
+{
+    if (kind == MeshAccelerator::Auto) {
+        const bool hierarchy_options = quantizationBits || splitBudget >= 0 ||
+                                       layout != NodeLayout::Pointer || lazy;
+        kind = hierarchy_options ? MeshAccelerator::BVH
+                                 : choose_accelerator(faces);
+    }
+
+    build();
+    build_levels(lodLevels);
+}
+
+// Levels are not worth having below this many faces, where the hierarchy is
+// a handful of nodes anyway.
+static constexpr std::size_t MIN_LOD_FACES = 64;
+static constexpr int MAX_LOD_LEVELS = 8;
+
+void Mesh::build_levels(int count)
+{
+    std::vector<std::size_t> targets;
+    std::size_t target = faces.size();
+
+    for (int i = 0; i < std::min(count, MAX_LOD_LEVELS); ++i) {
+        target /= 4;
+        if (target < MIN_LOD_FACES)
+            break;
+        targets.push_back(target);
+    }
+
+    if (targets.empty())
+        return;
+
+    for (auto &indices : simplify_mesh(*vertices, *pIndices, targets)) {
+        // Simplification stuck well short of the target gives a level
+        // hardly cheaper than the one before; later ones would be the same.
+        const std::size_t previous =
+            levels.empty() ? faces.size() : levels.back().faces.size();
+        if (indices.size() / 3 > previous * 3 / 4)
+            break;
+
+        Level level;
+        for (std::size_t i = 0; i < indices.size(); i += 3)
+            level.faces.push_back(Triangle(-1, matIndex, indices[i],
+                                           indices[i + 1], indices[i + 2],
+                                           vertices));
+        levels.push_back(std::move(level));
+    }
+
+    // Only now that the faces no longer move
+    for (auto &level : levels) {
+        level.bvh = new BVH(vertices, level.faces.data(),
+                            level.faces.data() + level.faces.size(), 0);
+        level.builtRatio = level.bvh->surfaceAreaRatio();
+    }
+
+    measure_levels();
+}
+
+void Mesh::build()
+{
+    delete bvh;
+
+    references = faces.size();
+
+    if (kind == MeshAccelerator::Grid) {
+        auto grid = new Grid(faces.data(), faces.size());
+        bytes = grid->bytes();
+        references = grid->referenceCount();
+        bvh = grid;
+        return;
+    }
+
+    if (kind == MeshAccelerator::KdTree) {
+        auto tree = new KdTree(faces.data(), faces.size());
+        bytes = tree->bytes();
+        references = tree->referenceCount();
+        bvh = tree;
+        return;
+    }
+
+    if (splitBudget >= 0) {
+        auto spatial =
+            new SpatialBVH(faces.data(), faces.size(), splitBudget);
+        bytes = spatial->bytes();
+        references = spatial->referenceCount();
+        bvh = spatial;
+        return;
+    }
+
+    // Every other format is copied from a whole tree.
+    const bool on_demand = builds_on_demand();
+    auto full = new BVH(vertices, faces.data(), faces.data() + faces.size(), 0,
+                        on_demand);
+
+    if (quantizationBits == 8) {
+        auto quantized = new QuantizedBVH<std::uint8_t>(*full, faces.data());
+        bytes = quantized->bytes();
+        bvh = quantized;
+        delete full;
+    } else if (quantizationBits == 16) {
+        auto quantized = new QuantizedBVH<std::uint16_t>(*full, faces.data());
+        bytes = quantized->bytes();
+        bvh = quantized;
+        delete full;
+    } else if (layout != NodeLayout::Pointer) {
+        auto flat = new FlatBVH(*full, faces.data(), layout);
+        bytes = flat->bytes();
+        bvh = flat;
+        delete full;
+    } else {
+        bytes = count_nodes(full) * sizeof(BVH);
+        builtRatio = on_demand ? 1 : full->surfaceAreaRatio();
+        bvh = full;
+    }
+}
+
+// Bounding sphere of the mesh, and the edge length of each level, for the
+// vertices as they are now.
+void Mesh::measure_levels()
+{
+    Box bounds;
+    for (int index : *pIndices)
+        bounds.update((*vertices)[index - 1]);
+
+    center = 0.5f * (bounds.min_point + bounds.max_point);
+    radius = 0.5f * (bounds.max_point - bounds.min_point).norm();
+
+    for (auto &level : levels) {
+        double sum = 0;
+        for (auto &face : level.faces) {
+            vec3f a, b, c;
+            face.getVertices(a, b, c);
+            sum += (b - a).norm() + (c - b).norm() + (a - c).norm();
+        }
+        level.edgeLength = sum / (3 * level.faces.size());
+    }
+}
+
+int Mesh::levelFor(const Ray &ray) const
+{
+    if (ray.coneWidth <= 0)
+        return -1;
+
+    // Narrowest the ray gets anywhere it can meet the mesh
+    const float distance = (center - ray.origin).norm();
+    const float width =
+        std::min(ray.widthAt(std::max(distance - radius, 0.0f)),
+                 ray.widthAt(distance + radius));
+
+    int level = -1;
+    while (level + 1 < static_cast<int>(levels.size()) &&
+           levels[level + 1].edgeLength <= lodTolerance * width)
+        ++level;
+
+    return level;
+}
+
+Mesh::~Mesh()
+{
+    delete bvh;
+    for (auto &level : levels)
+        delete level.bvh;
+    delete pIndices;
+}
+
+Hit Mesh::hit(const Ray &ray) const
+{
+    if (levels.empty())
+        return bvh->hit(ray);
+
+    const int level = levelFor(ray);
+    Hit hit = level < 0 ? bvh->hit(ray) : levels[level].bvh->hit(ray);
+    if (hit.t > 0)
+        hit.index = lod_index(level);
+
+    return hit;
+}
+
+void Mesh::hitPacket(const RayPacket &packet, std::uint64_t active,
+                     Hit *hits) const
 {
-    bvh = BVH(vertices, this->faces, 0);
+    if (levels.empty()) {
+        bvh->hitPacket(packet, active, hits);
+        return;
+    }
+
+    // Rays by the level they trace, the full mesh first
+    std::uint64_t groups[MAX_LOD_LEVELS + 1] = {};
+    for_each_ray(active, [&](int i) {
+        groups[levelFor(packet.rays[i]) + 1] |= std::uint64_t(1) << i;
+    });
+
+    for (int l = -1; l < static_cast<int>(levels.size()); ++l) {
+        if (!groups[l + 1])
+            continue;
+
+        (l < 0 ? bvh : levels[l].bvh)->hitPacket(packet, groups[l + 1], hits);
+        for_each_ray(groups[l + 1], [&](int i) {
+            if (hits[i].t > 0)
+                hits[i].index = lod_index(l);
+        });
+    }
+}
+
+void Mesh::fit_levels(ThreadPool &pool, float rebuildRatio)
+{
+    for (auto &level : levels) {
+        level.bvh->refit(vertices, pool);
+
+        if (level.bvh->surfaceAreaRatio() > rebuildRatio * level.builtRatio) {
+            delete level.bvh;
+            level.bvh = new BVH(vertices, level.faces.data(),
+                                level.faces.data() + level.faces.size(), 0);
+            level.builtRatio = level.bvh->surfaceAreaRatio();
+        }
+    }
+
+    measure_levels();
+}
+
+bool Mesh::refit(ThreadPool &pool, float rebuildRatio)
+{
+    fit_levels(pool, rebuildRatio);
+
+    if (kind != MeshAccelerator::BVH || lazy || quantizationBits ||
+        splitBudget >= 0 || layout != NodeLayout::Pointer) {
+        build();
+        return true;
+    }
+
+    auto full = static_cast<BVH *>(bvh);
+    full->refit(vertices, pool);
+
+    if (full->surfaceAreaRatio() > rebuildRatio * builtRatio) {
+        build();
+        return true;
+    }
+
+    return false;
+}
+
+void Mesh::collectVertices(std::vector<bool> &used) const
+{
+    for (auto &face : faces)
+        face.collectVertices(used);
+}
+
+// Only a plain BVH over the full mesh is built lazily.
+bool Mesh::builds_on_demand() const
+{
+    return lazy && kind == MeshAccelerator::BVH && splitBudget < 0 &&
+           !quantizationBits && layout == NodeLayout::Pointer;
+}
+
+bool Mesh::collectPrimitives(std::vector<RasterPrimitive> &primitives) const
+{
+    // A lazy hierarchy sorts faces in place as rays reach its nodes, which
+    // would swap them out from under the rasterized primitives.
+    if (builds_on_demand())
+        return false;
+
+    for (auto &face : faces)
+        face.collectPrimitives(primitives);
+
+    return true;
+}
+
+void Mesh::remapVertices(const std::vector<int> &remap)
+{
+    for (auto &face : faces)
+        face.remapVertices(remap);
+    for (auto &index : *pIndices)
+        index = remap[index - 1];
+    for (auto &level : levels)
+        for (auto &face : level.faces)
+            face.remapVertices(remap);
+}
+
+// Writes the hierarchy depth first, each node followed by its left subtree,
+// so that subtrees end up on as few pages as possible.
+static std::int32_t serialize_bvh(const BVH *node,
+                                  std::vector<PagedRecord> &records)
+{
+    const std::int32_t idx = records.size();
+    records.emplace_back();
+
+    PagedRecord record = {};
+    const vec3f &min = node->bounding_box.min_point,
+                &max = node->bounding_box.max_point;
+    std::copy_n(&min.x, 3, record.data);
+    std::copy_n(&max.x, 3, record.data + 3);
+    record.left = record.right = -1;
+
+    if (node->isLeaf()) {
+        record.flags = PagedRecord::LEAF;
+
+        for (auto child : {node->left, node->right}) {
+            if (!child)
+                continue;
+
+            PagedRecord triangle = {};
+            vec3f a, b, c;
+            static_cast<const Triangle *>(child)->getVertices(a, b, c);
+            std::copy_n(&a.x, 3, triangle.data);
+            std::copy_n(&b.x, 3, triangle.data + 3);
+            std::copy_n(&c.x, 3, triangle.data + 6);
+
+            (child == node->left ? record.left : record.right) = records.size();
+            records.push_back(triangle);
+        }
+    } else {
+        record.left = serialize_bvh(static_cast<const BVH *>(node->left),
+                                    records);
+        record.right = serialize_bvh(static_cast<const BVH *>(node->right),
+                                     records);
+    }
+
+    records[idx] = record;
+    return idx;
+}
+
+PagedMesh::PagedMesh(int id, int matIndex, const BVH &bvh, PageFile *file)
+    : Shape(id, matIndex), file(file)
+{
+    std::vector<PagedRecord> records;
+    serialize_bvh(&bvh, records);
+
+    // Child links are relative to the mesh so far, the file decides where its
+    // records start.
+    root = file->nextRecord();
+    for (auto &record : records) {
+        if (record.left != -1)
+            record.left += root;
+        if (record.right != -1)
+            record.right += root;
+    }
+
+    file->append(records);
+}
+
+// Kept across calls, so that consecutive rays through the same part of the
+// hierarchy do not go through the shared cache at all.
+static thread_local PageFile::Cursor paged_cursor;
+
+Hit PagedMesh::hit(const Ray &ray) const
+{
+    return intersect_node(ray, root, paged_cursor);
+}
+
+HitRecord PagedMesh::hitRecord(const Ray &ray, const Hit &hit) const
+{
+    const PagedRecord triangle = file->fetch(hit.index, paged_cursor);
+    const float *v = triangle.data;
+
+    return triangle_hit_record({v[0], v[1], v[2]}, {v[3], v[4], v[5]},
+                               {v[6], v[7], v[8]}, ray, hit, matIndex);
+}
+
+// Mirrors BVH::hit, so that hits and ties resolve exactly as they do for an
+// in-memory Mesh.
+Hit PagedMesh::intersect_node(const Ray &ray, std::int32_t idx,
+                              PageFile::Cursor &cursor) const
+{
+    Hit right_hit = MISS, left_hit = MISS;
+    const PagedRecord node = file->fetch(idx, cursor);
+
+    Box box({node.data[0], node.data[1], node.data[2]},
+            {node.data[3], node.data[4], node.data[5]});
+    if (!box.intersects(ray))
+        return MISS;
+
+    if (node.flags & PagedRecord::LEAF) {
+        if (node.left != -1)
+            left_hit = intersect_record(ray, node.left, cursor);
+        if (node.right != -1)
+            right_hit = intersect_record(ray, node.right, cursor);
+    } else {
+        if (node.left != -1)
+            left_hit = intersect_node(ray, node.left, cursor);
+        if (node.right != -1)
+            right_hit = intersect_node(ray, node.right, cursor);
+    }
+
+    return closest(left_hit, right_hit);
 }
 
-HitRecord Mesh::intersect(const Ray &ray) const { return bvh.intersect(ray); }
+Hit PagedMesh::intersect_record(const Ray &ray, std::int32_t idx,
+                                PageFile::Cursor &cursor) const
+{
+    const PagedRecord triangle = file->fetch(idx, cursor);
+    const float *v = triangle.data;
+
+    Hit hit = intersect_triangle({v[0], v[1], v[2]}, {v[3], v[4], v[5]},
+                                 {v[6], v[7], v[8]}, ray);
+    hit.index = idx;
+    hit.shape = this;
+
+    return hit;
+}
 
 Box::Box()
 {
@@ -156,29 +770,26 @@ void Box::update(const vec3f &p)
 #undef IFY
 }
 
+float Box::surfaceArea() const
+{
+    vec3f extent = max_point - min_point;
+
+    return 2 * (extent.x * extent.y + extent.y * extent.z +
+                extent.z * extent.x);
+}
+
 bool Box::intersects(const Ray &ray) const
 {
-    float dx = 1 / ray.direction.x, dy = 1 / ray.direction.y,
-          dz = 1 / ray.direction.z, t_x_min, t_x_max, t_y_min, t_y_max, t_z_min,
-          t_z_max;
-
-#define BERK(C)                                                                \
-    if ((d##C) >= 0) {                                                         \
-        t_##C##_min = (d##C) * (min_point.C - ray.origin.C);                   \
-        t_##C##_max = (d##C) * (max_point.C - ray.origin.C);                   \
-    } else {                                                                   \
-        t_##C##_min = (d##C) * (max_point.C - ray.origin.C);                   \
-        t_##C##_max = (d##C) * (min_point.C - ray.origin.C);                   \
-    }
+    using giraffe::vec4f;
 
-    BERK(x);
-    BERK(y);
-    BERK(z);
+    ++traversal_work.nodeVisits;
 
-#undef BERK
+    vec4f origin(ray.origin), inv_direction(ray.invDirection);
+    vec4f t_0 = (vec4f(min_point) - origin) * inv_direction,
+          t_1 = (vec4f(max_point) - origin) * inv_direction;
 
-    float t_min = std::max(std::max(t_x_min, t_y_min), t_z_min),
-          t_max = std::min(std::min(t_x_max, t_y_max), t_z_max);
+    float t_min = giraffe::hmax3(giraffe::min(t_0, t_1)),
+          t_max = giraffe::hmin3(giraffe::max(t_0, t_1));
 
     return t_min <= t_max;
 }
@@ -319,89 +930,245 @@ auto the_conjuring(
 /*                                               */
 /*▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒▒*/
 
-BVH::BVH(std::vector<vec3f> *vertices, const std::vector<Triangle> &triangles,
-         int axisIndex)
-    : Shape(-1, -1)
+BVH::BVH(std::vector<vec3f> *vertices, Triangle *first, Triangle *last,
+         int axisIndex, bool lazy)
+    : Shape(-1, -1), leaf(true)
 {
-    auto triangle_count = triangles.size();
+    auto triangle_count = last - first;
 
     if (triangle_count == 0) {
         left = right = nullptr;
     } else if (triangle_count == 1) {
-        left = (Shape *)&triangles[0];
+        left = &first[0];
         right = nullptr;
-        bounding_box = the_conjuring(vertices, (Triangle *)left);
+        fit_leaf(vertices);
     } else if (triangle_count == 2) {
-        left = (Shape *)&triangles[0];
-        right = (Shape *)&triangles[1];
-        Box left_bounding_box = the_conjuring(vertices, (Triangle *)left);
-        Box right_bounding_box = the_conjuring(vertices, (Triangle *)right);
-        bounding_box = Box(left_bounding_box, right_bounding_box);
+        left = &first[0];
+        right = &first[1];
+        fit_leaf(vertices);
+    } else if (lazy) {
+        // The box of the whole range is the one the children would add up
+        // to, so it can be had without building them.
+        leaf = false;
+        left = right = nullptr;
+        bounding_box = the_conjuring(vertices, first);
+        for (auto triangle = first + 1; triangle != last; ++triangle)
+            bounding_box =
+                Box(bounding_box, the_conjuring(vertices, triangle));
+        pending.store(new Pending{vertices, first, last, axisIndex},
+                      std::memory_order_relaxed);
     } else {
-        auto half_triangle_count = triangle_count / 2;
-        auto triangles_copy = triangles;
-
-        std::sort(triangles_copy.begin(), triangles_copy.end(),
-                  [vertices, axisIndex](Triangle s1, Triangle s2) {
-                      Box s1_box, s2_box;
-                      s1_box = the_conjuring(vertices, &s1);
-                      s2_box = the_conjuring(vertices, &s2);
-                      auto s1_mid_point =
-                          (s1_box.min_point + s1_box.max_point) / 2;
-                      auto s2_mid_point =
-                          (s2_box.min_point + s2_box.max_point) / 2;
-                      float s1_mp, s2_mp;
-                      if (axisIndex == 0) {
-                          s1_mp = s1_mid_point.x;
-                          s2_mp = s2_mid_point.x;
-                      } else if (axisIndex == 1) {
-                          s1_mp = s1_mid_point.y;
-                          s2_mp = s2_mid_point.y;
-                      } else if (axisIndex == 2) {
-                          s1_mp = s1_mid_point.y;
-                          s2_mp = s2_mid_point.y;
-                      }
-                      return s1_mp < s2_mp;
-                  });
-
-        auto lefts = new std::vector<Triangle>(triangles_copy.begin(),
-                                               triangles_copy.begin() +
-                                                   half_triangle_count);
-        auto rights = new std::vector<Triangle>(
-            triangles_copy.begin() + half_triangle_count, triangles_copy.end());
-        auto next_axis = (axisIndex + 1) % 3;
-
-        auto left_bvh = new BVH(vertices, *lefts, next_axis);
-        auto right_bvh = new BVH(vertices, *rights, next_axis);
-        left = left_bvh;
-        right = right_bvh;
-        bounding_box = Box(left_bvh->bounding_box, right_bvh->bounding_box);
+        split(vertices, first, last, axisIndex, false);
+        bounding_box = Box(static_cast<BVH *>(left)->bounding_box,
+                           static_cast<BVH *>(right)->bounding_box);
+    }
+}
+
+// Sorts the triangles by their centers along axisIndex, and builds a child
+// from each half.
+void BVH::split(std::vector<vec3f> *vertices, Triangle *first, Triangle *last,
+                int axisIndex, bool lazy)
+{
+    auto half_triangle_count = (last - first) / 2;
+
+    std::sort(first, last, [vertices, axisIndex](Triangle s1, Triangle s2) {
+        Box s1_box, s2_box;
+        s1_box = the_conjuring(vertices, &s1);
+        s2_box = the_conjuring(vertices, &s2);
+        auto s1_mid_point = (s1_box.min_point + s1_box.max_point) / 2;
+        auto s2_mid_point = (s2_box.min_point + s2_box.max_point) / 2;
+        float s1_mp, s2_mp;
+        if (axisIndex == 0) {
+            s1_mp = s1_mid_point.x;
+            s2_mp = s2_mid_point.x;
+        } else if (axisIndex == 1) {
+            s1_mp = s1_mid_point.y;
+            s2_mp = s2_mid_point.y;
+        } else if (axisIndex == 2) {
+            s1_mp = s1_mid_point.y;
+            s2_mp = s2_mid_point.y;
+        }
+        return s1_mp < s2_mp;
+    });
+
+    auto next_axis = (axisIndex + 1) % 3;
+
+    auto left_bvh = new BVH(vertices, first, first + half_triangle_count,
+                            next_axis, lazy);
+    auto right_bvh = new BVH(vertices, first + half_triangle_count, last,
+                             next_axis, lazy);
+    leaf = false;
+    left = left_bvh;
+    right = right_bvh;
+}
+
+// Splits a lazy node. Threads that reach it while another one is at it wait
+// for that one to finish.
+void BVH::split_pending() const
+{
+    std::call_once(splitting, [this] {
+        const Pending *p = pending.load(std::memory_order_relaxed);
+
+        const_cast<BVH *>(this)->split(p->vertices, p->first, p->last,
+                                       p->axisIndex, true);
+        pending.store(nullptr, std::memory_order_release);
+        delete p;
+    });
+}
+
+BVH::~BVH()
+{
+    delete pending.load(std::memory_order_relaxed);
+
+    if (!leaf) {
+        delete left;
+        delete right;
     }
 }
 
-HitRecord BVH::intersect(const Ray &ray) const
+Hit BVH::hit(const Ray &ray) const
 {
-    HitRecord right_hr = NO_HIT, left_hr = NO_HIT;
+    Hit right_hit = MISS, left_hit = MISS;
 
     if (!bounding_box.intersects(ray))
-        return NO_HIT;
+        return MISS;
+
+    if (!isSplit())
+        split_pending();
 
     if (left)
-        left_hr = left->intersect(ray);
+        left_hit = left->hit(ray);
     if (right)
-        right_hr = right->intersect(ray);
+        right_hit = right->hit(ray);
 
-    if (left_hr.t > 0 && right_hr.t > 0) {
-        if (left_hr.t <= right_hr.t)
-            return left_hr;
-        else
-            return right_hr;
+    return closest(left_hit, right_hit);
+}
+
+void BVH::hitPacket(const RayPacket &packet, std::uint64_t active,
+                    Hit *hits) const
+{
+    for_each_ray(active, [&](int i) { hits[i] = MISS; });
+    hit_packet(packet, active, hits);
+}
+
+// Folds each ray's hits in this subtree into hits[i] with closest, in the
+// order BVH::hit visits them. That gives every ray the same hit it gets on
+// its own, ties included.
+void BVH::hit_packet(const RayPacket &packet, std::uint64_t active,
+                     Hit *hits) const
+{
+    if (packet.missesAll(bounding_box))
+        return;
+
+    active = packet.intersects(bounding_box, active);
+
+    if (__builtin_popcountll(active) < RayPacket::MIN_ACTIVE) {
+        for_each_ray(active, [&](int i) {
+            hits[i] = closest(hits[i], hit(packet.rays[i]));
+        });
+    } else if (leaf) {
+        for_each_ray(active, [&](int i) {
+            const Ray &ray = packet.rays[i];
+
+            if (left)
+                hits[i] = closest(hits[i], left->hit(ray));
+            if (right)
+                hits[i] = closest(hits[i], right->hit(ray));
+        });
+    } else {
+        if (!isSplit())
+            split_pending();
+
+        static_cast<const BVH *>(left)->hit_packet(packet, active, hits);
+        static_cast<const BVH *>(right)->hit_packet(packet, active, hits);
     }
+}
 
-    if (left_hr.t > 0)
-        return left_hr;
-    if (right_hr.t > 0)
-        return right_hr;
+void BVH::fit_leaf(std::vector<vec3f> *vertices)
+{
+    if (!left)
+        return;
 
-    return NO_HIT;
+    bounding_box = the_conjuring(vertices, (Triangle *)left);
+
+    if (right) {
+        Box right_bounding_box = the_conjuring(vertices, (Triangle *)right);
+        bounding_box = Box(bounding_box, right_bounding_box);
+    }
+}
+
+void BVH::refit(std::vector<vec3f> *vertices, ThreadPool &pool)
+{
+    // Split off enough subtrees to keep every worker busy, refit them as
+    // separate tasks, then finish the few nodes above them here.
+    int depth = 0;
+    while ((1u << depth) < 4 * pool.size())
+        ++depth;
+
+    std::vector<BVH *> subtrees;
+    collect_subtrees(depth, subtrees);
+
+    std::vector<std::future<void>> tasks;
+    for (auto subtree : subtrees)
+        tasks.push_back(
+            pool.submit([=] { subtree->refit_subtree(vertices); }));
+    for (auto &task : tasks)
+        task.get();
+
+    refit_top(depth);
+}
+
+void BVH::collect_subtrees(int depth, std::vector<BVH *> &subtrees)
+{
+    if (depth == 0 || leaf) {
+        subtrees.push_back(this);
+        return;
+    }
+
+    static_cast<BVH *>(left)->collect_subtrees(depth - 1, subtrees);
+    static_cast<BVH *>(right)->collect_subtrees(depth - 1, subtrees);
+}
+
+void BVH::refit_subtree(std::vector<vec3f> *vertices)
+{
+    if (leaf) {
+        fit_leaf(vertices);
+        return;
+    }
+
+    auto left_bvh = static_cast<BVH *>(left),
+         right_bvh = static_cast<BVH *>(right);
+    left_bvh->refit_subtree(vertices);
+    right_bvh->refit_subtree(vertices);
+    bounding_box = Box(left_bvh->bounding_box, right_bvh->bounding_box);
+}
+
+// Refits the nodes above the subtrees collect_subtrees() returned for depth.
+void BVH::refit_top(int depth)
+{
+    if (depth == 0 || leaf)
+        return;
+
+    auto left_bvh = static_cast<BVH *>(left),
+         right_bvh = static_cast<BVH *>(right);
+    left_bvh->refit_top(depth - 1);
+    right_bvh->refit_top(depth - 1);
+    bounding_box = Box(left_bvh->bounding_box, right_bvh->bounding_box);
+}
+
+float BVH::surfaceAreaRatio() const
+{
+    const float root_area = bounding_box.surfaceArea();
+
+    return root_area > 0 ? surface_area_sum() / root_area : 1;
+}
+
+double BVH::surface_area_sum() const
+{
+    if (leaf || !left)
+        return bounding_box.surfaceArea();
+
+    return bounding_box.surfaceArea() +
+           static_cast<const BVH *>(left)->surface_area_sum() +
+           static_cast<const BVH *>(right)->surface_area_sum();
 }
@@ -1,29 +1,88 @@
 #ifndef _SHAPE_H_
 #define _SHAPE_H_
 
+#include "PageFile.h"
 #include "Ray.h"
 #include "defs.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <vector>
 
+class ThreadPool;
+struct RayPacket;
+
+// Work the calling thread's ray queries have done since it started: a node
+// visit for each ray tested against a box, a primitive test for each ray
+// tested against a sphere or triangle. Cheap enough to always count;
+// heatmap renders sample it around each pixel.
+struct TraversalWork {
+    unsigned long nodeVisits = 0;
+    unsigned long primitiveTests = 0;
+};
+
+extern thread_local TraversalWork traversal_work;
+
 struct Box {
     Box(vec3f min_point, vec3f max_point);
     Box();
     Box(const Box &left, const Box &right);
     void update(const vec3f &p);
     bool intersects(const Ray &ray) const;
+    float surfaceArea() const;
     vec3f min_point, max_point;
 };
 
+// A sphere or triangle of the scene, as a rasterizer takes it (see
+// VisibilityBuffer).
+struct RasterPrimitive {
+    const Shape *shape; // The Sphere or Triangle itself
+    vec3f a, b, c;      // Corners of a triangle, or a is a sphere's center
+    float radius;       // Of a sphere, 0 for a triangle
+};
+
 class Shape
 {
   public:
     int id;
     int matIndex;
 
-    virtual HitRecord intersect(const Ray &ray) const = 0;
+    // Closest hit along ray, if any, without its attributes.
+    virtual Hit hit(const Ray &ray) const = 0;
+    // Position, normal and material of a hit this shape returned for ray.
+    virtual HitRecord hitRecord(const Ray &ray, const Hit &hit) const
+    {
+        return NO_HIT;
+    }
+    // Both at once, for when the closest hit is all that is wanted.
+    virtual HitRecord intersect(const Ray &ray) const;
+    // The hit() of each ray of packet in active, into hits at the ray's
+    // index. Traces them one at a time unless the shape knows better.
+    virtual void hitPacket(const RayPacket &packet, std::uint64_t active,
+                           Hit *hits) const;
 
     Shape(void);
     Shape(int id, int matIndex);
+    virtual ~Shape() = default;
+
+    // Marks the entries of Scene::vertices this shape refers to, and moves
+    // its references to new (1-based) indices after the vector is compacted.
+    virtual void collectVertices(std::vector<bool> &used) const {}
+    virtual void remapVertices(const std::vector<int> &remap) {}
+
+    // Appends the spheres and triangles the shape is made of to primitives,
+    // for rasterizing. Returns false if they are not in memory.
+    virtual bool collectPrimitives(std::vector<RasterPrimitive> &primitives)
+        const
+    {
+        return false;
+    }
+
+    // Updates acceleration structures after Scene::vertices moved, using
+    // pool for the heavy lifting. Returns true if the structure had to be
+    // rebuilt rather than refitted.
+    virtual bool refit(ThreadPool &pool, float rebuildRatio) { return false; }
 };
 
 class Sphere : public Shape
@@ -32,7 +91,11 @@ class Sphere : public Shape
     Sphere(void);
     Sphere(int id, int matIndex, int cIndex, float R,
            std::vector<vec3f> *vertices);
-    HitRecord intersect(const Ray &ray) const;
+    Hit hit(const Ray &ray) const;
+    HitRecord hitRecord(const Ray &ray, const Hit &hit) const;
+    void collectVertices(std::vector<bool> &used) const;
+    void remapVertices(const std::vector<int> &remap);
+    bool collectPrimitives(std::vector<RasterPrimitive> &primitives) const;
 
   private:
     int centerIdx;
@@ -46,39 +109,239 @@ class Triangle : public Shape
     Triangle(void);
     Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index,
              std::vector<vec3f> *vertices);
+    Hit hit(const Ray &ray) const;
+    HitRecord hitRecord(const Ray &ray, const Hit &hit) const;
     HitRecord intersect(const Ray &ray) const;
+    void getVertices(vec3f &a, vec3f &b, vec3f &c) const;
+    void collectVertices(std::vector<bool> &used) const;
+    void remapVertices(const std::vector<int> &remap);
+    bool collectPrimitives(std::vector<RasterPrimitive> &primitives) const;
 
   private:
     int aIdx, bIdx, cIdx;
     std::vector<vec3f> *vertices;
 };
 
+// Bounding volume hierarchy over the triangles in [first, last). The range is
+// reordered in place while building, and leaves point into it, so it must
+// outlive the hierarchy.
+//
+// A lazy hierarchy starts out as just the root box. Each node is split the
+// first time a ray enters it, by whichever thread gets there first, into
+// the same children an eager build makes. Rays therefore hit exactly what
+// they would in the eager tree; the parts no ray reaches are never built.
 class BVH : public Shape
 {
   public:
-    BVH() = default;
-    BVH(std::vector<vec3f> *vertices, const std::vector<Triangle> &triangles,
-        int axisIndex);
-    HitRecord intersect(const Ray &ray) const;
+    BVH(std::vector<vec3f> *vertices, Triangle *first, Triangle *last,
+        int axisIndex, bool lazy = false);
+    ~BVH();
+    BVH(const BVH &) = delete;
+    BVH &operator=(const BVH &) = delete;
+    Hit hit(const Ray &ray) const;
+    void hitPacket(const RayPacket &packet, std::uint64_t active,
+                   Hit *hits) const;
+    bool isLeaf() const { return leaf; }
+    // False for an inner node of a lazy hierarchy that has not been split
+    // yet. It has no children until then.
+    bool isSplit() const
+    {
+        return !pending.load(std::memory_order_acquire);
+    }
+
+    // Recomputes every box bottom up for new vertex positions, keeping the
+    // tree as it is. Subtrees are refitted in parallel on pool.
+    void refit(std::vector<vec3f> *vertices, ThreadPool &pool);
+
+    // Summed surface area of all nodes relative to the root's. Refitting
+    // after large motion makes boxes overlap and this grow, along with the
+    // number of nodes rays visit.
+    float surfaceAreaRatio() const;
 
     Box bounding_box;
     Shape *left, *right;
+
+  private:
+    // What a lazy node needs to split itself later.
+    struct Pending {
+        std::vector<vec3f> *vertices;
+        Triangle *first, *last;
+        int axisIndex;
+    };
+
+    void hit_packet(const RayPacket &packet, std::uint64_t active,
+                    Hit *hits) const;
+    void split(std::vector<vec3f> *vertices, Triangle *first, Triangle *last,
+               int axisIndex, bool lazy);
+    void split_pending() const;
+    void fit_leaf(std::vector<vec3f> *vertices);
+    void refit_subtree(std::vector<vec3f> *vertices);
+    void refit_top(int depth);
+    void collect_subtrees(int depth, std::vector<BVH *> &subtrees);
+    double surface_area_sum() const;
+
+    bool leaf; // left and right are triangles rather than BVH nodes
+
+    // Set until a lazy node is split
+    mutable std::atomic<Pending *> pending{nullptr};
+    mutable std::once_flag splitting;
+};
+
+// Where the nodes of a full float mesh hierarchy live.
+enum class NodeLayout {
+    Pointer,     // Wherever new puts them, one allocation per node
+    DepthFirst,  // One array, each node followed by its left subtree
+    VanEmdeBoas, // One array, halves of the levels nested recursively
+    Treelet,     // One array, in page-sized treelets of the likeliest nodes
+};
+
+// What finds the faces rays hit in an in-memory mesh.
+enum class MeshAccelerator {
+    Auto,   // Picked per mesh from statistics of its faces
+    BVH,    // Bounding volume hierarchy, in the format asked for
+    Grid,   // Two-level uniform grid (see Grid)
+    KdTree, // Kd-tree (see KdTree)
 };
 
 class Mesh : public Shape
 {
   public:
     Mesh(void);
+    // quantizationBits selects the node format of the hierarchy: 0 for full
+    // floats, 8 or 16 for a QuantizedBVH. A splitBudget of 0 or more builds
+    // a SpatialBVH with that budget instead, and overrides it. layout only
+    // applies to full floats; anything but Pointer copies the hierarchy into
+    // a FlatBVH. lazy builds a plain BVH on demand (see BVH); the other
+    // formats are made from a whole tree and ignore it.
+    //
+    // lodLevels adds up to that many simplified copies of the mesh, each
+    // with about a quarter of the faces of the one before (see
+    // simplify_mesh), under plain BVHs. Rays with a footprint (see
+    // Ray::coneWidth) trace the coarsest copy whose edges are no longer
+    // than lodTolerance times the ray's width where it reaches the mesh.
+    //
+    // accelerator may replace the hierarchy over the full mesh with a grid
+    // or kd-tree, which take none of the options above. Auto keeps the
+    // hierarchy if any of them is set, and otherwise picks by how much the
+    // faces vary in size and how evenly they fill the mesh's bounds.
     Mesh(int id, int matIndex, const std::vector<Triangle> &faces,
-         std::vector<int> *pIndices, std::vector<vec3f> *vertices);
-    HitRecord intersect(const Ray &ray) const;
+         std::vector<int> *pIndices, std::vector<vec3f> *vertices,
+         int quantizationBits = 0, float splitBudget = -1,
+         NodeLayout layout = NodeLayout::Pointer, bool lazy = false,
+         int lodLevels = 0, float lodTolerance = 1,
+         MeshAccelerator accelerator = MeshAccelerator::BVH);
+    ~Mesh();
+    Mesh(const Mesh &) = delete;
+    Mesh &operator=(const Mesh &) = delete;
+    Hit hit(const Ray &ray) const;
+    void hitPacket(const RayPacket &packet, std::uint64_t active,
+                   Hit *hits) const;
+    void collectVertices(std::vector<bool> &used) const;
+    void remapVertices(const std::vector<int> &remap);
+    // The full mesh, whatever levels of detail it has. False with a lazy
+    // hierarchy, which moves the faces around while rays are traced.
+    bool collectPrimitives(std::vector<RasterPrimitive> &primitives) const;
+
+    // Refits the hierarchy, and rebuilds it instead once its surface area
+    // ratio has grown past rebuildRatio times the one it was built with.
+    // Lazy, flattened, quantized and spatial split hierarchies are always
+    // rebuilt, as are grids and kd-trees.
+    bool refit(ThreadPool &pool, float rebuildRatio);
+
+    // Memory taken by the nodes of the hierarchy, when it was built. Lazy
+    // hierarchies only have their root then.
+    std::size_t hierarchyBytes() const { return bytes; }
+
+    std::size_t faceCount() const { return faces.size(); }
+    // Face references in the leaves, more than faceCount() with spatial
+    // splits.
+    std::size_t referenceCount() const { return references; }
+    // What the full mesh was built with, never Auto.
+    MeshAccelerator accelerator() const { return kind; }
+    // Simplified copies actually built, which may be fewer than asked for.
+    std::size_t lodCount() const { return levels.size(); }
+    // The copy ray traces, or -1 for the full mesh.
+    int levelFor(const Ray &ray) const;
 
   private:
+    // A simplified copy of the mesh.
+    struct Level {
+        std::vector<Triangle> faces;
+        BVH *bvh;
+        float builtRatio;
+        float edgeLength; // Mean over the faces
+    };
+
+    void build();
+    bool builds_on_demand() const;
+    void build_levels(int count);
+    void fit_levels(ThreadPool &pool, float rebuildRatio);
+    void measure_levels();
+
     std::vector<Triangle> faces;
     std::vector<int> *pIndices;
     std::vector<vec3f> *vertices;
 
-    BVH bvh;
+    // A BVH, FlatBVH, QuantizedBVH, SpatialBVH, Grid or KdTree over faces
+    Shape *bvh = nullptr;
+    MeshAccelerator kind = MeshAccelerator::BVH;
+    int quantizationBits = 0;
+    float splitBudget = -1;
+    NodeLayout layout = NodeLayout::Pointer;
+    bool lazy = false;
+    std::size_t references = 0;
+    float builtRatio = 1; // surfaceAreaRatio() right after the last build
+    std::size_t bytes = 0;
+
+    std::vector<Level> levels; // Finest first
+    float lodTolerance = 1;
+    // Bounding sphere, which bounds how far along rays meet the mesh
+    vec3f center;
+    float radius = 0;
+};
+
+// Mesh whose BVH and triangles live in a PageFile rather than in memory, and
+// are faulted in page by page during traversal. Triangles carry their own
+// vertices, so the mesh does not need Scene::vertices.
+class PagedMesh : public Shape
+{
+  public:
+    // Writes bvh, which must be built over this mesh's faces, to file.
+    PagedMesh(int id, int matIndex, const BVH &bvh, PageFile *file);
+    Hit hit(const Ray &ray) const;
+    HitRecord hitRecord(const Ray &ray, const Hit &hit) const;
+
+  private:
+    Hit intersect_node(const Ray &ray, std::int32_t idx,
+                       PageFile::Cursor &cursor) const;
+    Hit intersect_record(const Ray &ray, std::int32_t idx,
+                         PageFile::Cursor &cursor) const;
+
+    PageFile *file;
+    std::int32_t root;
 };
 
+// Intersection test shared by Triangle and PagedMesh. The returned hit has no
+// shape set.
+Hit intersect_triangle(const vec3f &a, const vec3f &b, const vec3f &c,
+                       const Ray &ray);
+
+// Attributes of a hit on the triangle abc.
+HitRecord triangle_hit_record(const vec3f &a, const vec3f &b, const vec3f &c,
+                              const Ray &ray, const Hit &hit, int matIndex);
+
+// The closer of two hits, or left if they tie. Shared by all hierarchies, so
+// that they resolve ties the same way.
+inline Hit closest(const Hit &left_hit, const Hit &right_hit)
+{
+    if (left_hit.t > 0 && right_hit.t > 0)
+        return left_hit.t <= right_hit.t ? left_hit : right_hit;
+    if (left_hit.t > 0)
+        return left_hit;
+    if (right_hit.t > 0)
+        return right_hit;
+
+    return MISS;
+}
+
 #endif
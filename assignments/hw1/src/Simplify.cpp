@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+
+#include "Simplify.h"
+
+// Edges on the border of the surface get a plane at right angles to their
+// face, weighted this much more than faces are, so that borders keep their
+// shape rather than eroding.
+static constexpr double BOUNDARY_WEIGHT = 100;
+
+// Sum of squared distances to weighted planes, as the upper triangle of a
+// symmetric 4x4 matrix.
+struct Quadric {
+    double q[10] = {};
+
+    // Plane ax + by + cz + d = 0, with (a, b, c) of unit length.
+    void addPlane(double a, double b, double c, double d, double weight)
+    {
+        const double p[4] = {a, b, c, d};
+        int k = 0;
+
+        for (int i = 0; i < 4; ++i)
+            for (int j = i; j < 4; ++j)
+                q[k++] += weight * p[i] * p[j];
+    }
+
+    Quadric &operator+=(const Quadric &other)
+    {
+        for (int k = 0; k < 10; ++k)
+            q[k] += other.q[k];
+
+        return *this;
+    }
+
+    double error(const vec3f &v) const
+    {
+        const double x = v.x, y = v.y, z = v.z;
+
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z +
+               2 * q[3] * x + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+               q[7] * z * z + 2 * q[8] * z + q[9];
+    }
+};
+
+// Collapse of vertex from onto vertex to, still valid while neither has
+// changed since (see EdgeCollapse::stamps).
+struct Collapse {
+    double cost;
+    int from, to;
+    unsigned int fromStamp, toStamp;
+    bool reversed; // The other way round was tried first, and failed
+
+    // Cheapest first, and ties in a fixed order, so that the result does
+    // not depend on the heap.
+    bool operator>(const Collapse &other) const
+    {
+        if (cost != other.cost)
+            return cost > other.cost;
+        if (from != other.from)
+            return from > other.from;
+        return to > other.to;
+    }
+};
+
+using Face = std::array<int, 3>;
+
+// A mesh being simplified, over its own copy of the vertices it uses.
+class EdgeCollapse
+{
+  public:
+    EdgeCollapse(const std::vector<vec3f> &vertices,
+                 const std::vector<int> &indices);
+
+    // Collapses edges, cheapest first, until no more than target faces are
+    // left or no edge can go.
+    void run(std::size_t target);
+
+    // The faces left, as 1-based indices of the original vertices.
+    std::vector<int> faces() const;
+
+  private:
+    void push_edge(int u, int v, bool reversed = false);
+    bool collapse(int from, int to);
+    vec3f normal(const Face &face) const; // Not normalized
+    std::vector<int> neighbours(int v) const;
+
+    std::vector<vec3f> positions;
+    std::vector<int> original; // Index of each vertex in the input
+    std::vector<Quadric> quadrics;
+    // Bumped whenever a vertex takes in another, which changes the cost of
+    // all of its edges.
+    std::vector<unsigned int> stamps;
+    std::vector<bool> removed; // Collapsed onto another vertex
+
+    std::vector<Face> triangles;
+    std::vector<bool> dead;              // Collapsed to a line
+    std::vector<std::vector<int>> around; // Faces of each vertex, and some
+                                          // dead ones
+    std::size_t live = 0;
+
+    std::priority_queue<Collapse, std::vector<Collapse>,
+                        std::greater<Collapse>>
+        heap;
+};
+
+static std::uint64_t edge_key(int u, int v)
+{
+    return std::uint64_t(std::min(u, v)) << 32 | std::max(u, v);
+}
+
+EdgeCollapse::EdgeCollapse(const std::vector<vec3f> &vertices,
+                           const std::vector<int> &indices)
+{
+    std::unordered_map<int, int> local;
+
+    for (std::size_t i = 0; i + 2 < indices.size(); i += 3) {
+        Face face;
+
+        for (int k = 0; k < 3; ++k) {
+            auto it = local.emplace(indices[i + k], positions.size()).first;
+            if (it->second == static_cast<int>(positions.size())) {
+                positions.push_back(vertices[indices[i + k] - 1]);
+                original.push_back(indices[i + k]);
+            }
+            face[k] = it->second;
+        }
+
+        triangles.push_back(face);
+    }
+
+    quadrics.resize(positions.size());
+    stamps.resize(positions.size());
+    removed.resize(positions.size());
+    around.resize(positions.size());
+    dead.resize(triangles.size());
+
+    std::unordered_map<std::uint64_t, int> edges; // Faces on each edge
+
+    for (std::size_t f = 0; f < triangles.size(); ++f) {
+        const Face &face = triangles[f];
+
+        if (face[0] == face[1] || face[1] == face[2] || face[0] == face[2]) {
+            dead[f] = true;
+            continue;
+        }
+
+        ++live;
+        for (int k = 0; k < 3; ++k) {
+            around[face[k]].push_back(f);
+            ++edges[edge_key(face[k], face[(k + 1) % 3])];
+        }
+
+        // Planes weighted by area, so that slivers count for little
+        const vec3f n = normal(face);
+        const double length = n.norm();
+        if (length == 0)
+            continue;
+
+        const vec3f unit = n / length;
+        const vec3f &a = positions[face[0]];
+        for (int k = 0; k < 3; ++k)
+            quadrics[face[k]].addPlane(unit.x, unit.y, unit.z, -(unit * a),
+                                       length / 2);
+    }
+
+    for (std::size_t f = 0; f < triangles.size(); ++f) {
+        if (dead[f])
+            continue;
+
+        const Face &face = triangles[f];
+        const vec3f n = normal(face);
+
+        for (int k = 0; k < 3; ++k) {
+            const int u = face[k], v = face[(k + 1) % 3];
+            if (edges[edge_key(u, v)] != 1)
+                continue;
+
+            const vec3f edge = positions[v] - positions[u];
+            const vec3f side = giraffe::cross(edge, n);
+            const double length = side.norm();
+            if (length == 0)
+                continue;
+
+            const vec3f unit = side / length;
+            const double weight = BOUNDARY_WEIGHT * (edge * edge);
+            quadrics[u].addPlane(unit.x, unit.y, unit.z,
+                                 -(unit * positions[u]), weight);
+            quadrics[v].addPlane(unit.x, unit.y, unit.z,
+                                 -(unit * positions[u]), weight);
+        }
+    }
+
+    for (auto &edge : edges)
+        push_edge(edge.first >> 32, edge.first & 0xffffffff);
+}
+
+vec3f EdgeCollapse::normal(const Face &face) const
+{
+    const vec3f &a = positions[face[0]];
+
+    return giraffe::cross(positions[face[1]] - a, positions[face[2]] - a);
+}
+
+// Queues the collapse of edge uv, whichever way round is cheaper. The
+// other only gets queued if that one fails.
+void EdgeCollapse::push_edge(int u, int v, bool reversed)
+{
+    Quadric q = quadrics[u];
+    q += quadrics[v];
+
+    const double onto_v = q.error(positions[v]);
+    const double onto_u = q.error(positions[u]);
+
+    if (reversed || onto_v <= onto_u)
+        heap.push({onto_v, u, v, stamps[u], stamps[v], reversed});
+    else
+        heap.push({onto_u, v, u, stamps[v], stamps[u], false});
+}
+
+std::vector<int> EdgeCollapse::neighbours(int v) const
+{
+    std::vector<int> result;
+
+    for (int f : around[v]) {
+        if (dead[f])
+            continue;
+        for (int w : triangles[f])
+            if (w != v)
+                result.push_back(w);
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+
+    return result;
+}
+
+// Moves from onto to, unless that would fold a face over or join two parts
+// of the surface that only touched through the edge. Returns whether it
+// did.
+bool EdgeCollapse::collapse(int from, int to)
+{
+    int shared = 0; // Faces on the edge, which collapse with it
+
+    for (int f : around[from]) {
+        if (dead[f])
+            continue;
+
+        const Face &face = triangles[f];
+        if (std::count(face.begin(), face.end(), to)) {
+            ++shared;
+            continue;
+        }
+
+        Face moved = face;
+        std::replace(moved.begin(), moved.end(), from, to);
+        const vec3f before = normal(face), after = normal(moved);
+        if (before * after <= 0 || after.norm() == 0)
+            return false;
+    }
+
+    if (!shared)
+        return false;
+
+    // Only the vertices across the faces on the edge may neighbour both
+    // ends; any other would end up with a face or edge on it twice.
+    const std::vector<int> a = neighbours(from), b = neighbours(to);
+    std::vector<int> common;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                          std::back_inserter(common));
+    if (static_cast<int>(common.size()) > shared)
+        return false;
+
+    for (int f : around[from]) {
+        if (dead[f])
+            continue;
+
+        Face &face = triangles[f];
+        if (std::count(face.begin(), face.end(), to)) {
+            dead[f] = true;
+            --live;
+        } else {
+            std::replace(face.begin(), face.end(), from, to);
+            around[to].push_back(f);
+        }
+    }
+
+    quadrics[to] += quadrics[from];
+    removed[from] = true;
+    around[from].clear();
+    ++stamps[to];
+
+    auto &faces = around[to];
+    faces.erase(std::remove_if(faces.begin(), faces.end(),
+                               [this](int f) { return dead[f]; }),
+                faces.end());
+
+    for (int w : neighbours(to))
+        push_edge(to, w);
+
+    return true;
+}
+
+void EdgeCollapse::run(std::size_t target)
+{
+    while (live > target && !heap.empty()) {
+        const Collapse next = heap.top();
+        heap.pop();
+
+        if (removed[next.from] || removed[next.to] ||
+            stamps[next.from] != next.fromStamp ||
+            stamps[next.to] != next.toStamp)
+            continue;
+
+        if (!collapse(next.from, next.to) && !next.reversed)
+            push_edge(next.to, next.from, true);
+    }
+}
+
+std::vector<int> EdgeCollapse::faces() const
+{
+    std::vector<int> indices;
+
+    for (std::size_t f = 0; f < triangles.size(); ++f)
+        if (!dead[f])
+            for (int v : triangles[f])
+                indices.push_back(original[v]);
+
+    return indices;
+}
+
+std::vector<std::vector<int>>
+simplify_mesh(const std::vector<vec3f> &vertices,
+              const std::vector<int> &indices,
+              const std::vector<std::size_t> &targets)
+{
+    EdgeCollapse mesh(vertices, indices);
+    std::vector<std::vector<int>> levels;
+
+    for (auto target : targets) {
+        mesh.run(target);
+        levels.push_back(mesh.faces());
+    }
+
+    return levels;
+}
@@ -0,0 +1,23 @@
+#ifndef _SIMPLIFY_H_
+#define _SIMPLIFY_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "defs.h"
+
+// Quadric error edge collapse (Garland and Heckbert) of the triangle mesh
+// in indices, three 1-based indices into vertices per face. Every collapse
+// moves one end of an edge onto the other, so simplified faces only use
+// vertices of the original mesh and follow it when those move.
+//
+// Simplifies to each face count in targets in turn, largest first, and
+// returns the faces at each, as indices the same way. A level stops short
+// of its target when no edge is left that can collapse without folding a
+// face over or pinching the surface.
+std::vector<std::vector<int>>
+simplify_mesh(const std::vector<vec3f> &vertices,
+              const std::vector<int> &indices,
+              const std::vector<std::size_t> &targets);
+
+#endif
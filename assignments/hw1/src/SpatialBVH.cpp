@@ -0,0 +1,496 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "SpatialBVH.h"
+
+using giraffe::vec4f;
+
+// Relative costs of visiting a node and of testing a face.
+static constexpr float TRAVERSAL_COST = 1;
+static constexpr float INTERSECTION_COST = 1;
+
+// Nodes with at most this many references may become leaves, larger ones are
+// always split.
+static constexpr std::size_t MAX_LEAF_SIZE = 8;
+
+// Spatial splits are only tried where the children of the best partition
+// overlap by more than this fraction of the root's area.
+static constexpr float MIN_OVERLAP = 1e-5f;
+
+static constexpr int SPATIAL_BINS = 16;
+
+// Below this depth nodes split wherever the heuristic says, past it they
+// split at the median, so that the depth stays bounded.
+static constexpr int MAX_SAH_DEPTH = 64;
+static constexpr int MAX_DEPTH = MAX_SAH_DEPTH + 32;
+
+static float &coordinate(vec3f &v, int axis) { return (&v.x)[axis]; }
+
+static float coordinate(const vec3f &v, int axis) { return (&v.x)[axis]; }
+
+static bool is_empty(const Box &box)
+{
+    return box.min_point.x > box.max_point.x ||
+           box.min_point.y > box.max_point.y ||
+           box.min_point.z > box.max_point.z;
+}
+
+static float area(const Box &box)
+{
+    return is_empty(box) ? 0 : box.surfaceArea();
+}
+
+static Box overlap(const Box &a, const Box &b)
+{
+    return Box({std::max(a.min_point.x, b.min_point.x),
+                std::max(a.min_point.y, b.min_point.y),
+                std::max(a.min_point.z, b.min_point.z)},
+               {std::min(a.max_point.x, b.max_point.x),
+                std::min(a.max_point.y, b.max_point.y),
+                std::min(a.max_point.z, b.max_point.z)});
+}
+
+// Smallest box around both, either of which may be empty, unlike
+// Box(a, b).
+static Box merge(const Box &a, const Box &b)
+{
+    return Box({std::min(a.min_point.x, b.min_point.x),
+                std::min(a.min_point.y, b.min_point.y),
+                std::min(a.min_point.z, b.min_point.z)},
+               {std::max(a.max_point.x, b.max_point.x),
+                std::max(a.max_point.y, b.max_point.y),
+                std::max(a.max_point.z, b.max_point.z)});
+}
+
+static vec3f centroid(const Box &box)
+{
+    return (box.min_point + box.max_point) / 2;
+}
+
+struct SpatialBVH::Builder {
+    // Part of a face, bounded by box, that ends up in a leaf.
+    struct Reference {
+        Box box;
+        std::int32_t face;
+    };
+
+    // Best way found to split a node.
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = 0;
+        bool spatial = false;
+        std::size_t leftCount = 0; // Partition: references sorted to the left
+        float position = 0;        // Spatial: split plane
+        Box left, right;           // Partition: child boxes
+    };
+
+    SpatialBVH &bvh;
+    std::vector<vec3f> corners; // Three per face
+    float rootArea = 0;
+
+    Builder(SpatialBVH &bvh) : bvh(bvh) {}
+
+    // Splits the part of face inside ref.box at the plane position on axis.
+    void split_reference(const Reference &ref, int axis, float position,
+                         Reference &left, Reference &right) const
+    {
+        const vec3f *v = &corners[3 * ref.face];
+
+        left = right = {Box(), ref.face};
+
+        for (int i = 0; i < 3; ++i) {
+            const vec3f &v0 = v[i], &v1 = v[(i + 1) % 3];
+            const float p0 = coordinate(v0, axis), p1 = coordinate(v1, axis);
+
+            if (p0 <= position)
+                left.box.update(v0);
+            if (p0 >= position)
+                right.box.update(v0);
+
+            // Edge crossing the plane
+            if ((p0 < position && position < p1) ||
+                (p1 < position && position < p0)) {
+                vec3f t = v0 + (position - p0) / (p1 - p0) * (v1 - v0);
+                coordinate(t, axis) = position;
+                left.box.update(t);
+                right.box.update(t);
+            }
+        }
+
+        coordinate(left.box.max_point, axis) = position;
+        coordinate(right.box.min_point, axis) = position;
+        left.box = overlap(left.box, ref.box);
+        right.box = overlap(right.box, ref.box);
+    }
+
+    float sah(float area_left, std::size_t count_left, float area_right,
+              std::size_t count_right, float node_area) const
+    {
+        return TRAVERSAL_COST +
+               INTERSECTION_COST *
+                   (area_left * count_left + area_right * count_right) /
+                   node_area;
+    }
+
+    void sort_by_centroid(std::vector<Reference> &refs, int axis) const
+    {
+        std::sort(refs.begin(), refs.end(),
+                  [axis](const Reference &a, const Reference &b) {
+                      float ca = coordinate(centroid(a.box), axis),
+                            cb = coordinate(centroid(b.box), axis);
+                      return ca < cb || (ca == cb && a.face < b.face);
+                  });
+    }
+
+    // Best partition of refs along any axis, as a sweep over the references
+    // sorted by centroid.
+    void find_object_split(std::vector<Reference> &refs, float node_area,
+                           Split &best) const
+    {
+        const std::size_t n = refs.size();
+        std::vector<float> right_areas(n);
+
+        for (int axis = 0; axis < 3; ++axis) {
+            sort_by_centroid(refs, axis);
+
+            Box right;
+            for (std::size_t i = n - 1; i > 0; --i) {
+                right = merge(right, refs[i].box);
+                right_areas[i] = area(right);
+            }
+
+            Box left;
+            for (std::size_t i = 1; i < n; ++i) {
+                left = merge(left, refs[i - 1].box);
+                float cost = sah(area(left), i, right_areas[i], n - i,
+                                 node_area);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.spatial = false;
+                    best.leftCount = i;
+                }
+            }
+        }
+
+        // Child boxes of the winner
+        sort_by_centroid(refs, best.axis);
+        best.left = best.right = Box();
+        for (std::size_t i = 0; i < n; ++i) {
+            Box &side = i < best.leftCount ? best.left : best.right;
+            side = merge(side, refs[i].box);
+        }
+    }
+
+    // Best split plane among evenly spaced candidates on each axis, with the
+    // references clipped into the bins they pass through.
+    void find_spatial_split(const std::vector<Reference> &refs,
+                            const Box &bounds, float node_area,
+                            Split &best) const
+    {
+        for (int axis = 0; axis < 3; ++axis) {
+            const float lo = coordinate(bounds.min_point, axis),
+                        extent = coordinate(bounds.max_point, axis) - lo;
+            if (!(extent > 0))
+                continue;
+
+            const float bin_size = extent / SPATIAL_BINS;
+            auto bin_of = [&](float p) {
+                return std::clamp(int((p - lo) / bin_size), 0,
+                                  SPATIAL_BINS - 1);
+            };
+
+            Box boxes[SPATIAL_BINS];
+            std::size_t entries[SPATIAL_BINS] = {}, exits[SPATIAL_BINS] = {};
+
+            for (auto &ref : refs) {
+                const int first = bin_of(coordinate(ref.box.min_point, axis)),
+                          last = bin_of(coordinate(ref.box.max_point, axis));
+
+                Reference rest = ref;
+                for (int bin = first; bin < last; ++bin) {
+                    Reference left, right;
+                    split_reference(rest, axis, lo + (bin + 1) * bin_size,
+                                    left, right);
+                    boxes[bin] = merge(boxes[bin], left.box);
+                    rest = right;
+                }
+                boxes[last] = merge(boxes[last], rest.box);
+
+                ++entries[first];
+                ++exits[last];
+            }
+
+            float right_areas[SPATIAL_BINS];
+            std::size_t right_counts[SPATIAL_BINS];
+            Box right;
+            std::size_t right_count = 0;
+            for (int bin = SPATIAL_BINS - 1; bin > 0; --bin) {
+                right = merge(right, boxes[bin]);
+                right_count += exits[bin];
+                right_areas[bin] = area(right);
+                right_counts[bin] = right_count;
+            }
+
+            Box left;
+            std::size_t left_count = 0;
+            for (int bin = 1; bin < SPATIAL_BINS; ++bin) {
+                left = merge(left, boxes[bin - 1]);
+                left_count += entries[bin - 1];
+
+                if (!left_count || !right_counts[bin])
+                    continue;
+
+                float cost = sah(area(left), left_count, right_areas[bin],
+                                 right_counts[bin], node_area);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.spatial = true;
+                    best.position = lo + bin * bin_size;
+                }
+            }
+        }
+    }
+
+    // Distributes refs over the two sides of a spatial split. A straddling
+    // reference is only cut in two if that beats moving it whole into
+    // either child, and while budget lasts. Returns the references added.
+    std::size_t spatial_partition(std::vector<Reference> &refs,
+                                  const Split &split, std::size_t budget,
+                                  std::vector<Reference> &left,
+                                  std::vector<Reference> &right)
+    {
+        std::size_t added = 0;
+        const int axis = split.axis;
+        Box left_box, right_box;
+        std::vector<const Reference *> straddling;
+
+        for (auto &ref : refs) {
+            if (coordinate(ref.box.max_point, axis) <= split.position) {
+                left.push_back(ref);
+                left_box = merge(left_box, ref.box);
+            } else if (coordinate(ref.box.min_point, axis) >= split.position) {
+                right.push_back(ref);
+                right_box = merge(right_box, ref.box);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+
+        std::size_t left_count = left.size() + straddling.size(),
+                    right_count = right.size() + straddling.size();
+
+        for (auto ref : straddling) {
+            Reference left_part, right_part;
+            split_reference(*ref, axis, split.position, left_part,
+                            right_part);
+
+            const Box split_left(left_box, left_part.box),
+                split_right(right_box, right_part.box);
+            const Box whole_left(left_box, ref->box),
+                whole_right(right_box, ref->box);
+
+            const float cost_split = area(split_left) * left_count +
+                                     area(split_right) * right_count,
+                        cost_left = area(whole_left) * left_count +
+                                    area(right_box) * (right_count - 1),
+                        cost_right = area(left_box) * (left_count - 1) +
+                                     area(whole_right) * right_count;
+
+            const bool split_ok =
+                !is_empty(left_part.box) && !is_empty(right_part.box);
+
+            if (split_ok && added < budget && cost_split <= cost_left &&
+                cost_split <= cost_right) {
+                left.push_back(left_part);
+                right.push_back(right_part);
+                left_box = split_left;
+                right_box = split_right;
+                ++added;
+            } else if (cost_left <= cost_right) {
+                left.push_back(*ref);
+                left_box = whole_left;
+                --right_count;
+            } else {
+                right.push_back(*ref);
+                right_box = whole_right;
+                --left_count;
+            }
+        }
+
+        return added;
+    }
+
+    // Appends the subtree over refs depth first and returns its root.
+    // budget is the number of references spatial splits may add below it.
+    std::int32_t build(std::vector<Reference> &refs, int depth,
+                       std::size_t budget)
+    {
+        const std::int32_t idx = bvh.nodes.size();
+        bvh.nodes.emplace_back();
+
+        Box bounds;
+        for (auto &ref : refs)
+            bounds = merge(bounds, ref.box);
+
+        const float node_area = area(bounds);
+        const std::size_t n = refs.size();
+
+        Split best;
+        std::vector<Reference> left, right;
+
+        if (n > 1 && depth < MAX_SAH_DEPTH && node_area > 0) {
+            find_object_split(refs, node_area, best);
+
+            const float shared = area(overlap(best.left, best.right));
+            if (budget > 0 && shared > MIN_OVERLAP * rootArea)
+                find_spatial_split(refs, bounds, node_area, best);
+        }
+
+        const float leaf_cost = INTERSECTION_COST * n;
+
+        if (n <= 1 || (n <= MAX_LEAF_SIZE && leaf_cost <= best.cost)) {
+            Node &node = bvh.nodes[idx];
+            node.box = bounds;
+            node.index = bvh.references.size();
+            node.count = n;
+            node.axis = 0;
+            for (auto &ref : refs)
+                bvh.references.push_back(ref.face);
+            return idx;
+        }
+
+        if (best.spatial) {
+            budget -= spatial_partition(refs, best, budget, left, right);
+        } else {
+            std::size_t left_count = best.leftCount;
+            if (best.cost == std::numeric_limits<float>::infinity()) {
+                // Too deep, or flat: split at the median.
+                best.axis = depth % 3;
+                sort_by_centroid(refs, best.axis);
+                left_count = n / 2;
+            }
+            left.assign(refs.begin(), refs.begin() + left_count);
+            right.assign(refs.begin() + left_count, refs.end());
+        }
+
+        // Spatial partitions may still leave a side empty.
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+            sort_by_centroid(refs, best.axis);
+            left.assign(refs.begin(), refs.begin() + n / 2);
+            right.assign(refs.begin() + n / 2, refs.end());
+        }
+
+        std::vector<Reference>().swap(refs);
+
+        // What is left of the budget is shared out by size, so that the
+        // first subtrees built do not use it all up.
+        const std::size_t left_budget =
+            budget * left.size() / (left.size() + right.size());
+
+        build(left, depth + 1, left_budget);
+        const std::int32_t right_child =
+            build(right, depth + 1, budget - left_budget);
+
+        Node &node = bvh.nodes[idx];
+        node.box = bounds;
+        node.index = right_child;
+        node.count = 0;
+        node.axis = best.axis;
+        return idx;
+    }
+};
+
+SpatialBVH::SpatialBVH(const Triangle *faces, std::size_t count, float budget)
+    : Shape(-1, -1), faces(faces)
+{
+    Builder builder(*this);
+    std::vector<Builder::Reference> refs(count);
+
+    builder.corners.resize(3 * count);
+    for (std::size_t i = 0; i < count; ++i) {
+        vec3f *v = &builder.corners[3 * i];
+        faces[i].getVertices(v[0], v[1], v[2]);
+
+        refs[i].face = i;
+        for (int k = 0; k < 3; ++k)
+            refs[i].box.update(v[k]);
+    }
+
+    if (count == 0)
+        return;
+
+    Box root;
+    for (auto &ref : refs)
+        root = merge(root, ref.box);
+    builder.rootArea = area(root);
+
+    builder.build(refs, 0, std::size_t(count * budget));
+
+    nodes.shrink_to_fit();
+    references.shrink_to_fit();
+}
+
+// Entry distance of the ray into box, if it enters before far.
+static bool enters(const Box &box, vec4f origin, vec4f inv_direction,
+                   float far)
+{
+    ++traversal_work.nodeVisits;
+
+    vec4f t_0 = (vec4f(box.min_point) - origin) * inv_direction,
+          t_1 = (vec4f(box.max_point) - origin) * inv_direction;
+
+    float t_min = giraffe::hmax3(giraffe::min(t_0, t_1)),
+          t_max = giraffe::hmin3(giraffe::max(t_0, t_1));
+
+    return t_min <= t_max && t_max > 0 && t_min <= far;
+}
+
+// Children are visited nearest first, and subtrees that start beyond the
+// closest hit so far are skipped.
+Hit SpatialBVH::hit(const Ray &ray) const
+{
+    if (nodes.empty())
+        return MISS;
+
+    const vec4f origin(ray.origin), inv_direction(ray.invDirection);
+    const float direction[3] = {ray.direction.x, ray.direction.y,
+                                ray.direction.z};
+
+    Hit best = MISS;
+    std::int32_t stack[MAX_DEPTH + 2];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top) {
+        const std::int32_t idx = stack[--top];
+        const Node &node = nodes[idx];
+        const float far =
+            best.t > 0 ? best.t : std::numeric_limits<float>::max();
+
+        if (!enters(node.box, origin, inv_direction, far))
+            continue;
+
+        if (node.count) {
+            for (int i = 0; i < node.count; ++i) {
+                Hit hit = faces[references[node.index + i]].hit(ray);
+                if (hit.t > 0 && (best.t <= 0 || hit.t < best.t))
+                    best = hit;
+            }
+            continue;
+        }
+
+        std::int32_t near = idx + 1, far_child = node.index;
+        if (direction[node.axis] < 0)
+            std::swap(near, far_child);
+
+        stack[top++] = far_child;
+        stack[top++] = near;
+    }
+
+    return best;
+}
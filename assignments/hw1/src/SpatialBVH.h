@@ -0,0 +1,54 @@
+#ifndef _SPATIAL_BVH_H_
+#define _SPATIAL_BVH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Shape.h"
+
+// Mesh hierarchy built with the surface area heuristic and spatial splits
+// (SBVH). Besides partitioning the faces between its children, a node may cut
+// the faces that straddle a plane into two clipped references, one per side,
+// where that is cheaper. Long thin triangles then stop inflating every box
+// they pass through, at the cost of some faces sitting in several leaves.
+//
+// A memory budget caps the references spatial splits may add. It is shared
+// out between subtrees by size, and nodes whose share is spent only
+// partition.
+class SpatialBVH : public Shape
+{
+  public:
+    // Builds over faces[0, count). faces must outlive the hierarchy. budget
+    // is the number of extra references allowed, as a fraction of count.
+    SpatialBVH(const Triangle *faces, std::size_t count, float budget);
+    Hit hit(const Ray &ray) const;
+
+    // Memory taken by the nodes and the reference list.
+    std::size_t bytes() const
+    {
+        return nodes.size() * sizeof(Node) +
+               references.size() * sizeof(std::int32_t);
+    }
+
+    // Face references in the leaves, at least one per face.
+    std::size_t referenceCount() const { return references.size(); }
+
+  private:
+    struct Node {
+        Box box;
+        // Leaf: first entry in references. Inner node: right child, the left
+        // child being the next node.
+        std::int32_t index;
+        std::uint16_t count; // Faces in a leaf, 0 for an inner node
+        std::uint8_t axis;   // Inner node: split axis, for near-first order
+    };
+
+    struct Builder;
+
+    std::vector<Node> nodes;
+    std::vector<std::int32_t> references; // Faces of the leaves
+    const Triangle *faces;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include <algorithm>
+
+#include "Numa.h"
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int num_threads, const std::vector<int> &cpus)
+{
+    // std::thread::hardware_concurrency returns zero when the value is not
+    // well defined or computable, so we fall back to a single worker then.
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (unsigned int i = 0; i < num_threads; ++i)
+        workers.emplace_back(&ThreadPool::work, this, cpus);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::work(const std::vector<int> &cpus)
+{
+    if (!cpus.empty())
+        pin_current_thread(cpus);
+
+    for (;;) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+            if (stopping && tasks.empty())
+                return;
+
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+
+        task();
+    }
+}
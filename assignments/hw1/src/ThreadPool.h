@@ -0,0 +1,58 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run submitted tasks in FIFO order. The
+// workers stay alive between renders, so a long-running process does not pay
+// for thread creation on every frame.
+class ThreadPool
+{
+  public:
+    // Zero means one worker per hardware thread. If cpus is not empty, the
+    // workers only run on those CPUs.
+    explicit ThreadPool(unsigned int num_threads = 0,
+                        const std::vector<int> &cpus = {});
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    unsigned int size() const { return workers.size(); }
+
+    template <class F>
+    auto submit(F &&f) -> std::future<decltype(f())>
+    {
+        using R = decltype(f());
+
+        auto task =
+            std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto future = task->get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace([task] { (*task)(); });
+        }
+        cv.notify_one();
+
+        return future;
+    }
+
+  private:
+    void work(const std::vector<int> &cpus);
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Trace.h"
+
+struct TraceEvent {
+    const char *name;
+    std::int64_t start, end; // Nanoseconds since trace_start
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+// Spans of one thread. Only that thread writes to it, and once full it
+// overwrites its oldest span.
+struct TraceRing {
+    int tid;
+    std::uint64_t count = 0; // Spans ever recorded
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+static std::atomic<bool> tracing{false};
+static std::chrono::steady_clock::time_point epoch;
+static std::string trace_path;
+
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<TraceRing>> rings;
+static thread_local TraceRing *ring = nullptr;
+
+static std::int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch)
+        .count();
+}
+
+// The calling thread's ring, made on its first span.
+static TraceRing &own_ring()
+{
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.emplace_back(new TraceRing);
+        ring = rings.back().get();
+        ring->tid = static_cast<int>(rings.size()) - 1;
+    }
+
+    return *ring;
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(file, "\\%c", *str);
+        else if (static_cast<unsigned char>(*str) < 0x20)
+            fprintf(file, "\\u%04x", *str);
+        else
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+// Writes every ring to trace_path. Run at exit.
+static void write_trace()
+{
+    tracing = false;
+
+    FILE *file = fopen(trace_path.c_str(), "w");
+    if (!file) {
+        std::cerr << "cannot write trace " << trace_path << "\n";
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    for (auto &r : rings) {
+        // trace_start made the first ring, on its caller's thread.
+        fprintf(file,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":",
+                first ? "" : ",\n", r->tid);
+        if (r->tid == 0) {
+            write_string(file, "main");
+        } else {
+            char name[32];
+            snprintf(name, sizeof(name), "thread %d", r->tid);
+            write_string(file, name);
+        }
+        fprintf(file, "}}");
+        first = false;
+
+        const std::uint64_t kept =
+            std::min<std::uint64_t>(r->count, TRACE_RING_SIZE);
+        if (kept < r->count)
+            std::cerr << "trace: thread " << r->tid << " dropped its first "
+                      << r->count - kept << " spans\n";
+
+        for (std::uint64_t i = r->count - kept; i < r->count; ++i) {
+            const TraceEvent &event = r->events[i % TRACE_RING_SIZE];
+
+            fprintf(file, ",\n{\"name\":");
+            write_string(file, event.name);
+            fprintf(file,
+                    ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f",
+                    r->tid, event.start / 1e3,
+                    (event.end - event.start) / 1e3);
+            if (event.detail[0]) {
+                fprintf(file, ",\"args\":{\"detail\":");
+                write_string(file, event.detail);
+                fprintf(file, "}");
+            }
+            fprintf(file, "}");
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file))
+        std::cerr << "cannot write trace " << trace_path << "\n";
+}
+
+void trace_start(const std::string &path)
+{
+    if (tracing.exchange(true))
+        return;
+
+    trace_path = path;
+    epoch = std::chrono::steady_clock::now();
+    own_ring();
+
+    std::atexit(write_trace);
+}
+
+TraceSpan::TraceSpan(const char *name, const char *format, ...) : name(name)
+{
+    if (!tracing.load(std::memory_order_relaxed))
+        return;
+
+    detail[0] = '\0';
+    if (format) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(detail, sizeof(detail), format, args);
+        va_end(args);
+    }
+
+    start = now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (start < 0 || !tracing.load(std::memory_order_relaxed))
+        return;
+
+    TraceRing &r = own_ring();
+    TraceEvent &event = r.events[r.count++ % TRACE_RING_SIZE];
+
+    event.name = name;
+    event.start = start;
+    event.end = now();
+    memcpy(event.detail, detail, sizeof(detail));
+}
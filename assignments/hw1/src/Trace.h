@@ -0,0 +1,44 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Timeline of what each thread spends wall time on: parsing, hierarchy
+// builds, rendering tiles and writing images. Every thread records its spans
+// in a ring buffer of its own, without locks, and the rings are written out
+// as Chrome Trace Event JSON when the process exits, for chrome://tracing or
+// Perfetto to show idle gaps and stragglers.
+
+// Starts recording. The trace is written to path at exit, by which time no
+// other thread may be recording. Each thread keeps its last TRACE_RING_SIZE
+// spans.
+void trace_start(const std::string &path);
+
+constexpr std::size_t TRACE_RING_SIZE = 1 << 14;
+
+// Longest description a span keeps, with its terminating NUL.
+constexpr std::size_t TRACE_DETAIL_SIZE = 40;
+
+// Records the time from its construction to its destruction on the calling
+// thread, if tracing has started. Otherwise it costs a call and a branch.
+class TraceSpan
+{
+  public:
+    // format and the arguments after it, as for printf, describe this span
+    // in the trace, such as the tile or mesh it worked on.
+    explicit TraceSpan(const char *name, const char *format = nullptr, ...)
+        __attribute__((format(printf, 3, 4)));
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+  private:
+    const char *name;
+    std::int64_t start = -1; // Nanoseconds since trace_start; -1 if off
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+#endif
@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <future>
+
+#include "Camera.h"
+#include "ThreadPool.h"
+#include "VisibilityBuffer.h"
+
+// Rows per band. Each band is one task, and every primitive is tested
+// against the rows of each band it reaches.
+static constexpr int BAND_HEIGHT = 16;
+
+// Triangles are clipped to this far in front of the eye, in units of the
+// distance to the image plane, so that none of them cross behind it.
+static constexpr double NEAR_CLIP = 1e-6;
+
+// Pixel coordinates are image plane coordinates scaled so that pixel
+// (i, j) is centered on (i, j): x = u / du - 0.5 and y = v / dv - 0.5.
+struct View {
+    vec3f eye;
+    vec3f toCorner; // From the eye to the top left corner of the image
+    vec3f right, up;
+    double du, dv; // Image plane units per pixel
+    // Takes p - eye to (s, s u, s v), with p at s times the (unnormalized)
+    // direction through (u, v).
+    double inverse[3][3];
+    int width, height;
+};
+
+// A primitive as seen from the view.
+struct Projected {
+    int count; // Edges of the clipped triangle, 0 for a sphere
+    // Pixel (x, y) is inside edge k if edges[k][0] + edges[k][1] x +
+    // edges[k][2] y >= 0. These come from the plane through the eye and the
+    // edge, so that they stay exact however far off screen the corners are.
+    float edges[4][3];
+    // 1 / s over the plane of a triangle is i0 + ix x + iy y.
+    float i0, ix, iy;
+    int x0, x1, y0, y1; // Pixels that may be covered, inclusive
+};
+
+static View make_view(const Camera *camera)
+{
+    const ImagePlane &plane = camera->imgPlane;
+    View view;
+
+    view.eye = camera->getPosition();
+    view.toCorner = camera->getImageTopLeft() - view.eye;
+    view.right = camera->getRight();
+    view.up = camera->getUp();
+    view.du = double(plane.right - plane.left) / plane.nx;
+    view.dv = double(plane.top - plane.bottom) / plane.ny;
+    view.width = plane.nx;
+    view.height = plane.ny;
+
+    // Columns toCorner, right and -up
+    const double m[3][3] = {
+        {view.toCorner.x, view.right.x, -view.up.x},
+        {view.toCorner.y, view.right.y, -view.up.y},
+        {view.toCorner.z, view.right.z, -view.up.z},
+    };
+    const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                       m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                       m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            view.inverse[i][j] =
+                (m[(j + 1) % 3][(i + 1) % 3] * m[(j + 2) % 3][(i + 2) % 3] -
+                 m[(j + 1) % 3][(i + 2) % 3] * m[(j + 2) % 3][(i + 1) % 3]) /
+                det;
+
+    return view;
+}
+
+static void to_view(const View &view, const vec3f &p, double q[3])
+{
+    const double d[3] = {p.x - view.eye.x, p.y - view.eye.y,
+                         p.z - view.eye.z};
+
+    for (int i = 0; i < 3; ++i)
+        q[i] = view.inverse[i][0] * d[0] + view.inverse[i][1] * d[1] +
+               view.inverse[i][2] * d[2];
+}
+
+// Pixels whose centers lie within [minX, maxX] x [minY, maxY].
+static void set_bounds(const View &view, double minX, double maxX,
+                       double minY, double maxY, Projected &out)
+{
+    out.x0 = std::max(0.0, std::ceil(minX));
+    out.x1 = std::min(double(view.width - 1), std::floor(maxX));
+    out.y0 = std::max(0.0, std::ceil(minY));
+    out.y1 = std::min(double(view.height - 1), std::floor(maxY));
+}
+
+static void project_triangle(const View &view, const RasterPrimitive &p,
+                             Projected &out)
+{
+    double q[3][3];
+    to_view(view, p.a, q[0]);
+    to_view(view, p.b, q[1]);
+    to_view(view, p.c, q[2]);
+
+    // Clip away what is behind the eye
+    double polygon[4][3];
+    int n = 0;
+    for (int k = 0; k < 3; ++k) {
+        const double *cur = q[k], *next = q[(k + 1) % 3];
+        const bool cur_in = cur[0] >= NEAR_CLIP, next_in = next[0] >= NEAR_CLIP;
+
+        if (cur_in)
+            std::copy_n(cur, 3, polygon[n++]);
+        if (cur_in != next_in) {
+            const double t = (NEAR_CLIP - cur[0]) / (next[0] - cur[0]);
+            for (int i = 0; i < 3; ++i)
+                polygon[n][i] = cur[i] + t * (next[i] - cur[i]);
+            ++n;
+        }
+    }
+
+    if (n < 3)
+        return;
+
+    // Seen edge on
+    const vec3f normal = giraffe::cross(p.b - p.a, p.c - p.a);
+    const double k = normal * (p.a - view.eye);
+    if (k == 0)
+        return;
+
+    double x[4], y[4];
+    for (int i = 0; i < n; ++i) {
+        x[i] = polygon[i][1] / polygon[i][0] / view.du - 0.5;
+        y[i] = polygon[i][2] / polygon[i][0] / view.dv - 0.5;
+    }
+
+    // Edge i bounds the half space (q_i x q_i+1) . q >= 0, flipped so that
+    // the triangle is inside, with q = (1, du (x + 0.5), dv (y + 0.5)) the
+    // direction through pixel (x, y).
+    double cross[4][3];
+    for (int i = 0; i < n; ++i) {
+        const double *a = polygon[i], *b = polygon[(i + 1) % n];
+        cross[i][0] = a[1] * b[2] - a[2] * b[1];
+        cross[i][1] = a[2] * b[0] - a[0] * b[2];
+        cross[i][2] = a[0] * b[1] - a[1] * b[0];
+    }
+    const double *third = polygon[2];
+    const double orientation = cross[0][0] * third[0] +
+                               cross[0][1] * third[1] + cross[0][2] * third[2];
+    if (orientation == 0)
+        return;
+
+    out.count = n;
+    for (int i = 0; i < n; ++i) {
+        const double sign = orientation > 0 ? 1 : -1;
+        out.edges[i][0] = sign * (cross[i][0] + 0.5 * view.du * cross[i][1] +
+                                  0.5 * view.dv * cross[i][2]);
+        out.edges[i][1] = sign * view.du * cross[i][1];
+        out.edges[i][2] = sign * view.dv * cross[i][2];
+    }
+
+    out.i0 = (normal * view.toCorner + 0.5 * view.du * (normal * view.right) -
+              0.5 * view.dv * (normal * view.up)) /
+             k;
+    out.ix = view.du * (normal * view.right) / k;
+    out.iy = -view.dv * (normal * view.up) / k;
+
+    set_bounds(view, *std::min_element(x, x + n), *std::max_element(x, x + n),
+               *std::min_element(y, y + n), *std::max_element(y, y + n),
+               out);
+}
+
+// Bounds a sphere by the corners of the cube around it, or by the whole
+// image if some of those are behind the eye.
+static void project_sphere(const View &view, const RasterPrimitive &p,
+                           Projected &out)
+{
+    double minX = 0, maxX = view.width - 1;
+    double minY = 0, maxY = view.height - 1;
+    double xs[8], ys[8];
+    int behind = 0;
+
+    for (int corner = 0; corner < 8; ++corner) {
+        const vec3f offset = {corner & 1 ? p.radius : -p.radius,
+                              corner & 2 ? p.radius : -p.radius,
+                              corner & 4 ? p.radius : -p.radius};
+        double q[3];
+        to_view(view, p.a + offset, q);
+
+        if (q[0] < NEAR_CLIP) {
+            ++behind;
+            continue;
+        }
+        xs[corner] = q[1] / q[0] / view.du - 0.5;
+        ys[corner] = q[2] / q[0] / view.dv - 0.5;
+    }
+
+    if (behind == 8)
+        return;
+
+    if (!behind) {
+        minX = *std::min_element(xs, xs + 8);
+        maxX = *std::max_element(xs, xs + 8);
+        minY = *std::min_element(ys, ys + 8);
+        maxY = *std::max_element(ys, ys + 8);
+    }
+
+    out.count = 0;
+    set_bounds(view, minX, maxX, minY, maxY, out);
+}
+
+// Keeps primitive index in the pixels of rows [rowBegin, rowEnd) it covers
+// and is nearer in than what they have. Ties go to what was there first.
+static void rasterize(const View &view, const RasterPrimitive &primitive,
+                      const Projected &p, std::int32_t index, int rowBegin,
+                      int rowEnd, std::int32_t *nearest,
+                      float *inverseDepths)
+{
+    const int y_end = std::min(p.y1 + 1, rowEnd);
+
+    for (int y = std::max(p.y0, rowBegin); y < y_end; ++y) {
+        const std::size_t row = std::size_t(y) * view.width;
+
+        for (int x = p.x0; x <= p.x1; ++x) {
+            float inverse;
+
+            if (p.count) {
+                bool inside = true;
+                for (int k = 0; k < p.count && inside; ++k)
+                    inside = p.edges[k][0] + p.edges[k][1] * x +
+                                 p.edges[k][2] * y >=
+                             0;
+                if (!inside)
+                    continue;
+
+                inverse = p.i0 + p.ix * x + p.iy * y;
+            } else {
+                // Nearest positive s with eye + s d on the sphere
+                const vec3f d = view.toCorner +
+                                float((x + 0.5) * view.du) * view.right -
+                                float((y + 0.5) * view.dv) * view.up;
+                const vec3f from_center = view.eye - primitive.a;
+                const float a = d * d, b = d * from_center;
+                const float c = from_center * from_center -
+                                primitive.radius * primitive.radius;
+                const float discriminant = b * b - a * c;
+                if (discriminant < 0)
+                    continue;
+
+                const float root = std::sqrt(discriminant);
+                const float near = (-b - root) / a, far = (-b + root) / a;
+                const float s = near > 0 ? near : far;
+                if (s <= 0)
+                    continue;
+
+                inverse = 1 / s;
+            }
+
+            if (inverse > 0 && inverse > inverseDepths[row + x]) {
+                inverseDepths[row + x] = inverse;
+                nearest[row + x] = index;
+            }
+        }
+    }
+}
+
+// Every task refers to what the caller set up for it, so all of them must
+// be done before an error can leave.
+static void wait_all(std::vector<std::future<void>> &tasks)
+{
+    std::exception_ptr error;
+
+    for (auto &task : tasks) {
+        try {
+            task.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+VisibilityBuffer::VisibilityBuffer(const Camera *camera,
+                                   std::vector<RasterPrimitive> primitives,
+                                   ThreadPool &pool)
+    : width(camera->imgPlane.nx), height(camera->imgPlane.ny),
+      primitives(std::move(primitives)),
+      nearest(std::size_t(width) * height, -1)
+{
+    const View view = make_view(camera);
+    const std::size_t count = this->primitives.size();
+    const int bands = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+    const std::size_t chunks =
+        std::min<std::size_t>(std::max(count, std::size_t(1)),
+                              pool.size() * 4);
+
+    // Project the primitives in chunks, and list each under the bands it
+    // reaches, in order.
+    std::vector<Projected> projected(count);
+    std::vector<std::vector<std::vector<std::int32_t>>> bins(
+        chunks, std::vector<std::vector<std::int32_t>>(bands));
+    std::vector<std::future<void>> tasks;
+
+    for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+        tasks.push_back(pool.submit([&, chunk] {
+            const std::size_t begin = count * chunk / chunks;
+            const std::size_t end = count * (chunk + 1) / chunks;
+
+            for (std::size_t i = begin; i < end; ++i) {
+                Projected &p = projected[i];
+                p.x0 = p.y0 = 1;
+                p.x1 = p.y1 = 0;
+
+                if (this->primitives[i].radius > 0)
+                    project_sphere(view, this->primitives[i], p);
+                else
+                    project_triangle(view, this->primitives[i], p);
+
+                if (p.x0 > p.x1 || p.y0 > p.y1)
+                    continue;
+                for (int band = p.y0 / BAND_HEIGHT;
+                     band <= p.y1 / BAND_HEIGHT; ++band)
+                    bins[chunk][band].push_back(i);
+            }
+        }));
+    }
+    wait_all(tasks);
+    tasks.clear();
+
+    std::vector<float> inverseDepths(nearest.size(), 0);
+
+    for (int band = 0; band < bands; ++band) {
+        tasks.push_back(pool.submit([&, band] {
+            const int row_begin = band * BAND_HEIGHT;
+            const int row_end = std::min(row_begin + BAND_HEIGHT, height);
+
+            for (auto &bin : bins)
+                for (std::int32_t i : bin[band])
+                    rasterize(view, this->primitives[i], projected[i], i,
+                              row_begin, row_end, nearest.data(),
+                              inverseDepths.data());
+        }));
+    }
+    wait_all(tasks);
+}
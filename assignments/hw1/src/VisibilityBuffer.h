@@ -0,0 +1,42 @@
+#ifndef _VISIBILITY_BUFFER_H_
+#define _VISIBILITY_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Shape.h"
+
+class Camera;
+class ThreadPool;
+
+// Primitive seen at the center of each pixel of a camera's image, found by
+// rasterizing every sphere and triangle instead of tracing primary rays.
+// Only which primitive it is gets kept: its hit is worked out again from
+// the pixel's primary ray, so pixels get exactly the hit tracing gives them
+// wherever both see the same primitive. They may disagree on pixels right
+// on the edge between primitives, or where two are at the same depth.
+class VisibilityBuffer
+{
+  public:
+    // Rasterizes primitives as camera sees them, on pool, in bands of rows
+    // that each test only the primitives reaching them.
+    VisibilityBuffer(const Camera *camera,
+                     std::vector<RasterPrimitive> primitives,
+                     ThreadPool &pool);
+
+    // The sphere or triangle nearest at the center of pixel (x, y), or
+    // nullptr if there is none.
+    const Shape *at(int x, int y) const
+    {
+        const std::int32_t i = nearest[std::size_t(y) * width + x];
+        return i < 0 ? nullptr : primitives[i].shape;
+    }
+
+  private:
+    int width, height;
+    std::vector<RasterPrimitive> primitives;
+    std::vector<std::int32_t> nearest; // Index in primitives, or -1
+};
+
+#endif
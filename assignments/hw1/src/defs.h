@@ -1,11 +1,13 @@
 #ifndef _DEFS_H_
 #define _DEFS_H_
 
+#include <cstdint>
+
 #include "Geometry.h"
 
 using giraffe::vec3f;
 
-class Scene;
+class Shape;
 
 struct HitRecord {
     float t;
@@ -18,6 +20,22 @@ struct HitRecord {
 
 constexpr HitRecord NO_HIT = {-1, {0, 0, 0}, {0, 0, 0}, -1};
 
-extern Scene *pScene;
+// What traversal keeps of a candidate hit: just enough for its shape to work
+// out the full HitRecord later, once it is known to be the closest.
+struct Hit {
+    float t;
+    float beta, gamma;  // Barycentric coordinates of triangle hits
+    std::int32_t index; // Triangle record of a paged mesh, lod_index() of
+                        // the level of a mesh with levels of detail, -1
+                        // otherwise
+    const Shape *shape; // Sphere or Triangle that was hit, or the paged mesh
+};
+
+// Hit::index of a hit on level of a mesh with levels of detail, -1 being
+// the full mesh, and back. Other rays may see the mesh at another level.
+constexpr std::int32_t lod_index(int level) { return -3 - level; }
+constexpr int lod_level(std::int32_t index) { return -3 - index; }
+
+constexpr Hit MISS = {-1, 0, 0, -1, nullptr};
 
 #endif
@@ -1,15 +1,342 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Distributed.h"
+#include "Image.h"
+#include "Numa.h"
+#include "PerfCounters.h"
 #include "Scene.h"
+#include "Server.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 #include "defs.h"
 
-Scene *pScene; // definition of the global scene variable (declared in defs.h)
+// Renders several scenes side by side, each camera as one single-threaded
+// job on a shared pool, which suits many small scenes better than splitting
+// each frame over every thread in turn.
+static void render_scenes(const std::vector<const char *> &paths,
+                          const SceneOptions &options, unsigned int threads,
+                          bool printStats)
+{
+    std::vector<std::unique_ptr<Scene>> scenes;
+    for (auto path : paths)
+        scenes.emplace_back(new Scene(path, options));
+
+    ThreadPool pool(threads);
+    std::vector<std::pair<const Scene *, const Camera *>> jobs;
+    std::vector<std::future<RenderStats>> results;
+
+    for (auto &scene : scenes) {
+        for (auto camera : scene->cameras) {
+            const Scene *s = scene.get();
+            jobs.emplace_back(s, camera);
+            results.push_back(pool.submit([s, camera] {
+                const int width = camera->imgPlane.nx,
+                          height = camera->imgPlane.ny;
+                std::vector<Color> pixels(width * height);
+
+                RenderStats stats =
+                    s->render(camera, {0, 0, width, height},
+                              reinterpret_cast<unsigned char *>(pixels.data()));
+                Image(pixels.data(), width, height)
+                    .saveImage(camera->imageName.c_str());
+
+                return stats;
+            }));
+        }
+    }
+
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        RenderStats stats = results[i].get();
+        if (printStats)
+            jobs[i].first->reportStats(jobs[i].second, stats);
+    }
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [options] [--stats] [--perf] [--threads N] scene.xml...\n"
+              << "       " << argv0
+              << " [--stats] [--cache-size N] --serve | --socket PATH\n"
+              << "       " << argv0
+              << " [--threads N] --worker [HOST:]PORT\n"
+              << "       " << argv0
+              << " --coordinator [--spawn N] [--connect HOST:PORT]...\n"
+              << "           [--threads N] [--tile-size N] scene.xml\n"
+              << "       " << argv0
+              << " [--stats] --sequence [--rebuild-ratio R] scene.xml"
+              << " frame.xml...\n"
+              << "       " << argv0
+              << " [--stats] --numa | --numa-replicate [--threads N]"
+              << " scene.xml\n"
+              << "options: --out-of-core DIR [--page-cache-mb N]\n"
+              << "         --bvh-bits 0|8|16\n"
+              << "         --bvh-layout pointer|dfs|veb|treelet [--lazy-bvh]\n"
+              << "         --sbvh all|ID[,ID]... [--sbvh-budget F]\n"
+              << "         --accel auto|bvh|grid|kdtree\n"
+              << "         --path-cutoff F [--russian-roulette]\n"
+              << "         --packets\n"
+              << "         --gbuffer\n"
+              << "         --raster\n"
+              << "         --heatmap nodes|tests|rays\n"
+              << "         --trace FILE\n"
+              << "         --lod N [--lod-tolerance F]\n"
+              << "         --shadow-maps N [--shadow-map-kernel K]\n"
+              << "         --checkpoint [--checkpoint-interval S] | --resume\n";
+}
 
 int main(int argc, char *argv[])
 {
-    const char *xmlPath = argv[1];
+    const char *xmlPath = nullptr;
+    const char *socketPath = nullptr;
+    bool printStats = false;
+    bool serve = false;
+    std::size_t cacheSize = 4;
+    const char *workerEndpoint = nullptr;
+    bool coordinator = false;
+    unsigned int spawn = 0;
+    unsigned int threads = 0;
+    int tileSize = 64;
+    std::vector<std::string> connect;
+    SceneOptions options;
+    bool sequence = false;
+    std::vector<const char *> morePaths; // Frames, or more scenes
+    float rebuildRatio = 1.5;
+    bool numa = false;
+    bool replicate = false;
+    bool perf = false;
+    const char *tracePath = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--stats")) {
+            printStats = true;
+        } else if (!strcmp(argv[i], "--serve")) {
+            serve = true;
+        } else if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            cacheSize = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--worker") && i + 1 < argc) {
+            workerEndpoint = argv[++i];
+        } else if (!strcmp(argv[i], "--coordinator")) {
+            coordinator = true;
+        } else if (!strcmp(argv[i], "--spawn") && i + 1 < argc) {
+            spawn = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+            connect.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc) {
+            tileSize = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--out-of-core") && i + 1 < argc) {
+            options.outOfCoreDir = argv[++i];
+        } else if (!strcmp(argv[i], "--page-cache-mb") && i + 1 < argc) {
+            options.pageCacheBytes = strtoull(argv[++i], nullptr, 10) << 20;
+        } else if (!strcmp(argv[i], "--bvh-bits") && i + 1 < argc) {
+            options.bvhBits = atoi(argv[++i]);
+            if (options.bvhBits != 0 && options.bvhBits != 8 &&
+                options.bvhBits != 16) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--bvh-layout") && i + 1 < argc) {
+            const char *layout = argv[++i];
+            if (!strcmp(layout, "pointer")) {
+                options.bvhLayout = NodeLayout::Pointer;
+            } else if (!strcmp(layout, "dfs")) {
+                options.bvhLayout = NodeLayout::DepthFirst;
+            } else if (!strcmp(layout, "veb")) {
+                options.bvhLayout = NodeLayout::VanEmdeBoas;
+            } else if (!strcmp(layout, "treelet")) {
+                options.bvhLayout = NodeLayout::Treelet;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--lazy-bvh")) {
+            options.lazyBVH = true;
+        } else if (!strcmp(argv[i], "--perf")) {
+            perf = true;
+        } else if (!strcmp(argv[i], "--sbvh") && i + 1 < argc) {
+            std::istringstream ids(argv[++i]);
+            std::string id;
+            while (std::getline(ids, id, ','))
+                if (id == "all")
+                    options.spatialSplitAll = true;
+                else
+                    options.spatialSplitMeshes.push_back(atoi(id.c_str()));
+        } else if (!strcmp(argv[i], "--sbvh-budget") && i + 1 < argc) {
+            options.splitBudget = std::max(atof(argv[++i]), 0.0);
+        } else if (!strcmp(argv[i], "--accel") && i + 1 < argc) {
+            const char *accel = argv[++i];
+            if (!strcmp(accel, "auto")) {
+                options.meshAccelerator = MeshAccelerator::Auto;
+            } else if (!strcmp(accel, "bvh")) {
+                options.meshAccelerator = MeshAccelerator::BVH;
+            } else if (!strcmp(accel, "grid")) {
+                options.meshAccelerator = MeshAccelerator::Grid;
+            } else if (!strcmp(accel, "kdtree")) {
+                options.meshAccelerator = MeshAccelerator::KdTree;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--path-cutoff") && i + 1 < argc) {
+            options.pathCutoff = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--russian-roulette")) {
+            options.russianRoulette = true;
+        } else if (!strcmp(argv[i], "--packets")) {
+            options.packets = true;
+        } else if (!strcmp(argv[i], "--gbuffer")) {
+            options.gBuffers = true;
+        } else if (!strcmp(argv[i], "--heatmap") && i + 1 < argc) {
+            const char *metric = argv[++i];
+            if (!strcmp(metric, "nodes")) {
+                options.heatmap = HeatMetric::NodeVisits;
+            } else if (!strcmp(metric, "tests")) {
+                options.heatmap = HeatMetric::PrimitiveTests;
+            } else if (!strcmp(metric, "rays")) {
+                options.heatmap = HeatMetric::Rays;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--raster")) {
+            options.rasterPrimary = true;
+        } else if (!strcmp(argv[i], "--checkpoint")) {
+            options.checkpoints = true;
+        } else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc) {
+            options.checkpointInterval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--resume")) {
+            options.checkpoints = options.resume = true;
+        } else if (!strcmp(argv[i], "--lod") && i + 1 < argc) {
+            options.lodLevels = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--lod-tolerance") && i + 1 < argc) {
+            options.lodTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--shadow-maps") && i + 1 < argc) {
+            options.shadowMapSize = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--shadow-map-kernel") && i + 1 < argc) {
+            options.shadowMapKernel = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (!strcmp(argv[i], "--numa")) {
+            numa = true;
+        } else if (!strcmp(argv[i], "--numa-replicate")) {
+            numa = replicate = true;
+        } else if (!strcmp(argv[i], "--sequence")) {
+            sequence = true;
+        } else if (!strcmp(argv[i], "--rebuild-ratio") && i + 1 < argc) {
+            rebuildRatio = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else if (xmlPath) {
+            morePaths.push_back(argv[i]);
+        } else {
+            xmlPath = argv[i];
+        }
+    }
+
+    if (tracePath)
+        trace_start(tracePath);
+
+    try {
+        if (serve || socketPath) {
+            RenderServer server(cacheSize, printStats, options);
+
+            if (socketPath)
+                server.listen(socketPath);
+            else
+                server.serve(stdin, stdout);
+
+            return 0;
+        }
+
+        if (workerEndpoint) {
+            listen_tiles(workerEndpoint, threads, options);
+            return 0;
+        }
+
+        if (!xmlPath || (!morePaths.empty() && (coordinator || numa))) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (coordinator) {
+            if (spawn == 0 && connect.empty()) {
+                usage(argv[0]);
+                return 1;
+            }
+
+            // Local workers split the cores between them unless told
+            // otherwise.
+            if (threads == 0 && spawn > 0)
+                threads = std::max(std::thread::hardware_concurrency() / spawn,
+                                   1u);
+
+            TileCoordinator tiles(tileSize, 3.0, options);
+
+            for (unsigned int i = 0; i < spawn; ++i)
+                tiles.spawnWorker(threads);
+            for (auto &endpoint : connect)
+                tiles.connectWorker(endpoint);
+
+            tiles.render(xmlPath);
+            tiles.printReport(std::cerr);
+
+            return 0;
+        }
+
+        if (numa) {
+            NumaRenderer renderer(xmlPath, options, threads, replicate);
+
+            renderer.render(printStats);
+            renderer.printReport(std::cerr);
+
+            return 0;
+        }
+
+        if (!sequence && !morePaths.empty()) {
+            morePaths.insert(morePaths.begin(), xmlPath);
+            render_scenes(morePaths, options, threads, printStats);
+            return 0;
+        }
+
+        Scene scene(xmlPath, options);
+        scene.printStats = printStats;
+
+        // Opened before the render threads exist, so that they inherit the
+        // counters.
+        std::unique_ptr<PerfCounters> counters;
+        if (perf) {
+            counters.reset(new PerfCounters);
+            counters->start();
+        }
 
-    pScene = new Scene(xmlPath);
+        if (sequence)
+            scene.renderSequence(morePaths, rebuildRatio);
+        else
+            scene.renderScene();
 
-    pScene->renderScene();
+        if (counters) {
+            counters->stop();
+            counters->print(std::cerr);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << "\n";
+        return 1;
+    }
 
     return 0;
 }
@@ -2,7 +2,15 @@
 
 # Example usage:
 #    nodemon -x "./watcher.sh past_examples/dragon_lowres.xml dragon_lowres.ppm dragon_lowres.png" past_examples/dragon_lowres.xml
+#
+# With RAYTRACER_SOCKET set to the socket of a "./raytracer --socket PATH"
+# started in this directory, renders through it instead, so that edits which
+# leave the geometry and materials alone do not rebuild the scene.
 
-time ./raytracer "$1"
+if [ -S "$RAYTRACER_SOCKET" ]; then
+    time printf '%s\nquit\n' "$(realpath "$1")" | nc -U "$RAYTRACER_SOCKET"
+else
+    time ./raytracer "$1"
+fi
 pnmtopng "$2" > "$3"
 open "$3"
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include "SceneGenerator.h"
+
+// Objects are scattered through [-EXTENT, EXTENT] on every axis.
+static constexpr double EXTENT = 8;
+static constexpr double FLOOR_Y = -EXTENT - 1;
+static constexpr double TOTAL_INTENSITY = 200000;
+
+struct Point {
+    double x, y, z;
+};
+
+struct Face {
+    int a, b, c; // 1-based, as the XML wants them
+};
+
+struct Surface {
+    int material;
+    std::vector<Face> faces;
+};
+
+struct Ball {
+    int center; // Vertex
+    double radius;
+    int material;
+};
+
+// Scene being generated, in the order the XML lists it.
+struct Generated {
+    std::vector<Point> vertices;
+    std::vector<Surface> meshes;
+    std::vector<Ball> spheres;
+
+    // Index of p as the XML refers to it.
+    int add(const Point &p)
+    {
+        vertices.push_back(p);
+        return vertices.size();
+    }
+};
+
+// Uniform in [lo, hi), the same on every standard library.
+static double uniform(std::mt19937 &rng, double lo, double hi)
+{
+    return lo + (hi - lo) * (rng() / 4294967296.0);
+}
+
+static Point random_point(std::mt19937 &rng, double extent)
+{
+    const double x = uniform(rng, -extent, extent);
+    const double y = uniform(rng, -extent, extent);
+    const double z = uniform(rng, -extent, extent);
+
+    return {x, y, z};
+}
+
+// Materials 2 to 4; 1 is the floor's.
+static int random_material(std::mt19937 &rng)
+{
+    return 2 + static_cast<int>(uniform(rng, 0, 3));
+}
+
+// Stacks of a tessellated sphere with about faces faces. A sphere of n stacks
+// and 2n slices has 4n(n - 1) faces.
+static int stacks_for(int faces)
+{
+    return std::max(2, static_cast<int>(std::lround(
+                           0.5 + std::sqrt(0.25 + faces / 4.0))));
+}
+
+int SceneParams::facesPerMesh() const
+{
+    const int n = stacks_for(meshFaces);
+    return 4 * n * (n - 1);
+}
+
+long SceneParams::triangles() const
+{
+    return 2 + soupTriangles + long(meshes) * facesPerMesh();
+}
+
+// Adds a sphere of radius r around center, wound counterclockwise seen from
+// outside.
+static std::vector<Face> tessellate(Generated &scene, const Point &center,
+                                    double r, int stacks)
+{
+    const int slices = 2 * stacks;
+    std::vector<Face> faces;
+
+    const int north = scene.add({center.x, center.y + r, center.z});
+    const int first = north + 1; // First vertex of the first ring
+
+    for (int i = 1; i < stacks; ++i) {
+        const double theta = M_PI * i / stacks;
+        for (int j = 0; j < slices; ++j) {
+            const double phi = 2 * M_PI * j / slices;
+            scene.add({center.x + r * std::sin(theta) * std::cos(phi),
+                       center.y + r * std::cos(theta),
+                       center.z + r * std::sin(theta) * std::sin(phi)});
+        }
+    }
+
+    const int south = scene.add({center.x, center.y - r, center.z});
+
+    auto ring = [&](int i, int j) { return first + i * slices + j % slices; };
+
+    for (int j = 0; j < slices; ++j) {
+        faces.push_back({north, ring(0, j + 1), ring(0, j)});
+        faces.push_back(
+            {south, ring(stacks - 2, j), ring(stacks - 2, j + 1)});
+    }
+
+    for (int i = 0; i + 1 < stacks - 1; ++i) {
+        for (int j = 0; j < slices; ++j) {
+            faces.push_back({ring(i, j), ring(i, j + 1), ring(i + 1, j)});
+            faces.push_back(
+                {ring(i, j + 1), ring(i + 1, j + 1), ring(i + 1, j)});
+        }
+    }
+
+    return faces;
+}
+
+static void write_material(std::ostream &out, int id, const char *diffuse,
+                           const char *specular, int phongExp,
+                           const char *mirror)
+{
+    out << "        <Material id=\"" << id << "\">\n"
+        << "            <AmbientReflectance>1 1 1</AmbientReflectance>\n"
+        << "            <DiffuseReflectance>" << diffuse
+        << "</DiffuseReflectance>\n"
+        << "            <SpecularReflectance>" << specular
+        << "</SpecularReflectance>\n"
+        << "            <MirrorReflectance>" << mirror
+        << "</MirrorReflectance>\n"
+        << "            <PhongExponent>" << phongExp << "</PhongExponent>\n"
+        << "        </Material>\n";
+}
+
+void write_scene(std::ostream &out, const SceneParams &params)
+{
+    std::mt19937 rng(params.seed);
+    Generated scene;
+
+    // Floor, facing up
+    const int corner = scene.add({-5 * EXTENT, FLOOR_Y, 5 * EXTENT});
+    scene.add({5 * EXTENT, FLOOR_Y, 5 * EXTENT});
+    scene.add({5 * EXTENT, FLOOR_Y, -5 * EXTENT});
+    scene.add({-5 * EXTENT, FLOOR_Y, -5 * EXTENT});
+    scene.meshes.push_back(
+        {1,
+         {{corner, corner + 1, corner + 2}, {corner, corner + 2, corner + 3}}});
+
+    // Sizes shrink with counts, so that more objects stay as many separate
+    // objects rather than filling the cube.
+    const double sphereSize =
+        EXTENT / std::cbrt(std::max(params.spheres, 1));
+    for (int i = 0; i < params.spheres; ++i) {
+        const Point center = random_point(rng, EXTENT);
+        const double r = sphereSize * uniform(rng, 0.1, 0.3);
+        scene.spheres.push_back(
+            {scene.add(center), r, random_material(rng)});
+    }
+
+    if (params.soupTriangles > 0) {
+        const double size =
+            EXTENT / std::cbrt(params.soupTriangles) * 0.5;
+        std::vector<Face> faces;
+
+        for (int i = 0; i < params.soupTriangles; ++i) {
+            const Point center = random_point(rng, EXTENT);
+            int corners[3];
+            for (int c = 0; c < 3; ++c) {
+                const Point offset = random_point(rng, size);
+                corners[c] = scene.add({center.x + offset.x,
+                                        center.y + offset.y,
+                                        center.z + offset.z});
+            }
+            faces.push_back({corners[0], corners[1], corners[2]});
+        }
+
+        scene.meshes.push_back({random_material(rng), faces});
+    }
+
+    const double meshSize = EXTENT / std::cbrt(std::max(params.meshes, 1));
+    for (int i = 0; i < params.meshes; ++i) {
+        const Point center = random_point(rng, EXTENT);
+        const double r = meshSize * uniform(rng, 0.2, 0.4);
+        const int material = random_material(rng);
+        scene.meshes.push_back(
+            {material,
+             tessellate(scene, center, r, stacks_for(params.meshFaces))});
+    }
+
+    const double aspect = double(params.width) / params.height;
+
+    out << std::fixed << std::setprecision(4);
+    out << "<Scene>\n"
+        << "    <BackgroundColor>0 0 0</BackgroundColor>\n\n"
+        << "    <ShadowRayEpsilon>1e-3</ShadowRayEpsilon>\n\n"
+        << "    <IntersectionTestEpsilon>1e-6</IntersectionTestEpsilon>\n\n"
+        << "    <MaxRecursionDepth>" << params.depth
+        << "</MaxRecursionDepth>\n\n";
+
+    out << "    <Cameras>\n"
+        << "        <Camera id=\"1\">\n"
+        << "            <Position>0 0 " << 3 * EXTENT << "</Position>\n"
+        << "            <Gaze>0 0 -1</Gaze>\n"
+        << "            <Up>0 1 0</Up>\n"
+        << "            <NearPlane>" << -aspect << " " << aspect
+        << " -1 1</NearPlane>\n"
+        << "            <NearDistance>2</NearDistance>\n"
+        << "            <ImageResolution>" << params.width << " "
+        << params.height << "</ImageResolution>\n"
+        << "            <ImageName>" << params.imageName << "</ImageName>\n"
+        << "        </Camera>\n"
+        << "    </Cameras>\n\n";
+
+    // On a ring above the cube
+    out << "    <Lights>\n"
+        << "        <AmbientLight>20 20 20</AmbientLight>\n";
+    for (int i = 0; i < params.lights; ++i) {
+        const double angle = 2 * M_PI * i / params.lights + 0.3;
+        const double intensity = TOTAL_INTENSITY / params.lights;
+        out << "        <PointLight id=\"" << i + 1 << "\">\n"
+            << "            <Position>" << 1.75 * EXTENT * std::cos(angle)
+            << " " << 2.25 * EXTENT << " "
+            << 1.75 * EXTENT * std::sin(angle) << "</Position>\n"
+            << "            <Intensity>" << intensity << " " << intensity
+            << " " << intensity << "</Intensity>\n"
+            << "        </PointLight>\n";
+    }
+    out << "    </Lights>\n\n";
+
+    out << "    <Materials>\n";
+    write_material(out, 1, "0.4 0.4 0.4", "0.2 0.2 0.2", 10, "0.4 0.4 0.4");
+    write_material(out, 2, "0.8 0.3 0.2", "0.1 0.1 0.1", 1, "0 0 0");
+    write_material(out, 3, "0.2 0.5 0.8", "0.8 0.8 0.8", 64, "0 0 0");
+    write_material(out, 4, "0.1 0.1 0.1", "0.9 0.9 0.9", 200, "0.7 0.7 0.7");
+    out << "    </Materials>\n\n";
+
+    out << "    <VertexData>\n";
+    for (auto &v : scene.vertices)
+        out << "        " << v.x << " " << v.y << " " << v.z << "\n";
+    out << "    </VertexData>\n\n";
+
+    out << "    <Objects>\n";
+    for (std::size_t i = 0; i < scene.meshes.size(); ++i) {
+        out << "        <Mesh id=\"" << i + 1 << "\">\n"
+            << "            <Material>" << scene.meshes[i].material
+            << "</Material>\n"
+            << "            <Faces>\n";
+        for (auto &f : scene.meshes[i].faces)
+            out << "                " << f.a << " " << f.b << " " << f.c
+                << "\n";
+        out << "            </Faces>\n"
+            << "        </Mesh>\n";
+    }
+    for (std::size_t i = 0; i < scene.spheres.size(); ++i)
+        out << "        <Sphere id=\"" << i + 1 << "\">\n"
+            << "            <Material>" << scene.spheres[i].material
+            << "</Material>\n"
+            << "            <Center>" << scene.spheres[i].center
+            << "</Center>\n"
+            << "            <Radius>" << scene.spheres[i].radius
+            << "</Radius>\n"
+            << "        </Sphere>\n";
+    out << "    </Objects>\n"
+        << "</Scene>\n";
+}
@@ -0,0 +1,30 @@
+#ifndef _SCENE_GENERATOR_H_
+#define _SCENE_GENERATOR_H_
+
+#include <ostream>
+#include <string>
+
+// Sizes of a generated scene. Everything is scattered at random, from seed,
+// through a cube in front of a single camera, above a mirroring floor.
+struct SceneParams {
+    int spheres = 16;
+    int soupTriangles = 1000; // Unconnected triangles, as one mesh
+    int meshes = 4;           // Tessellated spheres
+    int meshFaces = 2000;     // Faces of each mesh, roughly
+    int lights = 2;           // Sharing the same total intensity
+    int depth = 1;            // MaxRecursionDepth
+    int width = 256, height = 256;
+    unsigned int seed = 1;
+    std::string imageName = "generated.ppm";
+
+    // Faces of each mesh once tessellated.
+    int facesPerMesh() const;
+    // Triangles in the whole scene, floor included.
+    long triangles() const;
+};
+
+// Writes the scene XML params describe to out. The same params always give
+// the same scene.
+void write_scene(std::ostream &out, const SceneParams &params);
+
+#endif
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Camera.h"
+#include "Image.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+
+#include "SceneGenerator.h"
+
+// Scaling benchmark: varies one size of a generated scene at a time, away
+// from the SceneParams defaults, renders each scene with every thread count
+// and writes a CSV row per render, ready to plot as scaling curves.
+
+struct Sweep {
+    std::string parameter;
+    std::vector<int> values;
+};
+
+static const std::vector<Sweep> DEFAULT_SWEEPS = {
+    {"spheres", {1, 4, 16, 64, 256}},
+    {"soup", {1000, 10000, 100000}},
+    {"meshes", {1, 4, 16, 64}},
+    {"mesh-faces", {500, 2000, 8000, 32000}},
+    {"lights", {1, 2, 4, 8}},
+    {"depth", {0, 1, 2, 4}},
+    {"size", {64, 128, 256, 512}},
+};
+
+// Sets parameter of params to value. size sets both sides of the image.
+static bool set_parameter(SceneParams &params, const std::string &parameter,
+                          int value)
+{
+    if (parameter == "spheres")
+        params.spheres = value;
+    else if (parameter == "soup")
+        params.soupTriangles = value;
+    else if (parameter == "meshes")
+        params.meshes = value;
+    else if (parameter == "mesh-faces")
+        params.meshFaces = value;
+    else if (parameter == "lights")
+        params.lights = value;
+    else if (parameter == "depth")
+        params.depth = value;
+    else if (parameter == "size")
+        params.width = params.height = value;
+    else
+        return false;
+
+    return true;
+}
+
+static std::vector<int> parse_list(const char *str)
+{
+    std::vector<int> values;
+    std::istringstream items(str);
+    std::string item;
+
+    while (std::getline(items, item, ','))
+        values.push_back(atoi(item.c_str()));
+
+    return values;
+}
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [--sweep PARAMETER=N[,N]...]... [--threads N[,N]...]\n"
+              << "           [--repeat N] [--out FILE]\n"
+              << "parameters: spheres soup meshes mesh-faces lights depth"
+              << " size\n";
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<Sweep> sweeps;
+    std::vector<int> threadCounts;
+    int repeat = 1;
+    const char *outPath = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--sweep") && i + 1 < argc) {
+            const char *sweep = argv[++i];
+            const char *equals = strchr(sweep, '=');
+            SceneParams check;
+            if (!equals ||
+                !set_parameter(check, std::string(sweep, equals), 0)) {
+                usage(argv[0]);
+                return 1;
+            }
+            sweeps.push_back({std::string(sweep, equals),
+                              parse_list(equals + 1)});
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threadCounts = parse_list(argv[++i]);
+        } else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            repeat = std::max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            outPath = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (sweeps.empty())
+        sweeps = DEFAULT_SWEEPS;
+
+    // One thread, then every hardware thread.
+    if (threadCounts.empty()) {
+        threadCounts.push_back(1);
+        if (std::thread::hardware_concurrency() > 1)
+            threadCounts.push_back(std::thread::hardware_concurrency());
+    }
+
+    std::ofstream file;
+    if (outPath)
+        file.open(outPath);
+    std::ostream &out = outPath ? file : std::cout;
+
+    char scenePath[] = "/tmp/scalingXXXXXX";
+    const int fd = mkstemp(scenePath);
+    if (fd < 0) {
+        std::cerr << argv[0] << ": cannot create a temporary scene\n";
+        return 1;
+    }
+    close(fd);
+
+    out << "parameter,value,threads,triangles,spheres,lights,depth,pixels,"
+           "load_ms,render_ms,rays,mrays_per_s\n";
+
+    try {
+        for (auto &sweep : sweeps) {
+            for (int value : sweep.values) {
+                SceneParams params;
+                set_parameter(params, sweep.parameter, value);
+
+                {
+                    std::ofstream xml(scenePath);
+                    write_scene(xml, params);
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                Scene scene(scenePath);
+                const double loadTime = milliseconds_since(start);
+
+                const Camera *camera = scene.cameras[0];
+                const int width = camera->imgPlane.nx;
+                const int height = camera->imgPlane.ny;
+                std::vector<Color> pixels(std::size_t(width) * height);
+
+                for (int threads : threadCounts) {
+                    ThreadPool pool(threads);
+                    RenderStats stats;
+                    double renderTime = 0;
+
+                    // Best of repeat renders
+                    for (int r = 0; r < repeat; ++r) {
+                        start = std::chrono::steady_clock::now();
+                        stats = scene.render(
+                            camera, {0, 0, width, height},
+                            reinterpret_cast<unsigned char *>(pixels.data()),
+                            pool);
+                        const double elapsed = milliseconds_since(start);
+                        if (r == 0 || elapsed < renderTime)
+                            renderTime = elapsed;
+                    }
+
+                    const unsigned long rays = std::size_t(width) * height +
+                                               stats.shadowRays +
+                                               stats.mirrorRays;
+
+                    out << sweep.parameter << "," << value << ","
+                        << pool.size() << "," << params.triangles() << ","
+                        << params.spheres << "," << params.lights << ","
+                        << params.depth << "," << width * height << ","
+                        << loadTime << "," << renderTime << "," << rays
+                        << "," << rays / (renderTime * 1e3) << std::endl;
+
+                    std::cerr << sweep.parameter << "=" << value << ", "
+                              << pool.size() << " threads: " << renderTime
+                              << " ms\n";
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << "\n";
+        std::remove(scenePath);
+        return 1;
+    }
+
+    std::remove(scenePath);
+
+    return 0;
+}
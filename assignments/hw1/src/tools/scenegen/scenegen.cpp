@@ -0,0 +1,71 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "SceneGenerator.h"
+
+// Writes a random hw1 scene of the requested size, for charting how the
+// tracer scales. See scaling.cpp for a driver that sweeps the sizes.
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [--spheres N] [--soup N] [--meshes N] [--mesh-faces N]\n"
+              << "           [--lights N] [--depth N] [--size W H]"
+              << " [--seed N]\n"
+              << "           [--image NAME] [scene.xml]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    SceneParams params;
+    const char *path = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--spheres") && i + 1 < argc) {
+            params.spheres = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--soup") && i + 1 < argc) {
+            params.soupTriangles = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--meshes") && i + 1 < argc) {
+            params.meshes = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--mesh-faces") && i + 1 < argc) {
+            params.meshFaces = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--lights") && i + 1 < argc) {
+            params.lights = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+            params.depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 2 < argc) {
+            params.width = atoi(argv[++i]);
+            params.height = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            params.seed = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            params.imageName = argv[++i];
+        } else if (argv[i][0] == '-' || path) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (params.width <= 0 || params.height <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!path) {
+        write_scene(std::cout, params);
+        return 0;
+    }
+
+    std::ofstream file(path);
+    write_scene(file, params);
+    if (!file.flush()) {
+        std::cerr << argv[0] << ": cannot write " << path << "\n";
+        return 1;
+    }
+
+    return 0;
+}